@@ -0,0 +1,139 @@
+/**
+ * Benchmark for the node.js binding.
+ *
+ * Uses the same datasets as the native benchmark (bench/kdtree-bench.c) and
+ * writes one line of JSON per dataset and tree size.
+ *
+ *   node bench/bench.js [sizes] [queries]
+ *
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+var kd = require('../build/Release/kdtree');
+
+var sizes = (process.argv[2] || "10000,100000").split(",").map(Number);
+var numQueries = Number(process.argv[3] || 10000);
+var NUM_CLUSTERS = 32, RANGE_HITS = 10, KNN = 10;
+
+// Deterministic generator, so results are comparable between runs
+var seed = 12345;
+function rnd() {
+  seed = (seed * 1103515245 + 12345) % 2147483648;
+  return seed / 2147483648;
+}
+function rndNormal() {
+  return Math.sqrt(-2 * Math.log(rnd() + 1e-300)) * Math.cos(2 * Math.PI * rnd());
+}
+
+function uniform(n, dim) {
+  var pts = [];
+  for (var i = 0; i < n; i++) {
+    var p = [];
+    for (var j = 0; j < dim; j++) p.push(rnd());
+    pts.push(p);
+  }
+  return pts;
+}
+
+function clustered(n, dim) {
+  var centres = uniform(NUM_CLUSTERS, dim), pts = [];
+  for (var i = 0; i < n; i++) {
+    var c = centres[Math.floor(rnd() * NUM_CLUSTERS)], p = [];
+    for (var j = 0; j < dim; j++) p.push(c[j] + 0.01 * rndNormal());
+    pts.push(p);
+  }
+  return pts;
+}
+
+function sorted(n, dim) {
+  return uniform(n, dim).sort(function(a, b) { return a[0] - b[0]; });
+}
+
+var datasets = [
+  { name: "uniform", dim: 3, gen: uniform },
+  { name: "clustered", dim: 3, gen: clustered },
+  { name: "sorted", dim: 3, gen: sorted },
+  { name: "highdim", dim: 16, gen: uniform }
+];
+
+function nowUs() {
+  var t = process.hrtime();
+  return t[0] * 1e6 + t[1] / 1e3;
+}
+
+function latency(lat) {
+  lat.sort(function(a, b) { return a - b; });
+  var sum = lat.reduce(function(a, b) { return a + b; }, 0);
+  function pct(p) { return +lat[Math.floor(lat.length * p)].toFixed(3); }
+  return { mean: +(sum / lat.length).toFixed(3), p50: pct(0.5), p90: pct(0.9),
+           p99: pct(0.99), max: +lat[lat.length - 1].toFixed(3) };
+}
+
+// Volume of the unit ball, from V(d) = 2 * PI / d * V(d - 2)
+function ballVolume(dim) {
+  return dim === 0 ? 1 : dim === 1 ? 2 : 2 * Math.PI / dim * ballVolume(dim - 2);
+}
+
+// Radius of a ball holding about RANGE_HITS points of the unit cube
+function rangeRadius(n, dim) {
+  return Math.pow(RANGE_HITS / (n * ballVolume(dim)), 1 / dim);
+}
+
+function run(ds, n) {
+  var pts = ds.gen(n, ds.dim), queries = [], i, j, t, lat, hits = 0;
+
+  for (i = 0; i < numQueries; i++) {
+    var p = pts[Math.floor(rnd() * n)], q = [];
+    for (j = 0; j < ds.dim; j++) q.push(p[j] + 0.001 * rndNormal());
+    queries.push(q);
+  }
+
+  if (global.gc) global.gc();
+  var mem0 = process.memoryUsage().rss;
+  var tree = new kd.KDTree(ds.dim);
+  t = nowUs();
+  for (i = 0; i < n; i++) tree.insert.apply(tree, pts[i]);
+  var buildMs = (nowUs() - t) / 1e3;
+  var result = { dataset: ds.name, dim: ds.dim, n: n, queries: numQueries,
+                 build_ms: +buildMs.toFixed(3),
+                 native_bytes: tree.stats().nativeBytes,
+                 rss_delta_bytes: process.memoryUsage().rss - mem0 };
+
+  lat = [];
+  for (i = 0; i < numQueries; i++) {
+    t = nowUs();
+    tree.nearest.apply(tree, queries[i]);
+    lat.push(nowUs() - t);
+  }
+  result.nearest_us = latency(lat);
+
+  lat = [];
+  for (i = 0; i < numQueries; i++) {
+    var args = queries[i].concat([KNN]);
+    t = nowUs();
+    tree.nearestN.apply(tree, args);
+    lat.push(nowUs() - t);
+  }
+  result.knn_us = latency(lat);
+
+  var radius = rangeRadius(n, ds.dim);
+  lat = [];
+  for (i = 0; i < numQueries; i++) {
+    var args = queries[i].concat([radius]);
+    t = nowUs();
+    hits += tree.nearestRange.apply(tree, args).length;
+    lat.push(nowUs() - t);
+  }
+  result.range_us = latency(lat);
+  result.range_radius = radius;
+  result.range_hits = +(hits / numQueries).toFixed(2);
+
+  console.log(JSON.stringify(result));
+}
+
+datasets.forEach(function(ds) {
+  sizes.forEach(function(n) { run(ds, n); });
+});
@@ -0,0 +1,383 @@
+/**
+ * Native benchmark for the kdtree library.
+ *
+ * Builds trees from several synthetic datasets and measures build time,
+ * memory, and per-query latency percentiles. Each result is written as one
+ * line of JSON, so runs from different releases can be compared directly.
+ *
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "kdtree.h"
+
+#ifndef M_PI
+#define M_PI			3.14159265358979323846
+#endif
+
+#define NUM_CLUSTERS	32
+#define RANGE_HITS		10.0	/* expected number of points per range query */
+#define KNN				10		/* number of neighbours per kNN query */
+
+struct dataset {
+	const char *name;
+	int dim;
+	void (*gen)(double *pts, int n, int dim);
+};
+
+static unsigned long long rng_state = 88172645463325252ULL;
+
+static double rnd(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return (rng_state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double rnd_normal(void)
+{
+	double u = rnd(), v = rnd();
+	return sqrt(-2.0 * log(u + 1e-300)) * cos(2.0 * M_PI * v);
+}
+
+static void gen_uniform(double *pts, int n, int dim)
+{
+	int i;
+	for(i=0; i<n * dim; i++) {
+		pts[i] = rnd();
+	}
+}
+
+static void gen_clustered(double *pts, int n, int dim)
+{
+	double centres[NUM_CLUSTERS * 16];
+	int i, j, c;
+
+	for(i=0; i<NUM_CLUSTERS * dim; i++) {
+		centres[i] = rnd();
+	}
+	for(i=0; i<n; i++) {
+		c = (int)(rnd() * NUM_CLUSTERS);
+		for(j=0; j<dim; j++) {
+			pts[i * dim + j] = centres[c * dim + j] + 0.01 * rnd_normal();
+		}
+	}
+}
+
+static int cmp_first(const void *a, const void *b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* uniform points, inserted in order of their first coordinate */
+static void gen_sorted(double *pts, int n, int dim)
+{
+	gen_uniform(pts, n, dim);
+	qsort(pts, n, dim * sizeof *pts, cmp_first);
+}
+
+/* uniform points 100 times wider along the first axis than the others,
+ * like longitude and latitude over a narrow band */
+static void gen_skewed(double *pts, int n, int dim)
+{
+	int i;
+
+	gen_uniform(pts, n, dim);
+	for(i=0; i<n; i++) {
+		pts[i * dim] *= 100.0;
+	}
+}
+
+static struct dataset datasets[] = {
+	{"uniform", 3, gen_uniform},
+	{"clustered", 3, gen_clustered},
+	{"sorted", 3, gen_sorted},
+	{"highdim", 16, gen_uniform},
+	{"skewed", 3, gen_skewed},
+	{0, 0, 0}
+};
+
+static const char *split_names[] = {"cycle", "spread", "variance", "midpoint"};
+
+static struct kdstats stats;
+
+#ifdef KD_STATS
+
+static void print_stats(FILE *out, const char *name, int nq)
+{
+	fprintf(out, ",\"%s_stats\":{\"nodes\":%.2f,\"dists\":%.2f,\"pruned\":%.2f}",
+			name, (double)stats.nodes / nq, (double)stats.dists / nq, (double)stats.pruned / nq);
+	memset(&stats, 0, sizeof stats);
+}
+#endif
+
+static double now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* resident set size in bytes, or 0 if it can't be determined */
+static long rss_bytes(void)
+{
+	long pages = 0, resident = 0;
+	FILE *fp = fopen("/proc/self/statm", "r");
+
+	if(fp) {
+		if(fscanf(fp, "%ld %ld", &pages, &resident) != 2) {
+			resident = 0;
+		}
+		fclose(fp);
+	}
+	return resident * 4096;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	return cmp_first(a, b);
+}
+
+static void print_latency(FILE *out, const char *name, double *lat, int n)
+{
+	double sum = 0;
+	int i;
+
+	qsort(lat, n, sizeof *lat, cmp_double);
+	for(i=0; i<n; i++) {
+		sum += lat[i];
+	}
+	fprintf(out, ",\"%s_us\":{\"mean\":%.3f,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f}",
+			name, sum / n, lat[n / 2], lat[(int)(n * 0.9)], lat[(int)(n * 0.99)], lat[n - 1]);
+}
+
+/* radius of a ball which holds about RANGE_HITS points of a uniform unit cube */
+static double range_radius(int n, int dim)
+{
+	double ball = pow(M_PI, dim / 2.0) / tgamma(dim / 2.0 + 1.0);
+	return pow(RANGE_HITS / (n * ball), 1.0 / dim);
+}
+
+static int run(FILE *out, const struct dataset *ds, int n, int nq)
+{
+	struct kdtree *kd;
+	struct kdres *res;
+	double *pts, *queries, *lat, radius, t, build_ms;
+	long rss0, rss1, hits = 0;
+	int i, j, *ids, dim = ds->dim;
+
+	pts = malloc((size_t)n * dim * sizeof *pts);
+	queries = malloc((size_t)nq * dim * sizeof *queries);
+	lat = malloc(nq * sizeof *lat);
+	ids = malloc(nq * sizeof *ids);
+	if(!pts || !queries || !lat || !ids) {
+		fprintf(stderr, "out of memory\n");
+		return -1;
+	}
+	ds->gen(pts, n, dim);
+
+	/* queries follow the data distribution: jittered copies of data points */
+	for(i=0; i<nq; i++) {
+		const double *p = pts + (size_t)(rnd() * n) * dim;
+		for(j=0; j<dim; j++) {
+			queries[i * dim + j] = p[j] + 0.001 * rnd_normal();
+		}
+	}
+
+	rss0 = rss_bytes();
+	t = now_us();
+	kd = kd_create(dim);
+	for(i=0; i<n; i++) {
+		if(kd_insert(kd, pts + (size_t)i * dim, 0) == -1) {
+			fprintf(stderr, "insert failed\n");
+			return -1;
+		}
+	}
+	build_ms = (now_us() - t) / 1e3;
+	rss1 = rss_bytes();
+
+	fprintf(out, "{\"dataset\":\"%s\",\"dim\":%d,\"n\":%d,\"queries\":%d", ds->name, dim, n, nq);
+	fprintf(out, ",\"build_ms\":%.3f,\"mem_bytes\":%lu,\"rss_delta_bytes\":%ld",
+			build_ms, (unsigned long)kd_mem_usage(kd), rss1 - rss0);
+
+	kd_stats_attach(&stats);
+	for(i=0; i<nq; i++) {
+		t = now_us();
+		res = kd_nearest(kd, queries + i * dim);
+		lat[i] = now_us() - t;
+		kd_res_free(res);
+	}
+	print_latency(out, "nearest", lat, nq);
+#ifdef KD_STATS
+	print_stats(out, "nearest", nq);
+#endif
+
+	/* the same queries as one batch, run in Morton order */
+	t = now_us();
+	if(kd_nearest_batch(kd, queries, nq, 0, ids, 0) == -1) {
+		fprintf(stderr, "batch failed\n");
+		return -1;
+	}
+	fprintf(out, ",\"batch_nearest_us\":{\"mean\":%.3f}", (now_us() - t) / nq);
+#ifdef KD_STATS
+	print_stats(out, "batch_nearest", nq);
+#endif
+
+	for(i=0; i<nq; i++) {
+		t = now_us();
+		res = kd_nearest_n(kd, queries + i * dim, KNN);
+		lat[i] = now_us() - t;
+		kd_res_free(res);
+	}
+	print_latency(out, "knn", lat, nq);
+#ifdef KD_STATS
+	print_stats(out, "knn", nq);
+#endif
+
+	radius = range_radius(n, dim);
+	for(i=0; i<nq; i++) {
+		t = now_us();
+		res = kd_nearest_range(kd, queries + i * dim, radius);
+		lat[i] = now_us() - t;
+		hits += kd_res_size(res);
+		kd_res_free(res);
+	}
+	print_latency(out, "range", lat, nq);
+#ifdef KD_STATS
+	print_stats(out, "range", nq);
+#endif
+
+	/* the same queries once the nodes are laid out in search order */
+	t = now_us();
+	if(kd_optimize(kd) == -1) {
+		fprintf(stderr, "optimize failed\n");
+		return -1;
+	}
+	fprintf(out, ",\"optimize_ms\":%.3f", (now_us() - t) / 1e3);
+	for(i=0; i<nq; i++) {
+		t = now_us();
+		res = kd_nearest(kd, queries + i * dim);
+		lat[i] = now_us() - t;
+		kd_res_free(res);
+	}
+	print_latency(out, "optimized_nearest", lat, nq);
+#ifdef KD_STATS
+	print_stats(out, "optimized_nearest", nq);
+#endif
+
+	/* the same queries on balanced rebuilds by each split policy */
+	for(j=KD_SPLIT_CYCLE; j<=KD_SPLIT_MIDPOINT; j++) {
+		char name[32];
+
+		t = now_us();
+		if(kd_split(kd, j) == -1 || kd_rebuild(kd) == -1) {
+			fprintf(stderr, "rebuild failed\n");
+			return -1;
+		}
+		fprintf(out, ",\"split_%s_ms\":%.3f", split_names[j], (now_us() - t) / 1e3);
+		for(i=0; i<nq; i++) {
+			t = now_us();
+			res = kd_nearest(kd, queries + i * dim);
+			lat[i] = now_us() - t;
+			kd_res_free(res);
+		}
+		sprintf(name, "split_%s_nearest", split_names[j]);
+		print_latency(out, name, lat, nq);
+#ifdef KD_STATS
+		print_stats(out, name, nq);
+#endif
+	}
+
+	/* the same queries by linear scan, and always walking the tree */
+	for(j=KD_SCAN_ALWAYS; j<=KD_SCAN_NEVER; j++) {
+		const char *name = j == KD_SCAN_ALWAYS ? "scan_always_nearest" : "scan_never_nearest";
+
+		kd_scan(kd, j);
+		for(i=0; i<nq; i++) {
+			t = now_us();
+			res = kd_nearest(kd, queries + i * dim);
+			lat[i] = now_us() - t;
+			kd_res_free(res);
+		}
+		print_latency(out, name, lat, nq);
+	}
+	kd_stats_attach(0);
+	fprintf(out, ",\"range_radius\":%g,\"range_hits\":%.2f}\n", radius, (double)hits / nq);
+	fflush(out);
+
+	kd_free(kd);
+	free(pts);
+	free(queries);
+	free(lat);
+	free(ids);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n sizes] [-q queries] [-d dataset] [-o file]\n", prog);
+	fprintf(stderr, "  -n  comma separated list of tree sizes (default 10000,100000,1000000)\n");
+	fprintf(stderr, "  -q  number of queries per measurement (default 10000)\n");
+	fprintf(stderr, "  -d  only run one dataset: uniform, clustered, sorted, highdim or skewed\n");
+	fprintf(stderr, "  -o  write results to a file instead of stdout\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *sizes = "10000,100000,1000000", *only = 0;
+	FILE *out = stdout;
+	int i, nq = 10000;
+
+	for(i=1; i<argc; i++) {
+		if(i + 1 < argc && strcmp(argv[i], "-n") == 0) {
+			sizes = argv[++i];
+		} else if(i + 1 < argc && strcmp(argv[i], "-q") == 0) {
+			nq = atoi(argv[++i]);
+		} else if(i + 1 < argc && strcmp(argv[i], "-d") == 0) {
+			only = argv[++i];
+		} else if(i + 1 < argc && strcmp(argv[i], "-o") == 0) {
+			if(!(out = fopen(argv[++i], "w"))) {
+				perror(argv[i]);
+				return 1;
+			}
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if(nq < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	for(i=0; datasets[i].name; i++) {
+		const char *s = sizes;
+
+		if(only && strcmp(only, datasets[i].name) != 0) {
+			continue;
+		}
+		while(*s) {
+			int n = atoi(s);
+			if(n > 0 && run(out, datasets + i, n, nq) == -1) {
+				return 1;
+			}
+			while(*s && *s != ',') s++;
+			if(*s) s++;
+		}
+	}
+
+	if(out != stdout) {
+		fclose(out);
+	}
+	return 0;
+}
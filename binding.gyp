@@ -1,9 +1,27 @@
 {
+  "variables": {
+    "kdtree_stats%": 0
+  },
   "targets": [
     {
       "target_name": "kdtree",
-      "sources": [ "src/lib/kdtree.c", "src/node-kdtree.cc" ],
-      "include_dirs": [ "./src/lib", "<!(node -e \"require('nan')\")" ]
+      "sources": [ "src/lib/kdtree.c", "src/lib/kddyn.c", "src/lib/kdshard.c",
+                   "src/node-kdtree.cc", "src/node-kdtree-dynamic.cc",
+                   "src/node-kdtree-sharded.cc" ],
+      "include_dirs": [ "./src/lib", "<!(node -e \"require('nan')\")" ],
+      "conditions": [
+        [ "kdtree_stats==1", { "defines": [ "KD_STATS" ] } ],
+        [ "OS==\"win\"", { "defines": [ "NO_PTHREADS" ] } ]
+      ]
+    },
+    {
+      "target_name": "kdtree-build",
+      "type": "executable",
+      "sources": [ "src/lib/kdtree.c", "tools/kdtree-build.c" ],
+      "include_dirs": [ "./src/lib" ],
+      "conditions": [
+        [ "OS==\"win\"", { "defines": [ "NO_PTHREADS" ] } ]
+      ]
     }
   ]
 }
@@ -0,0 +1,269 @@
+/**
+ * Logarithmic-method dynamic index built from static kd-trees.
+ *
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "kddyn.h"
+
+#define DEFAULT_BUFSIZE	256
+#define MAX_LEVELS		32
+
+#define SQ(x)			((x) * (x))
+
+/* A set of points. For the levels, "tree" is a balanced tree built from the
+ * points, whose ids are the points' indices in "pos" and "data".
+ */
+struct kdlevel {
+	struct kdtree *tree;
+	double *pos;
+	void **data;
+	int size;
+};
+
+struct kddyn {
+	int dim, bufsize;
+	struct kdlevel buf;
+	struct kdlevel levels[MAX_LEVELS];
+	void (*destr)(void*);
+};
+
+static void level_free(struct kdlevel *lvl)
+{
+	if(lvl->tree) {
+		kd_free(lvl->tree);
+	}
+	free(lvl->pos);
+	free(lvl->data);
+	memset(lvl, 0, sizeof *lvl);
+}
+
+struct kddyn *kddyn_create(int k, int bufsize)
+{
+	struct kddyn *dyn;
+
+	if(!(dyn = calloc(1, sizeof *dyn))) {
+		return 0;
+	}
+	dyn->dim = k;
+	dyn->bufsize = bufsize > 0 ? bufsize : DEFAULT_BUFSIZE;
+
+	if(!(dyn->buf.pos = malloc(dyn->bufsize * k * sizeof *dyn->buf.pos)) ||
+			!(dyn->buf.data = malloc(dyn->bufsize * sizeof *dyn->buf.data))) {
+		level_free(&dyn->buf);
+		free(dyn);
+		return 0;
+	}
+	return dyn;
+}
+
+void kddyn_free(struct kddyn *dyn)
+{
+	int i, j;
+
+	if(!dyn) return;
+
+	for(i=-1; i<MAX_LEVELS; i++) {
+		struct kdlevel *lvl = i < 0 ? &dyn->buf : &dyn->levels[i];
+
+		if(dyn->destr) {
+			for(j=0; j<lvl->size; j++) {
+				dyn->destr(lvl->data[j]);
+			}
+		}
+		level_free(lvl);
+	}
+	free(dyn);
+}
+
+void kddyn_data_destructor(struct kddyn *dyn, void (*destr)(void*))
+{
+	dyn->destr = destr;
+}
+
+/* merges the full buffer and all levels below the first empty one into
+ * that level */
+static int flush(struct kddyn *dyn)
+{
+	struct kdlevel merged;
+	int i, j, n, dim = dyn->dim;
+
+	for(j=0; j<MAX_LEVELS && dyn->levels[j].size; j++);
+	if(j == MAX_LEVELS) {
+		return -1;
+	}
+
+	merged.size = dyn->bufsize << j;
+	merged.tree = kd_create(dim);
+	merged.pos = malloc((size_t)merged.size * dim * sizeof *merged.pos);
+	merged.data = malloc(merged.size * sizeof *merged.data);
+	if(!merged.tree || !merged.pos || !merged.data) {
+		level_free(&merged);
+		return -1;
+	}
+
+	n = 0;
+	for(i=-1; i<j; i++) {
+		struct kdlevel *lvl = i < 0 ? &dyn->buf : &dyn->levels[i];
+
+		memcpy(merged.pos + (size_t)n * dim, lvl->pos, (size_t)lvl->size * dim * sizeof *lvl->pos);
+		memcpy(merged.data + n, lvl->data, lvl->size * sizeof *lvl->data);
+		n += lvl->size;
+	}
+	if(kd_build(merged.tree, merged.pos, merged.data, merged.size) == -1) {
+		level_free(&merged);
+		return -1;
+	}
+
+	for(i=0; i<j; i++) {
+		level_free(&dyn->levels[i]);
+	}
+	dyn->levels[j] = merged;
+	dyn->buf.size = 0;
+	return 0;
+}
+
+int kddyn_insert(struct kddyn *dyn, const double *pos, void *data)
+{
+	if(dyn->buf.size == dyn->bufsize && flush(dyn) == -1) {
+		return -1;
+	}
+
+	memcpy(dyn->buf.pos + dyn->buf.size * dyn->dim, pos, dyn->dim * sizeof *pos);
+	dyn->buf.data[dyn->buf.size++] = data;
+	return 0;
+}
+
+int kddyn_size(struct kddyn *dyn)
+{
+	int i, size = dyn->buf.size;
+
+	for(i=0; i<MAX_LEVELS; i++) {
+		size += dyn->levels[i].size;
+	}
+	return size;
+}
+
+size_t kddyn_mem_usage(struct kddyn *dyn)
+{
+	size_t point_size = dyn->dim * sizeof(double) + sizeof(void*);
+	size_t mem = sizeof *dyn + dyn->bufsize * point_size;
+	int i;
+
+	for(i=0; i<MAX_LEVELS; i++) {
+		if(dyn->levels[i].tree) {
+			mem += kd_mem_usage(dyn->levels[i].tree) + dyn->levels[i].size * point_size;
+		}
+	}
+	return mem;
+}
+
+static double dist_sq(const double *a, const double *b, int dim)
+{
+	double d = 0;
+	int i;
+
+	for(i=0; i<dim; i++) {
+		d += SQ(a[i] - b[i]);
+	}
+	return d;
+}
+
+/* adds a point to the ordered list of the "num" nearest points found */
+static void hits_insert(struct kddyn_hit *hits, int *count, int num,
+		const double *pos, void *data, double d)
+{
+	int i;
+
+	if(*count == num && d >= hits[num - 1].dist_sq) {
+		return;
+	}
+	i = *count < num ? (*count)++ : num - 1;
+	while(i > 0 && hits[i - 1].dist_sq > d) {
+		hits[i] = hits[i - 1];
+		i--;
+	}
+	hits[i].pos = pos;
+	hits[i].data = data;
+	hits[i].dist_sq = d;
+}
+
+int kddyn_nearest_n(struct kddyn *dyn, const double *pos, int num, struct kddyn_hit *hits)
+{
+	struct kdres *res;
+	int i, j, count = 0, dim = dyn->dim;
+
+	if(num <= 0) return 0;
+
+	for(j=0; j<dyn->buf.size; j++) {
+		const double *p = dyn->buf.pos + j * dim;
+		hits_insert(hits, &count, num, p, dyn->buf.data[j], dist_sq(p, pos, dim));
+	}
+
+	for(i=0; i<MAX_LEVELS; i++) {
+		struct kdlevel *lvl = &dyn->levels[i];
+
+		if(!lvl->tree) continue;
+		if(!(res = kd_nearest_n(lvl->tree, pos, num))) {
+			return -1;
+		}
+		while(!kd_res_end(res)) {
+			int id = kd_res_item_id(res);
+			const double *p = lvl->pos + (size_t)id * dim;
+
+			hits_insert(hits, &count, num, p, lvl->data[id], dist_sq(p, pos, dim));
+			kd_res_next(res);
+		}
+		kd_res_free(res);
+	}
+	return count;
+}
+
+int kddyn_nearest_range(struct kddyn *dyn, const double *pos, double range,
+		int (*func)(const struct kddyn_hit*, void*), void *arg)
+{
+	struct kddyn_hit hit;
+	struct kdres *res;
+	int i, j, err = 0, count = 0, dim = dyn->dim;
+
+	for(j=0; j<dyn->buf.size; j++) {
+		hit.pos = dyn->buf.pos + j * dim;
+		hit.data = dyn->buf.data[j];
+		hit.dist_sq = dist_sq(hit.pos, pos, dim);
+		if(hit.dist_sq <= SQ(range)) {
+			if(func(&hit, arg)) {
+				return -1;
+			}
+			count++;
+		}
+	}
+
+	for(i=0; i<MAX_LEVELS; i++) {
+		struct kdlevel *lvl = &dyn->levels[i];
+
+		if(!lvl->tree) continue;
+		if(!(res = kd_nearest_range(lvl->tree, pos, range))) {
+			return -1;
+		}
+		while(!err && !kd_res_end(res)) {
+			int id = kd_res_item_id(res);
+
+			hit.pos = lvl->pos + (size_t)id * dim;
+			hit.data = lvl->data[id];
+			hit.dist_sq = dist_sq(hit.pos, pos, dim);
+			err = func(&hit, arg);
+			count++;
+			kd_res_next(res);
+		}
+		kd_res_free(res);
+		if(err) {
+			return -1;
+		}
+	}
+	return count;
+}
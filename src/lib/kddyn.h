@@ -0,0 +1,68 @@
+/**
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+#ifndef _KDDYN_H_
+#define _KDDYN_H_
+
+#include "kdtree.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A dynamic index for a stream of insertions, using the logarithmic method
+ * of Bentley and Saxe. New points go into a small unsorted buffer; when it
+ * is full, the buffer is merged with the smaller levels into a balanced
+ * kd-tree, so that level i is either empty or holds bufsize * 2^i points.
+ * Insertions take amortized O(log^2 n) time, and queries search the buffer
+ * and each of the O(log n) levels.
+ */
+struct kddyn;
+
+/* a point found by a search. "pos" remains valid until the next insertion */
+struct kddyn_hit {
+	const double *pos;
+	void *data;
+	double dist_sq;
+};
+
+/* create a dynamic index for "k"-dimensional data with an insert buffer of
+ * "bufsize" points, or a default size if bufsize is not positive */
+struct kddyn *kddyn_create(int k, int bufsize);
+
+/* free the index, calling the data destructor on all data pointers */
+void kddyn_free(struct kddyn *dyn);
+
+/* see kd_data_destructor */
+void kddyn_data_destructor(struct kddyn *dyn, void (*destr)(void*));
+
+/* insert a point, returns 0 on success or -1 on error */
+int kddyn_insert(struct kddyn *dyn, const double *pos, void *data);
+
+/* returns the number of points in the index */
+int kddyn_size(struct kddyn *dyn);
+
+/* returns the number of bytes allocated by the index, see kd_mem_usage */
+size_t kddyn_mem_usage(struct kddyn *dyn);
+
+/* Find the "num" nearest points, storing them in "hits" ordered by
+ * increasing distance. Returns the number of points found, or -1 on error.
+ */
+int kddyn_nearest_n(struct kddyn *dyn, const double *pos, int num, struct kddyn_hit *hits);
+
+/* Find all points within "range", calling "func" for each of them in no
+ * particular order; a non-zero return value from it aborts the search.
+ * Returns the number of points found, or -1 on error or abort.
+ */
+int kddyn_nearest_range(struct kddyn *dyn, const double *pos, double range,
+		int (*func)(const struct kddyn_hit*, void*), void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* _KDDYN_H_ */
@@ -0,0 +1,553 @@
+/**
+ * Spatially sharded index of kd-trees, with parallel inserts.
+ *
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "kdshard.h"
+
+#ifndef NO_PTHREADS
+#include <pthread.h>
+#endif
+
+#define PARALLEL_MIN	1024	/* smallest batch inserted by several threads */
+
+#define SQ(x)			((x) * (x))
+
+/* A cut of the partition: points with pos[dir] < value go to the left.
+ * Children are indices of cuts, or -1 - i for shard i.
+ */
+struct cut {
+	int dir;
+	double value;
+	int left, right;
+};
+
+/* A shard, with the bounding box of its points, and the part of a batch of
+ * inserts routed to it: the indices of its points in "items".
+ */
+struct shard {
+	struct kdtree *tree;
+	double *min, *max;
+	int size;
+
+	const struct kdshards *owner;
+	const double *pos;
+	void **data;
+	char *inserted;
+	const int *items;
+	int nitems, added;
+};
+
+struct kdshards {
+	int dim, count;
+	struct cut *cuts;
+	struct shard *shards;
+};
+
+static struct kdshards *shards_alloc(int k, int count)
+{
+	struct kdshards *s;
+	int i;
+
+	if(k <= 0 || count <= 0 || !(s = calloc(1, sizeof *s))) {
+		return 0;
+	}
+	s->dim = k;
+	s->count = count;
+	if(!(s->cuts = malloc((count > 1 ? count - 1 : 1) * sizeof *s->cuts)) ||
+			!(s->shards = calloc(count, sizeof *s->shards))) {
+		kdshards_free(s);
+		return 0;
+	}
+	for(i=0; i<count; i++) {
+		struct shard *sh = s->shards + i;
+
+		if(!(sh->tree = kd_create(k)) || !(sh->min = malloc(2 * k * sizeof *sh->min))) {
+			kdshards_free(s);
+			return 0;
+		}
+		sh->max = sh->min + k;
+	}
+	return s;
+}
+
+void kdshards_free(struct kdshards *s)
+{
+	int i;
+
+	if(!s) return;
+
+	if(s->shards) {
+		for(i=0; i<s->count; i++) {
+			if(s->shards[i].tree) {
+				kd_free(s->shards[i].tree);
+			}
+			free(s->shards[i].min);
+		}
+	}
+	free(s->shards);
+	free(s->cuts);
+	free(s);
+}
+
+static void swap_rows(double *a, double *b, int dim)
+{
+	double tmp;
+	int i;
+
+	for(i=0; i<dim; i++) {
+		tmp = a[i];
+		a[i] = b[i];
+		b[i] = tmp;
+	}
+}
+
+/* reorders the n points in "rows" so that the k-th one is in place by
+ * coordinate "dir", with none greater before it and none less after it */
+static void select_row(double *rows, int n, int k, int dir, int dim)
+{
+	int lo = 0, hi = n - 1, i, j;
+	double pivot;
+
+	while(lo < hi) {
+		pivot = rows[(size_t)(lo + (hi - lo) / 2) * dim + dir];
+		i = lo;
+		j = hi;
+		while(i <= j) {
+			while(rows[(size_t)i * dim + dir] < pivot) i++;
+			while(rows[(size_t)j * dim + dir] > pivot) j--;
+			if(i <= j) {
+				swap_rows(rows + (size_t)i * dim, rows + (size_t)j * dim, dim);
+				i++;
+				j--;
+			}
+		}
+		if(k <= j) {
+			hi = j;
+		} else if(k >= i) {
+			lo = i;
+		} else {
+			break;
+		}
+	}
+}
+
+/* splits "n" sample points (at least "count") into "count" shards, cutting
+ * along the axis of their widest spread. Returns the child index of the
+ * new cut or shard. */
+static int split_sample(struct kdshards *s, double *rows, int n, int count, int *ncuts, int *nshards)
+{
+	struct cut *c;
+	int i, j, m, lc, dim = s->dim;
+	double lo, hi, spread = -1.0;
+
+	if(count == 1) {
+		return -1 - (*nshards)++;
+	}
+	c = s->cuts + (*ncuts)++;
+	c->dir = 0;
+	for(j=0; j<dim; j++) {
+		lo = hi = rows[j];
+		for(i=1; i<n; i++) {
+			double x = rows[(size_t)i * dim + j];
+			if(x < lo) lo = x;
+			if(x > hi) hi = x;
+		}
+		if(hi - lo > spread) {
+			spread = hi - lo;
+			c->dir = j;
+		}
+	}
+
+	/* as many points on each side as it has shards */
+	lc = count / 2;
+	m = (int)((double)n * lc / count);
+	select_row(rows, n, m, c->dir, dim);
+	c->value = rows[(size_t)m * dim + c->dir];
+	c->left = split_sample(s, rows, m, lc, ncuts, nshards);
+	c->right = split_sample(s, rows + (size_t)m * dim, n - m, count - lc, ncuts, nshards);
+	return (int)(c - s->cuts);
+}
+
+/* splits the box from "min" to "max" into "count" cells of equal volume,
+ * cutting its longest side */
+static int split_grid(struct kdshards *s, double *min, double *max, int count, int *ncuts, int *nshards)
+{
+	struct cut *c;
+	int j, lc;
+	double save;
+
+	if(count == 1) {
+		return -1 - (*nshards)++;
+	}
+	c = s->cuts + (*ncuts)++;
+	c->dir = 0;
+	for(j=1; j<s->dim; j++) {
+		if(max[j] - min[j] > max[c->dir] - min[c->dir]) {
+			c->dir = j;
+		}
+	}
+
+	lc = count / 2;
+	c->value = min[c->dir] + (max[c->dir] - min[c->dir]) * lc / count;
+	save = max[c->dir];
+	max[c->dir] = c->value;
+	c->left = split_grid(s, min, max, lc, ncuts, nshards);
+	max[c->dir] = save;
+	save = min[c->dir];
+	min[c->dir] = c->value;
+	c->right = split_grid(s, min, max, count - lc, ncuts, nshards);
+	min[c->dir] = save;
+	return (int)(c - s->cuts);
+}
+
+struct kdshards *kdshards_create(int k, int count, const double *sample, int nsample)
+{
+	struct kdshards *s;
+	double *rows;
+	int ncuts = 0, nshards = 0;
+
+	if(nsample < count || !(s = shards_alloc(k, count))) {
+		return 0;
+	}
+	if(!(rows = malloc((size_t)nsample * k * sizeof *rows))) {
+		kdshards_free(s);
+		return 0;
+	}
+	memcpy(rows, sample, (size_t)nsample * k * sizeof *rows);
+	split_sample(s, rows, nsample, count, &ncuts, &nshards);
+	free(rows);
+	return s;
+}
+
+struct kdshards *kdshards_create_grid(int k, int count, const double *min, const double *max)
+{
+	struct kdshards *s;
+	double *box;
+	int ncuts = 0, nshards = 0;
+
+	if(!(s = shards_alloc(k, count))) {
+		return 0;
+	}
+	if(!(box = malloc(2 * k * sizeof *box))) {
+		kdshards_free(s);
+		return 0;
+	}
+	memcpy(box, min, k * sizeof *box);
+	memcpy(box + k, max, k * sizeof *box);
+	split_grid(s, box, box + k, count, &ncuts, &nshards);
+	free(box);
+	return s;
+}
+
+void kdshards_data_destructor(struct kdshards *s, void (*destr)(void*))
+{
+	int i;
+
+	for(i=0; i<s->count; i++) {
+		kd_data_destructor(s->shards[i].tree, destr);
+	}
+}
+
+int kdshards_count(struct kdshards *s)
+{
+	return s->count;
+}
+
+int kdshards_size(struct kdshards *s, int i)
+{
+	int size = 0;
+
+	if(i >= 0) {
+		return i < s->count ? s->shards[i].size : 0;
+	}
+	for(i=0; i<s->count; i++) {
+		size += s->shards[i].size;
+	}
+	return size;
+}
+
+size_t kdshards_mem_usage(struct kdshards *s)
+{
+	size_t mem = sizeof *s + s->count * (sizeof(struct cut) + sizeof(struct shard) + 2 * s->dim * sizeof(double));
+	int i;
+
+	for(i=0; i<s->count; i++) {
+		mem += kd_mem_usage(s->shards[i].tree);
+	}
+	return mem;
+}
+
+/* returns the shard a point belongs to */
+static int route(const struct kdshards *s, const double *pos)
+{
+	int i = 0;
+
+	if(s->count == 1) {
+		return 0;
+	}
+	for(;;) {
+		const struct cut *c = s->cuts + i;
+
+		i = pos[c->dir] < c->value ? c->left : c->right;
+		if(i < 0) {
+			return -1 - i;
+		}
+	}
+}
+
+/* inserts the points of a batch routed to a shard */
+static void *shard_insert(void *arg)
+{
+	struct shard *sh = arg;
+	int i, j, dim = sh->owner->dim;
+
+	sh->added = 0;
+	for(i=0; i<sh->nitems; i++) {
+		int k = sh->items[i];
+		const double *p = sh->pos + (size_t)k * dim;
+
+		if(kd_insert(sh->tree, p, sh->data ? sh->data[k] : 0) == -1) {
+			continue;
+		}
+		for(j=0; j<dim; j++) {
+			if(!sh->size || p[j] < sh->min[j]) sh->min[j] = p[j];
+			if(!sh->size || p[j] > sh->max[j]) sh->max[j] = p[j];
+		}
+		sh->size++;
+		sh->added++;
+		if(sh->inserted) {
+			sh->inserted[k] = 1;
+		}
+	}
+	return 0;
+}
+
+int kdshards_insert(struct kdshards *s, const double *pos, void **data, int n, char *inserted)
+{
+	int *which, *items, *start;
+	int i, added = 0;
+#ifndef NO_PTHREADS
+	pthread_t *threads = 0;
+	char *started = 0;
+#endif
+
+	if(n <= 0) return 0;
+	if(inserted) {
+		memset(inserted, 0, n);
+	}
+
+	which = malloc(n * sizeof *which);
+	items = malloc(n * sizeof *items);
+	start = calloc(s->count + 1, sizeof *start);
+	if(!which || !items || !start) {
+		free(which);
+		free(items);
+		free(start);
+		return -1;
+	}
+
+	/* route the points, and group their indices by shard */
+	for(i=0; i<n; i++) {
+		which[i] = route(s, pos + (size_t)i * s->dim);
+		start[which[i] + 1]++;
+	}
+	for(i=0; i<s->count; i++) {
+		start[i + 1] += start[i];
+	}
+	for(i=0; i<n; i++) {
+		items[start[which[i]]++] = i;
+	}
+	for(i=s->count; i>0; i--) {
+		start[i] = start[i - 1];
+	}
+	start[0] = 0;
+
+	for(i=0; i<s->count; i++) {
+		struct shard *sh = s->shards + i;
+
+		sh->owner = s;
+		sh->pos = pos;
+		sh->data = data;
+		sh->inserted = inserted;
+		sh->items = items + start[i];
+		sh->nitems = start[i + 1] - start[i];
+		sh->added = 0;
+	}
+
+#ifndef NO_PTHREADS
+	/* one thread per shard, or inline if a thread can't be started */
+	if(n >= PARALLEL_MIN && s->count > 1) {
+		threads = malloc(s->count * sizeof *threads);
+		started = calloc(s->count, 1);
+	}
+	for(i=0; i<s->count; i++) {
+		if(!s->shards[i].nitems) continue;
+		if(!threads || !started || pthread_create(threads + i, 0, shard_insert, s->shards + i) != 0) {
+			shard_insert(s->shards + i);
+		} else {
+			started[i] = 1;
+		}
+	}
+	for(i=0; i<s->count; i++) {
+		if(started && started[i]) {
+			pthread_join(threads[i], 0);
+		}
+		added += s->shards[i].added;
+	}
+	free(threads);
+	free(started);
+#else
+	for(i=0; i<s->count; i++) {
+		shard_insert(s->shards + i);
+		added += s->shards[i].added;
+	}
+#endif
+
+	free(which);
+	free(items);
+	free(start);
+	return added;
+}
+
+/* the squared distance from a point to the bounding box of a shard */
+static double box_dist_sq(const struct shard *sh, const double *pos, int dim)
+{
+	double d = 0;
+	int i;
+
+	for(i=0; i<dim; i++) {
+		if(pos[i] < sh->min[i]) {
+			d += SQ(sh->min[i] - pos[i]);
+		} else if(pos[i] > sh->max[i]) {
+			d += SQ(pos[i] - sh->max[i]);
+		}
+	}
+	return d;
+}
+
+/* a shard to search, and the distance of its bounding box */
+struct probe {
+	int shard;
+	double dist_sq;
+};
+
+/* lists the non-empty shards within "limit_sq" of a point, nearest first */
+static int probe_shards(const struct kdshards *s, const double *pos, double limit_sq, struct probe *probes)
+{
+	int i, j, n = 0;
+	double d;
+
+	for(i=0; i<s->count; i++) {
+		if(!s->shards[i].size || (d = box_dist_sq(s->shards + i, pos, s->dim)) > limit_sq) {
+			continue;
+		}
+		for(j=n++; j>0 && probes[j - 1].dist_sq > d; j--) {
+			probes[j] = probes[j - 1];
+		}
+		probes[j].shard = i;
+		probes[j].dist_sq = d;
+	}
+	return n;
+}
+
+int kdshards_nearest_n(struct kdshards *s, const double *pos, int num,
+		struct kdshards_hit *hits, double *coords)
+{
+	struct probe *probes;
+	struct kdres *res;
+	double *p, d;
+	int i, j, np, count = 0, dim = s->dim;
+
+	if(num <= 0) return 0;
+	if(!(probes = malloc(s->count * sizeof *probes)) || !(p = malloc(dim * sizeof *p))) {
+		free(probes);
+		return -1;
+	}
+
+	np = probe_shards(s, pos, HUGE_VAL, probes);
+	for(i=0; i<np; i++) {
+		/* the remaining shards are all farther than the points found */
+		if(count == num && probes[i].dist_sq >= hits[num - 1].dist_sq) {
+			break;
+		}
+		if(!(res = kd_nearest_n(s->shards[probes[i].shard].tree, pos, num))) {
+			count = -1;
+			break;
+		}
+		while(!kd_res_end(res)) {
+			void *data = kd_res_item(res, p);
+
+			d = 0;
+			for(j=0; j<dim; j++) {
+				d += SQ(p[j] - pos[j]);
+			}
+			if(count < num || d < hits[num - 1].dist_sq) {
+				j = count < num ? count++ : num - 1;
+				while(j > 0 && hits[j - 1].dist_sq > d) {
+					hits[j] = hits[j - 1];
+					memcpy(coords + (size_t)j * dim, coords + (size_t)(j - 1) * dim, dim * sizeof *coords);
+					j--;
+				}
+				hits[j].data = data;
+				hits[j].dist_sq = d;
+				memcpy(coords + (size_t)j * dim, p, dim * sizeof *coords);
+			}
+			kd_res_next(res);
+		}
+		kd_res_free(res);
+	}
+
+	for(i=0; i<count; i++) {
+		hits[i].pos = coords + (size_t)i * dim;
+	}
+	free(probes);
+	free(p);
+	return count;
+}
+
+int kdshards_nearest_range(struct kdshards *s, const double *pos, double range,
+		int (*func)(const struct kdshards_hit*, void*), void *arg)
+{
+	struct kdshards_hit hit;
+	struct probe *probes;
+	struct kdres *res;
+	double *p;
+	int i, j, np, err = 0, count = 0, dim = s->dim;
+
+	if(!(probes = malloc(s->count * sizeof *probes)) || !(p = malloc(dim * sizeof *p))) {
+		free(probes);
+		return -1;
+	}
+
+	np = probe_shards(s, pos, SQ(range), probes);
+	for(i=0; !err && i<np; i++) {
+		if(!(res = kd_nearest_range(s->shards[probes[i].shard].tree, pos, range))) {
+			err = 1;
+			break;
+		}
+		while(!err && !kd_res_end(res)) {
+			hit.data = kd_res_item(res, p);
+			hit.pos = p;
+			hit.dist_sq = 0;
+			for(j=0; j<dim; j++) {
+				hit.dist_sq += SQ(p[j] - pos[j]);
+			}
+			err = func(&hit, arg);
+			count++;
+			kd_res_next(res);
+		}
+		kd_res_free(res);
+	}
+
+	free(probes);
+	free(p);
+	return err ? -1 : count;
+}
@@ -0,0 +1,88 @@
+/**
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+#ifndef _KDSHARD_H_
+#define _KDSHARD_H_
+
+#include "kdtree.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* An index which splits space into a fixed number of shards, each with a
+ * kd-tree of its own. The shards are the cells of a partition of space by
+ * axis-parallel cuts, placed at medians of a sample of points or, without
+ * a sample, at regular intervals of a box. A batch of points is routed to
+ * the shards first, and then each shard inserts its points on a thread of
+ * its own, so that inserts scale with the number of cores. Searches only
+ * visit the shards whose points may be close enough, by the bounding box
+ * of the points each shard holds, and merge their results.
+ */
+struct kdshards;
+
+/* a point found by a search. "pos" points into the coordinates passed to
+ * kdshards_nearest_n, and is only valid during the call of the function
+ * passed to kdshards_nearest_range */
+struct kdshards_hit {
+	const double *pos;
+	void *data;
+	double dist_sq;
+};
+
+/* create an index of "count" shards for "k"-dimensional data, cutting space
+ * at the medians of the "nsample" points in "sample", one after the other.
+ * The sample needs at least as many points as there are shards.
+ * returns null on error */
+struct kdshards *kdshards_create(int k, int count, const double *sample, int nsample);
+
+/* create an index of "count" shards, cutting the box from "min" to "max" into
+ * cells of equal size. Points outside of the box go to the nearest cell. */
+struct kdshards *kdshards_create_grid(int k, int count, const double *min, const double *max);
+
+/* free the index, calling the data destructor on all data pointers */
+void kdshards_free(struct kdshards *shards);
+
+/* see kd_data_destructor */
+void kdshards_data_destructor(struct kdshards *shards, void (*destr)(void*));
+
+/* returns the number of shards */
+int kdshards_count(struct kdshards *shards);
+
+/* returns the number of points in the index, or in shard "i" if it is not
+ * negative */
+int kdshards_size(struct kdshards *shards, int i);
+
+/* returns the number of bytes allocated by the index, see kd_mem_usage */
+size_t kdshards_mem_usage(struct kdshards *shards);
+
+/* insert "n" points, given one after the other in "pos", with the data
+ * pointers in "data" (which may be null). Large batches are inserted by one
+ * thread per shard. Returns the number of points inserted; the data of
+ * points which were not inserted is left to the caller. If "inserted" is
+ * not null, inserted[i] is set to whether the i-th point was inserted. */
+int kdshards_insert(struct kdshards *shards, const double *pos, void **data, int n, char *inserted);
+
+/* Find the "num" nearest points, storing them in "hits" ordered by
+ * increasing distance, with their coordinates in "coords", which holds
+ * "num" points. Returns the number of points found, or -1 on error.
+ */
+int kdshards_nearest_n(struct kdshards *shards, const double *pos, int num,
+		struct kdshards_hit *hits, double *coords);
+
+/* Find all points within "range", calling "func" for each of them in no
+ * particular order; a non-zero return value from it aborts the search.
+ * Returns the number of points found, or -1 on error or abort.
+ */
+int kdshards_nearest_range(struct kdshards *shards, const double *pos, double range,
+		int (*func)(const struct kdshards_hit*, void*), void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* _KDSHARD_H_ */
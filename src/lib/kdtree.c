@@ -29,6 +29,7 @@ OF SUCH DAMAGE.
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <limits.h>
 #include "kdtree.h"
 
 #if defined(WIN32) || defined(__WIN32__)
@@ -48,30 +49,167 @@ OF SUCH DAMAGE.
 #endif	/* pthread support */
 #endif	/* use list node allocator */
 
+#ifndef NO_PTHREADS
+#include <pthread.h>
+#define LOCK(t)			pthread_mutex_lock(&(t)->lock)
+#define UNLOCK(t)		pthread_mutex_unlock(&(t)->lock)
+#else
+#define LOCK(t)
+#define UNLOCK(t)
+#endif
+
+/* Snapshots may be searched while new nodes are linked into the tree, so
+ * a node must be fully initialized before it becomes reachable.
+ */
+#if defined(__GNUC__)
+#define PUBLISH(p, v)	__atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#else
+#define PUBLISH(p, v)	((p) = (v))
+#endif
+
 struct kdhyperrect {
 	int dim;
 	double *min, *max;              /* minimum/maximum coords */
 };
 
 struct kdnode {
-	double *pos;
+	double *pos;			/* null if the tree is quantized, see COORD */
 	int dir;
+	int id;				/* insertion index within the tree */
+	unsigned int tag;	/* see kd_insert_tag */
+	unsigned int tags;	/* tags of all nodes in the subtree, or'ed together */
+	double expires;		/* see kd_insert_expiring, or REMOVED */
+	double min_expires, max_expires;	/* of the live nodes in the subtree */
 	void *data;
+	struct dup_chunk *dups;	/* more values at the same position */
 
 	struct kdnode *left, *right;	/* negative/positive side */
 };
 
+/* values inserted at the position of an existing node, see
+ * kd_merge_duplicates. Each chunk is twice the size of the one before it,
+ * and is filled before the next one is linked.
+ */
+struct dup_chunk {
+	int count, cap;
+	struct dup_chunk *next;
+	struct dup_item {
+		void *data;
+		int id;
+	} items[1];
+};
+
 struct res_node {
 	struct kdnode *item;
 	double dist_sq;
 	struct res_node *next;
 };
 
+/* the result of a search, kept by the cache of a tree, see kd_cache.
+ * The entry is followed by the query point, the squared distances of the
+ * results and the result nodes, nearest first.
+ */
+struct cache_entry {
+	int num;					/* neighbours searched for, 0 for kd_nearest */
+	unsigned int mask;
+	double max_dist;
+	double radius_sq;			/* squared distance of the farthest result, or
+								   the squared max_dist (HUGE_VAL without one)
+								   if fewer points than searched for were
+								   found */
+	int count;
+	double *pos, *dists;
+	struct kdnode **items;
+	struct cache_entry *hnext;			/* next in the hash bucket */
+	struct cache_entry *prev, *next;	/* least recently used last */
+};
+
+struct kdcache {
+	int capacity;
+	double quantum;
+	unsigned int nbuckets;		/* a power of two */
+	struct cache_entry **buckets;
+	struct cache_entry *head, *tail;
+	struct kdcachestats stats;
+};
+
+/* the points of a tree in one flat buffer, for searches by linear scan,
+ * see kd_scan. Coordinate i of point j is at coords[i * cap + j]; the
+ * buffer is padded to whole blocks with points at infinity.
+ */
+struct kdscan {
+	double *coords;
+	struct kdnode **nodes;
+	int size, cap;
+	int valid;				/* holds all nodes, cleared when they change */
+};
+
+/* the weights of the points of a tree, see kd_density: the nodes in
+ * preorder, each with the index after its subtree, the weight of its
+ * values and the sum of the weights of the points in its subtree */
+struct kdsum {
+	struct kdnode *node;
+	int end;
+	double own, sum;
+};
+
+struct kdsums {
+	double (*weight)(void*);	/* null if each point weighs 1 */
+	struct kdsum *nodes;
+	int size;
+	struct kdsums *next;
+};
+
+/* a root detached by kd_clear while snapshots still shared its nodes */
+struct retired {
+	struct kdnode *root;
+	char *pool;
+	size_t pool_size;
+	struct retired *next;
+};
+
 struct kdtree {
 	int dim;
+	int size;			/* number of points */
+	int next_id;		/* id of the next point inserted */
+	int removed;		/* removed nodes still linked, see kd_expire */
+	size_t mem;			/* bytes allocated for the tree, see kd_mem_usage */
 	struct kdnode *root;
 	struct kdhyperrect *rect;
 	void (*destr)(void*);
+
+	/* nodes laid out by kd_optimize, each followed by its coordinates */
+	char *pool;
+	size_t pool_size;
+
+	/* quantized trees store coordinate i of a node as an unsigned integer
+	 * q after the node, for the point qmin[i] + q * qstep[i] */
+	int qbits;				/* 16 or 32, or 0 if coordinates are doubles */
+	double *qmin, *qstep;	/* owned by the tree, shared by its snapshots */
+
+	int merge;				/* store duplicates in the dups of one node */
+	int split;				/* split policy of balanced builds, see kd_split */
+	int scan_mode;			/* see kd_scan */
+
+	int limit;				/* only nodes with smaller ids are visible */
+	struct kdtree *origin;	/* the tree a snapshot was taken from, or null */
+	unsigned int changes;	/* counts changes which move or free nodes,
+							   see kd_cursor_next */
+
+	/* the following are only used by trees, not snapshots */
+	int snapshots;			/* number of live snapshots */
+	int dead;				/* kd_free was called while snapshots were live */
+	struct retired *retired;
+	struct kdcache *cache;	/* see kd_cache, guarded by the lock */
+	struct kdscan *scan;	/* filled by searches, guarded by the lock */
+	struct kdsums *sums;	/* see kd_density, guarded by the lock */
+	double walk_nodes[2];	/* see scan_get, guarded by the lock */
+	unsigned int searches;
+	struct kdnode **by_id;	/* the node holding each id, see kd_update */
+	int by_id_cap;
+#ifndef NO_PTHREADS
+	pthread_mutex_t lock;
+#endif
 };
 
 struct kdres {
@@ -82,17 +220,76 @@ struct kdres {
 
 #define SQ(x)			((x) * (x))
 
+#define VISIBLE(kd, n)	((n) && (n)->id < (kd)->limit)
+
+/* the expiry time of a node removed by kd_expire, which stays in the tree
+ * until it is rebuilt, so that its subtrees keep their place */
+#define REMOVED			(-HUGE_VAL)
+
+/* nodes which expired at or before this time are not found */
+#define QUERY_NOW(q)	((q) && (q)->now != 0.0 ? (q)->now : REMOVED)
+
+/* nodes farther than this squared distance are not found */
+#define QUERY_LIMIT_SQ(q)	((q) && (q)->max_dist > 0.0 ? SQ((q)->max_dist) : HUGE_VAL)
 
-static void clear_rec(struct kdnode *node, void (*destr)(void*));
-static int insert_rec(struct kdnode **node, const double *pos, void *data, int dir, int dim);
+/* whether a node, or any node of its subtree, is found by a query */
+#define MATCH(q, n)			((n)->expires > QUERY_NOW(q) && \
+		(!(q) || !(q)->mask || ((n)->tag & (q)->mask)))
+#define SUBTREE_MATCH(q, n)	((n)->max_expires > QUERY_NOW(q) && \
+		(!(q) || !(q)->mask || ((n)->tags & (q)->mask)))
+
+#define NODE_SIZE(dim)	(sizeof(struct kdnode) + (dim) * sizeof(double))
+
+#define IN_POOL(p, size, n)	((char*)(n) >= (p) && (char*)(n) < (p) + (size))
+
+/* coordinate "i" of a node of tree "kd" */
+#define COORD(kd, n, i)	((n)->pos ? (n)->pos[i] : quant_coord((kd), (n), (i)))
+#define RECT_SIZE(dim)	(sizeof(struct kdhyperrect) + 2 * (dim) * sizeof(double))
+#define DUP_CHUNK_SIZE(cap)	(sizeof(struct dup_chunk) + ((cap) - 1) * sizeof(struct dup_item))
+
+/* Query statistics are gathered into a per-thread kdstats structure, see
+ * kd_stats_attach. Without KD_STATS the counters compile to nothing.
+ */
+#ifdef KD_STATS
+#if defined(_MSC_VER)
+#define KD_TLS			__declspec(thread)
+#else
+#define KD_TLS			__thread
+#endif
+static KD_TLS struct kdstats *cur_stats;
+#define STAT(field)		do { if(cur_stats) cur_stats->field++; } while(0)
+#else
+#define STAT(field)
+#endif
+
+
+static void clear_rec(struct kdnode *node, void (*destr)(void*), const char *pool, size_t pool_size);
+static int insert_rec(struct kdtree *kd, struct kdnode **nptr, struct kdnode *node, int dir);
+static double quant_coord(const struct kdtree *kd, const struct kdnode *node, int i);
 static int rlist_insert(struct res_node *list, struct kdnode *item, double dist_sq);
+struct nearest_n;
+static int rlist_insert_n(struct nearest_n *nn, struct kdnode *item, double dist_sq);
 static void clear_results(struct kdres *set);
+static struct kdres *nearest_q(struct kdtree *kd, const double *pos, const struct kdquery *q);
+static struct kdres *nearest_n_q(struct kdtree *kd, const double *pos, int num, const struct kdquery *q);
+static struct kdres *cache_search(struct kdtree *kd, const double *pos, int num, const struct kdquery *q);
+static void cache_invalidate(struct kdtree *kd, const struct kdnode *node);
+static void cache_invalidate_at(struct kdtree *kd, const struct kdnode *node, const double *pos);
+static void cache_flush(struct kdtree *kd);
+static int ids_reserve(struct kdtree *kd, int id);
+static void ids_drop(struct kdtree *kd);
+static void scan_append(struct kdtree *kd, struct kdnode *node);
+static void scan_reset(struct kdtree *kd);
+static void scan_uncount(struct kdtree *kd);
+static void scan_free(struct kdtree *kd);
+static void sums_free(struct kdtree *kd);
 
 static struct kdhyperrect* hyperrect_create(int dim, const double *min, const double *max);
 static void hyperrect_free(struct kdhyperrect *rect);
 static struct kdhyperrect* hyperrect_duplicate(const struct kdhyperrect *rect);
 static void hyperrect_extend(struct kdhyperrect *rect, const double *pos);
 static double hyperrect_dist_sq(struct kdhyperrect *rect, const double *pos);
+static double hyperrect_rect_dist_sq(const struct kdhyperrect *a, const struct kdhyperrect *b);
 
 #ifdef USE_LIST_NODE_ALLOCATOR
 static struct res_node *alloc_resnode(void);
@@ -113,350 +310,710 @@ struct kdtree *kd_create(int k)
 	}
 
 	tree->dim = k;
+	tree->size = 0;
+	tree->next_id = 0;
+	tree->removed = 0;
+	tree->mem = sizeof *tree;
 	tree->root = 0;
 	tree->destr = 0;
 	tree->rect = 0;
+	tree->pool = 0;
+	tree->pool_size = 0;
+	tree->qbits = 0;
+	tree->qmin = tree->qstep = 0;
+	tree->merge = 0;
+	tree->split = KD_SPLIT_CYCLE;
+	tree->scan_mode = KD_SCAN_AUTO;
+	tree->limit = INT_MAX;
+	tree->origin = 0;
+	tree->changes = 0;
+	tree->snapshots = 0;
+	tree->dead = 0;
+	tree->retired = 0;
+	tree->cache = 0;
+	tree->scan = 0;
+	tree->sums = 0;
+	scan_uncount(tree);
+	tree->by_id = 0;
+	tree->by_id_cap = 0;
+#ifndef NO_PTHREADS
+	pthread_mutex_init(&tree->lock, 0);
+#endif
 
 	return tree;
 }
 
-void kd_free(struct kdtree *tree)
+/* sets the box of a quantized tree, which is split into 2^bits - 1 steps
+ * along each axis */
+static int quant_box(struct kdtree *tree, const double *min, const double *max)
 {
-	if(tree) {
-		kd_clear(tree);
-		free(tree);
-	}
-}
+	double steps = tree->qbits == 16 ? 65535.0 : 4294967295.0;
+	int i;
 
-static void clear_rec(struct kdnode *node, void (*destr)(void*))
-{
-	if(!node) return;
+	if(!(tree->qmin = malloc(2 * tree->dim * sizeof *tree->qmin))) {
+		return -1;
+	}
+	tree->qstep = tree->qmin + tree->dim;
+	tree->mem += 2 * tree->dim * sizeof *tree->qmin;
 
-	clear_rec(node->left, destr);
-	clear_rec(node->right, destr);
-	
-	if(destr) {
-		destr(node->data);
+	for(i=0; i<tree->dim; i++) {
+		tree->qmin[i] = min[i];
+		tree->qstep[i] = max[i] > min[i] ? (max[i] - min[i]) / steps : 0.0;
 	}
-	free(node->pos);
-	free(node);
+	return 0;
 }
 
-void kd_clear(struct kdtree *tree)
+struct kdtree *kd_create_quantized(int k, const double *min, const double *max, int bits)
 {
-	clear_rec(tree->root, tree->destr);
-	tree->root = 0;
+	struct kdtree *tree;
 
-	if (tree->rect) {
-		hyperrect_free(tree->rect);
-		tree->rect = 0;
+	if(bits != 16 && bits != 32) {
+		return 0;
+	}
+	if(!(tree = kd_create(k))) {
+		return 0;
+	}
+	tree->qbits = bits;
+
+	if(min && max && quant_box(tree, min, max) == -1) {
+		kd_free(tree);
+		return 0;
 	}
+	return tree;
 }
 
-void kd_data_destructor(struct kdtree *tree, void (*destr)(void*))
+static void tree_destroy(struct kdtree *tree)
 {
-	tree->destr = destr;
+#ifndef NO_PTHREADS
+	pthread_mutex_destroy(&tree->lock);
+#endif
+	free(tree->qmin);
+	free(tree);
 }
 
-
-static int insert_rec(struct kdnode **nptr, const double *pos, void *data, int dir, int dim)
+static void snapshot_release(struct kdtree *snap)
 {
-	int new_dir;
-	struct kdnode *node;
+	struct kdtree *tree = snap->origin;
+	struct retired *ret = 0, *next;
+	int destroy = 0;
 
-	if(!*nptr) {
-		if(!(node = malloc(sizeof *node))) {
-			return -1;
-		}
-		if(!(node->pos = malloc(dim * sizeof *node->pos))) {
-			free(node);
-			return -1;
-		}
-		memcpy(node->pos, pos, dim * sizeof *node->pos);
-		node->data = data;
-		node->dir = dir;
-		node->left = node->right = 0;
-		*nptr = node;
-		return 0;
+	if(snap->rect) {
+		hyperrect_free(snap->rect);
 	}
+	sums_free(snap);
+#ifndef NO_PTHREADS
+	pthread_mutex_destroy(&snap->lock);
+#endif
+	free(snap);
 
-	node = *nptr;
-	new_dir = (node->dir + 1) % dim;
-	if(pos[node->dir] < node->pos[node->dir]) {
-		return insert_rec(&(*nptr)->left, pos, data, new_dir, dim);
+	LOCK(tree);
+	if(--tree->snapshots == 0) {
+		ret = tree->retired;
+		tree->retired = 0;
+		destroy = tree->dead;
+	}
+	UNLOCK(tree);
+
+	/* no reader can reach nodes of cleared roots anymore */
+	while(ret) {
+		next = ret->next;
+		clear_rec(ret->root, tree->destr, ret->pool, ret->pool_size);
+		free(ret->pool);
+		free(ret);
+		ret = next;
+	}
+	if(destroy) {
+		tree_destroy(tree);
 	}
-	return insert_rec(&(*nptr)->right, pos, data, new_dir, dim);
 }
 
-int kd_insert(struct kdtree *tree, const double *pos, void *data)
+void kd_free(struct kdtree *tree)
 {
-	if (insert_rec(&tree->root, pos, data, 0, tree->dim)) {
-		return -1;
-	}
+	int live;
 
-	if (tree->rect == 0) {
-		tree->rect = hyperrect_create(tree->dim, pos, pos);
-	} else {
-		hyperrect_extend(tree->rect, pos);
+	if(!tree) return;
+
+	if(tree->origin) {
+		snapshot_release(tree);
+		return;
 	}
 
-	return 0;
+	kd_clear(tree);
+	kd_cache(tree, 0, 0.0);
+	scan_free(tree);
+
+	LOCK(tree);
+	tree->dead = 1;
+	live = tree->snapshots;
+	UNLOCK(tree);
+
+	/* otherwise the last snapshot frees the tree */
+	if(!live) {
+		tree_destroy(tree);
+	}
 }
 
-int kd_insertf(struct kdtree *tree, const float *pos, void *data)
+struct kdtree *kd_snapshot(struct kdtree *tree)
 {
-	static double sbuf[16];
-	double *bptr, *buf = 0;
-	int res, dim = tree->dim;
+	struct kdtree *snap, *origin = tree->origin ? tree->origin : tree;
 
-	if(dim > 16) {
-#ifndef NO_ALLOCA
-		if(dim <= 256)
-			bptr = buf = alloca(dim * sizeof *bptr);
-		else
-#endif
-			if(!(bptr = buf = malloc(dim * sizeof *bptr))) {
-				return -1;
-			}
-	} else {
-		bptr = buf = sbuf;
+	if(!(snap = malloc(sizeof *snap))) {
+		return 0;
 	}
-
-	while(dim-- > 0) {
-		*bptr++ = *pos++;
+	snap->dim = tree->dim;
+	snap->size = tree->size;
+	snap->next_id = tree->next_id;
+	snap->removed = tree->removed;
+	snap->mem = sizeof *snap;
+	snap->root = tree->root;
+	snap->destr = 0;
+	snap->rect = 0;
+	snap->pool = 0;
+	snap->pool_size = 0;
+	snap->qbits = tree->qbits;
+	snap->qmin = tree->qmin;
+	snap->qstep = tree->qstep;
+	snap->merge = tree->merge;
+	snap->split = tree->split;
+	snap->scan_mode = KD_SCAN_NEVER;
+	if(tree->rect) {
+		if(!(snap->rect = hyperrect_duplicate(tree->rect))) {
+			free(snap);
+			return 0;
+		}
+		snap->mem += RECT_SIZE(tree->dim);
 	}
-
-	res = kd_insert(tree, buf, data);
-#ifndef NO_ALLOCA
-	if(tree->dim > 256)
-#else
-	if(tree->dim > 16)
+	snap->limit = tree->origin ? tree->limit : tree->next_id;
+	snap->origin = origin;
+	snap->changes = 0;
+	snap->snapshots = 0;
+	snap->dead = 0;
+	snap->retired = 0;
+	snap->cache = 0;
+	snap->scan = 0;
+	snap->sums = 0;
+	scan_uncount(snap);
+	snap->by_id = 0;
+	snap->by_id_cap = 0;
+#ifndef NO_PTHREADS
+	/* guards the sums of kd_density, which snapshots fill on their own */
+	pthread_mutex_init(&snap->lock, 0);
 #endif
-		free(buf);
-	return res;
+
+	LOCK(origin);
+	origin->snapshots++;
+	UNLOCK(origin);
+	return snap;
 }
 
-int kd_insert3(struct kdtree *tree, double x, double y, double z, void *data)
+int kd_is_snapshot(struct kdtree *tree)
 {
-	double buf[3];
-	buf[0] = x;
-	buf[1] = y;
-	buf[2] = z;
-	return kd_insert(tree, buf, data);
+	return tree->origin != 0;
 }
 
-int kd_insert3f(struct kdtree *tree, float x, float y, float z, void *data)
+int kd_snapshot_count(struct kdtree *tree)
 {
-	double buf[3];
-	buf[0] = x;
-	buf[1] = y;
-	buf[2] = z;
-	return kd_insert(tree, buf, data);
+	int count;
+
+	if(tree->origin) return 0;
+	LOCK(tree);
+	count = tree->snapshots;
+	UNLOCK(tree);
+	return count;
 }
 
-static int find_nearest(struct kdnode *node, const double *pos, double range, struct res_node *list, int ordered, int dim)
+static void clear_dups(struct dup_chunk *chunk, void (*destr)(void*))
 {
-	double dist_sq, dx;
-	int i, ret, added_res = 0;
-
-	if(!node) return 0;
+	struct dup_chunk *next;
+	int i;
 
-	dist_sq = 0;
-	for(i=0; i<dim; i++) {
-		dist_sq += SQ(node->pos[i] - pos[i]);
-	}
-	if(dist_sq <= SQ(range)) {
-		if(rlist_insert(list, node, ordered ? dist_sq : -1.0) == -1) {
-			return -1;
+	while(chunk) {
+		next = chunk->next;
+		for(i=0; destr && i<chunk->count; i++) {
+			destr(chunk->items[i].data);
 		}
-		added_res = 1;
+		free(chunk);
+		chunk = next;
 	}
+}
 
-	dx = pos[node->dir] - node->pos[node->dir];
+static void clear_rec(struct kdnode *node, void (*destr)(void*), const char *pool, size_t pool_size)
+{
+	if(!node) return;
 
-	ret = find_nearest(dx <= 0.0 ? node->left : node->right, pos, range, list, ordered, dim);
-	if(ret >= 0 && fabs(dx) < range) {
-		added_res += ret;
-		ret = find_nearest(dx <= 0.0 ? node->right : node->left, pos, range, list, ordered, dim);
+	clear_rec(node->left, destr, pool, pool_size);
+	clear_rec(node->right, destr, pool, pool_size);
+	
+	if(destr) {
+		destr(node->data);
 	}
-	if(ret == -1) {
-		return -1;
+	clear_dups(node->dups, destr);
+	/* pooled nodes are freed along with the pool */
+	if(!IN_POOL(pool, pool_size, node)) {
+		free(node->pos);
+		free(node);
 	}
-	added_res += ret;
+}
 
-	return added_res;
+/* detaches the root of the tree if snapshots may still search it, returns
+ * non-zero if the nodes must not be freed now */
+static int retire_root(struct kdtree *tree)
+{
+	struct retired *ret;
+	int shared;
+
+	LOCK(tree);
+	if((shared = tree->snapshots > 0 && tree->root)) {
+		/* if we can't keep track of the nodes, leak them rather than
+		 * freeing them under a reader */
+		if((ret = malloc(sizeof *ret))) {
+			ret->root = tree->root;
+			ret->pool = tree->pool;
+			ret->pool_size = tree->pool_size;
+			ret->next = tree->retired;
+			tree->retired = ret;
+		}
+	}
+	UNLOCK(tree);
+	return shared;
 }
 
-#if 0
-static int find_nearest_n(struct kdnode *node, const double *pos, double range, int num, struct rheap *heap, int dim)
+void kd_clear(struct kdtree *tree)
 {
-	double dist_sq, dx;
-	int i, ret, added_res = 0;
+	/* snapshots are read-only */
+	if(tree->origin) return;
+
+	cache_flush(tree);
+	ids_drop(tree);
+	scan_reset(tree);
+	scan_uncount(tree);
+	sums_free(tree);
+	tree->changes++;
+	if(!retire_root(tree)) {
+		clear_rec(tree->root, tree->destr, tree->pool, tree->pool_size);
+		free(tree->pool);
+	}
+	tree->root = 0;
+	tree->pool = 0;
+	tree->pool_size = 0;
+	tree->size = 0;
+	tree->next_id = 0;
+	tree->removed = 0;
+	tree->mem = sizeof *tree;
 
-	if(!node) return 0;
-	
-	/* if the photon is close enough, add it to the result heap */
-	dist_sq = 0;
-	for(i=0; i<dim; i++) {
-		dist_sq += SQ(node->pos[i] - pos[i]);
+	if (tree->rect) {
+		hyperrect_free(tree->rect);
+		tree->rect = 0;
 	}
-	if(dist_sq <= range_sq) {
-		if(heap->size >= num) {
-			/* get furthest element */
-			struct res_node *maxelem = rheap_get_max(heap);
+}
 
-			/* and check if the new one is closer than that */
-			if(maxelem->dist_sq > dist_sq) {
-				rheap_remove_max(heap);
+void kd_data_destructor(struct kdtree *tree, void (*destr)(void*))
+{
+	tree->destr = destr;
+}
 
-				if(rheap_insert(heap, node, dist_sq) == -1) {
-					return -1;
-				}
-				added_res = 1;
+static void free_data_rec(struct kdnode *node, void (*destr)(void*))
+{
+	struct dup_chunk *chunk;
+	int i;
 
-				range_sq = dist_sq;
-			}
-		} else {
-			if(rheap_insert(heap, node, dist_sq) == -1) {
-				return =1;
+	if(!node) return;
+
+	free_data_rec(node->left, destr);
+	free_data_rec(node->right, destr);
+
+	if(node->data) {
+		destr(node->data);
+		node->data = 0;
+	}
+	for(chunk = node->dups; chunk; chunk = chunk->next) {
+		for(i=0; i<chunk->count; i++) {
+			if(chunk->items[i].data) {
+				destr(chunk->items[i].data);
+				chunk->items[i].data = 0;
 			}
-			added_res = 1;
 		}
 	}
+}
 
+void kd_free_data(struct kdtree *tree)
+{
+	if(tree->origin || !tree->destr) return;
+	sums_free(tree);
+	free_data_rec(tree->root, tree->destr);
+}
 
-	/* find signed distance from the splitting plane */
-	dx = pos[node->dir] - node->pos[node->dir];
-
-	ret = find_nearest_n(dx <= 0.0 ? node->left : node->right, pos, range, num, heap, dim);
-	if(ret >= 0 && fabs(dx) < range) {
-		added_res += ret;
-		ret = find_nearest_n(dx <= 0.0 ? node->right : node->left, pos, range, num, heap, dim);
-	}
+int kd_merge_duplicates(struct kdtree *tree, int merge)
+{
+	if(tree->origin) return -1;
+	tree->merge = merge;
+	return 0;
+}
 
+int kd_dimension(struct kdtree *tree)
+{
+	return tree->dim;
 }
-#endif
 
-static void kd_nearest_i(struct kdnode *node, const double *pos, struct kdnode **result, double *result_dist_sq, struct kdhyperrect* rect)
+int kd_size(struct kdtree *tree)
 {
-	int dir = node->dir;
-	int i;
-	double dummy, dist_sq;
-	struct kdnode *nearer_subtree, *farther_subtree;
-	double *nearer_hyperrect_coord, *farther_hyperrect_coord;
+	return tree->size;
+}
 
-	/* Decide whether to go left or right in the tree */
-	dummy = pos[dir] - node->pos[dir];
-	if (dummy <= 0) {
-		nearer_subtree = node->left;
-		farther_subtree = node->right;
-		nearer_hyperrect_coord = rect->max + dir;
-		farther_hyperrect_coord = rect->min + dir;
-	} else {
-		nearer_subtree = node->right;
-		farther_subtree = node->left;
-		nearer_hyperrect_coord = rect->min + dir;
-		farther_hyperrect_coord = rect->max + dir;
-	}
+int kd_next_id(struct kdtree *tree)
+{
+	return tree->next_id;
+}
 
-	if (nearer_subtree) {
-		/* Slice the hyperrect to get the hyperrect of the nearer subtree */
-		dummy = *nearer_hyperrect_coord;
-		*nearer_hyperrect_coord = node->pos[dir];
-		/* Recurse down into nearer subtree */
-		kd_nearest_i(nearer_subtree, pos, result, result_dist_sq, rect);
-		/* Undo the slice */
-		*nearer_hyperrect_coord = dummy;
-	}
+size_t kd_mem_usage(struct kdtree *tree)
+{
+	size_t mem = tree->mem;
+	struct kdsums *s;
 
-	/* Check the distance of the point at the current node, compare it
-	 * with our best so far */
-	dist_sq = 0;
-	for(i=0; i < rect->dim; i++) {
-		dist_sq += SQ(node->pos[i] - pos[i]);
+	LOCK(tree);
+	if(tree->scan) {
+		mem += sizeof *tree->scan + (size_t)tree->scan->cap * (tree->dim * sizeof(double) + sizeof(struct kdnode*));
 	}
-	if (dist_sq < *result_dist_sq) {
-		*result = node;
-		*result_dist_sq = dist_sq;
+	for(s = tree->sums; s; s = s->next) {
+		mem += sizeof *s + (size_t)s->size * sizeof *s->nodes;
 	}
+	UNLOCK(tree);
+	return mem;
+}
 
-	if (farther_subtree) {
-		/* Get the hyperrect of the farther subtree */
-		dummy = *farther_hyperrect_coord;
-		*farther_hyperrect_coord = node->pos[dir];
-		/* Check if we have to recurse down by calculating the closest
-		 * point of the hyperrect and see if it's closer than our
-		 * minimum distance in result_dist_sq. */
-		if (hyperrect_dist_sq(rect, pos) < *result_dist_sq) {
-			/* Recurse down into farther subtree */
-			kd_nearest_i(farther_subtree, pos, result, result_dist_sq, rect);
-		}
-		/* Undo the slice on the hyperrect */
-		*farther_hyperrect_coord = dummy;
+static void info_rec(struct kdtree *kd, struct kdnode *node, int depth, struct kdinfo *info, double *depth_sum, int *nodes)
+{
+	if(!VISIBLE(kd, node)) return;
+
+	if(depth > info->max_depth) {
+		info->max_depth = depth;
 	}
+	*depth_sum += depth;
+	(*nodes)++;
+
+	info_rec(kd, node->left, depth + 1, info, depth_sum, nodes);
+	info_rec(kd, node->right, depth + 1, info, depth_sum, nodes);
 }
 
-struct kdres *kd_nearest(struct kdtree *kd, const double *pos)
+void kd_info(struct kdtree *tree, struct kdinfo *info)
 {
-	struct kdhyperrect *rect;
-	struct kdnode *result;
-	struct kdres *rset;
-	double dist_sq;
-	int i;
+	double depth_sum = 0;
+	int ideal = 0, nodes = 0, n;
 
-	if (!kd) return 0;
-	if (!kd->rect) return 0;
+	info->size = tree->size;
+	info->max_depth = 0;
+	info->mem = kd_mem_usage(tree);
+	info_rec(tree, tree->root, 1, info, &depth_sum, &nodes);
 
-	/* Allocate result set */
-	if(!(rset = malloc(sizeof *rset))) {
-		return 0;
+	/* merged duplicates share a node, so there may be fewer nodes than points */
+	info->avg_depth = nodes ? depth_sum / nodes : 0.0;
+
+	/* depth of a perfectly balanced tree of the same size */
+	for(n = nodes; n > 0; n >>= 1) {
+		ideal++;
 	}
-	if(!(rset->rlist = alloc_resnode())) {
-		free(rset);
-		return 0;
+	info->balance = info->max_depth ? (double)ideal / info->max_depth : 1.0;
+}
+
+void kd_stats_attach(struct kdstats *st)
+{
+#ifdef KD_STATS
+	cur_stats = st;
+#else
+	(void)st;
+#endif
+}
+
+
+/* bytes taken by a node and its coordinates */
+static size_t node_size(const struct kdtree *kd)
+{
+	if(kd->qbits) {
+		/* keep nodes aligned when they are laid out one after the other */
+		return (sizeof(struct kdnode) + kd->dim * kd->qbits / 8 + 7) & ~(size_t)7;
 	}
-	rset->rlist->next = 0;
-	rset->tree = kd;
+	return NODE_SIZE(kd->dim);
+}
 
-	/* Duplicate the bounding hyperrectangle, we will work on the copy */
-	if (!(rect = hyperrect_duplicate(kd->rect))) {
-		kd_res_free(rset);
-		return 0;
+static double quant_coord(const struct kdtree *kd, const struct kdnode *node, int i)
+{
+	if(kd->qbits == 16) {
+		return kd->qmin[i] + ((const unsigned short*)(node + 1))[i] * kd->qstep[i];
 	}
+	return kd->qmin[i] + ((const unsigned int*)(node + 1))[i] * kd->qstep[i];
+}
 
-	/* Our first guesstimate is the root node */
-	result = kd->root;
-	dist_sq = 0;
-	for (i = 0; i < kd->dim; i++)
-		dist_sq += SQ(result->pos[i] - pos[i]);
+/* returns the step nearest to coordinate "x" along axis "i" of a quantized
+ * tree, clamped to the box of the tree */
+static double quant_step(const struct kdtree *kd, double x, int i)
+{
+	double q, steps = kd->qbits == 16 ? 65535.0 : 4294967295.0;
 
-	/* Search for the nearest neighbour recursively */
-	kd_nearest_i(kd->root, pos, &result, &dist_sq, rect);
+	q = kd->qstep[i] > 0.0 ? floor((x - kd->qmin[i]) / kd->qstep[i] + 0.5) : 0.0;
+	if(!(q >= 0.0)) {
+		q = 0.0;
+	} else if(q > steps) {
+		q = steps;
+	}
+	return q;
+}
 
-	/* Free the copy of the hyperrect */
-	hyperrect_free(rect);
+/* stores the coordinates of a node of a quantized tree, rounded to the
+ * nearest step and clamped to the box of the tree */
+static void quant_encode(const struct kdtree *kd, struct kdnode *node, const double *pos)
+{
+	double q;
+	int i;
 
-	/* Store the result */
-	if (result) {
-		if (rlist_insert(rset->rlist, result, -1.0) == -1) {
-			kd_res_free(rset);
+	for(i=0; i<kd->dim; i++) {
+		q = quant_step(kd, pos[i], i);
+		if(kd->qbits == 16) {
+			((unsigned short*)(node + 1))[i] = (unsigned short)q;
+		} else {
+			((unsigned int*)(node + 1))[i] = (unsigned int)q;
+		}
+	}
+}
+
+/* extends a bounding box by the stored coordinates of a node, which differ
+ * from the inserted ones in quantized trees */
+static void hyperrect_extend_node(struct kdtree *kd, struct kdhyperrect *rect, const struct kdnode *node)
+{
+	double x;
+	int i;
+
+	for(i=0; i<kd->dim; i++) {
+		x = COORD(kd, node, i);
+		if(x < rect->min[i]) {
+			rect->min[i] = x;
+		}
+		if(x > rect->max[i]) {
+			rect->max[i] = x;
+		}
+	}
+}
+
+static struct kdnode *node_create(struct kdtree *kd, const double *pos, void *data, int id, unsigned int tag)
+{
+	struct kdnode *node;
+
+	if(kd->qbits) {
+		if(!(node = malloc(node_size(kd)))) {
 			return 0;
 		}
-		rset->size = 1;
-		kd_res_rewind(rset);
-		return rset;
+		node->pos = 0;
+		quant_encode(kd, node, pos);
 	} else {
-		kd_res_free(rset);
+		if(!(node = malloc(sizeof *node))) {
+			return 0;
+		}
+		if(!(node->pos = malloc(kd->dim * sizeof *node->pos))) {
+			free(node);
+			return 0;
+		}
+		memcpy(node->pos, pos, kd->dim * sizeof *node->pos);
+	}
+	node->data = data;
+	node->id = id;
+	node->tag = node->tags = tag;
+	node->expires = node->min_expires = node->max_expires = HUGE_VAL;
+	node->dups = 0;
+	node->left = node->right = 0;
+	return node;
+}
+
+static int same_pos(const struct kdtree *kd, const struct kdnode *a, const struct kdnode *b)
+{
+	int i;
+
+	if(kd->qbits) {
+		return memcmp(a + 1, b + 1, kd->dim * kd->qbits / 8) == 0;
+	}
+	for(i=0; i<kd->dim; i++) {
+		if(a->pos[i] != b->pos[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* returns the last chunk of the dups of a node, adding an empty one if it
+ * is full, or 0 if memory runs out */
+static struct dup_chunk *dup_room(struct kdtree *kd, struct kdnode *node)
+{
+	struct dup_chunk *chunk, *last = 0;
+	int cap;
+
+	for(chunk = node->dups; chunk; chunk = chunk->next) {
+		last = chunk;
+	}
+	if(last && last->count < last->cap) {
+		return last;
+	}
+	cap = last ? 2 * last->cap : 2;
+	if(!(chunk = malloc(DUP_CHUNK_SIZE(cap)))) {
 		return 0;
 	}
+	chunk->count = 0;
+	chunk->cap = cap;
+	chunk->next = 0;
+	if(last) {
+		PUBLISH(last->next, chunk);
+	} else {
+		PUBLISH(node->dups, chunk);
+	}
+	kd->mem += DUP_CHUNK_SIZE(cap);
+	return chunk;
 }
 
-struct kdres *kd_nearestf(struct kdtree *tree, const float *pos)
+/* adds a value to the dups of a node. Snapshots may be reading the chunks,
+ * so entries are written before they are counted. */
+static int dup_append(struct kdtree *kd, struct kdnode *node, void *data, int id)
+{
+	struct dup_chunk *last;
+
+	if(!(last = dup_room(kd, node))) {
+		return -1;
+	}
+	last->items[last->count].data = data;
+	last->items[last->count].id = id;
+	PUBLISH(last->count, last->count + 1);
+	return 0;
+}
+
+/* returns the id of the i-th value stored at a node, the first being the
+ * node's own, and its data in "data" if not null; or -1 past the last one */
+static int node_value(const struct kdtree *kd, const struct kdnode *node, int i, void **data)
+{
+	struct dup_chunk *chunk;
+
+	if(i == 0) {
+		if(data) *data = node->data;
+		return node->id;
+	}
+	for(chunk = node->dups, i--; chunk; chunk = chunk->next) {
+		if(i < chunk->count) {
+			/* values are appended in id order, so the rest is hidden too */
+			if(chunk->items[i].id >= kd->limit) {
+				return -1;
+			}
+			if(data) *data = chunk->items[i].data;
+			return chunk->items[i].id;
+		}
+		i -= chunk->count;
+	}
+	return -1;
+}
+
+/* links a new node into the tree. Returns 0 if it was linked, 1 if its
+ * value was added to a node at the same position instead, or -1 on error */
+static int insert_rec(struct kdtree *kd, struct kdnode **nptr, struct kdnode *node, int dir)
+{
+	struct kdnode *cur;
+	double a, b;
+
+	if(!*nptr) {
+		node->dir = dir;
+		PUBLISH(*nptr, node);
+		return 0;
+	}
+
+	cur = *nptr;
+	cur->tags |= node->tag;
+	if(node->expires < cur->min_expires) {
+		cur->min_expires = node->expires;
+	}
+	if(node->expires > cur->max_expires) {
+		cur->max_expires = node->expires;
+	}
+	dir = (cur->dir + 1) % kd->dim;
+	a = COORD(kd, node, cur->dir);
+	b = COORD(kd, cur, cur->dir);
+	if(a < b) {
+		return insert_rec(kd, &cur->left, node, dir);
+	}
+	/* duplicates always go right, so they meet the first node at their position */
+	if(kd->merge && a == b && node->tag == cur->tag && node->expires == cur->expires && same_pos(kd, node, cur)) {
+		if(dup_append(kd, cur, node->data, node->id) == -1) {
+			return -1;
+		}
+		if(kd->by_id) {
+			kd->by_id[node->id] = cur;
+		}
+		return 1;
+	}
+	return insert_rec(kd, &cur->right, node, dir);
+}
+
+int kd_insert(struct kdtree *tree, const double *pos, void *data)
+{
+	return kd_insert_tag(tree, pos, data, 0);
+}
+
+int kd_insert_tag(struct kdtree *tree, const double *pos, void *data, unsigned int tag)
+{
+	return kd_insert_expiring(tree, pos, data, tag, HUGE_VAL);
+}
+
+int kd_insert_expiring(struct kdtree *tree, const double *pos, void *data, unsigned int tag, double expires)
+{
+	struct kdnode *node;
+
+	/* snapshots are read-only, and quantized trees need their box first */
+	if (tree->origin || (tree->qbits && !tree->qmin) || !(expires > REMOVED)) {
+		return -1;
+	}
+	if (ids_reserve(tree, tree->next_id) == -1) {
+		return -1;
+	}
+	if (!(node = node_create(tree, pos, data, tree->next_id, tag))) {
+		return -1;
+	}
+	node->expires = node->min_expires = node->max_expires = expires;
+	sums_free(tree);
+	switch (insert_rec(tree, &tree->root, node, 0)) {
+	case -1:
+		free(node->pos);
+		free(node);
+		return -1;
+	case 1:
+		/* merged into an existing node, so the bounding box is unchanged */
+		cache_invalidate(tree, node);
+		free(node->pos);
+		free(node);
+		tree->size++;
+		tree->next_id++;
+		return 0;
+	}
+	cache_invalidate(tree, node);
+	scan_append(tree, node);
+	if (tree->by_id) {
+		tree->by_id[node->id] = node;
+	}
+	tree->size++;
+	tree->next_id++;
+	tree->mem += node_size(tree);
+
+	if (tree->rect == 0) {
+		if (!(tree->rect = hyperrect_create(tree->dim, pos, pos))) {
+			return -1;
+		}
+		tree->mem += RECT_SIZE(tree->dim);
+	} else {
+		hyperrect_extend(tree->rect, pos);
+	}
+	if (tree->qbits) {
+		hyperrect_extend_node(tree, tree->rect, node);
+	}
+
+	return 0;
+}
+
+int kd_insertf(struct kdtree *tree, const float *pos, void *data)
 {
 	static double sbuf[16];
 	double *bptr, *buf = 0;
-	int dim = tree->dim;
-	struct kdres *res;
+	int res, dim = tree->dim;
 
 	if(dim > 16) {
 #ifndef NO_ALLOCA
@@ -465,50 +1022,2668 @@ struct kdres *kd_nearestf(struct kdtree *tree, const float *pos)
 		else
 #endif
 			if(!(bptr = buf = malloc(dim * sizeof *bptr))) {
-				return 0;
+				return -1;
 			}
 	} else {
 		bptr = buf = sbuf;
 	}
 
-	while(dim-- > 0) {
-		*bptr++ = *pos++;
-	}
+	while(dim-- > 0) {
+		*bptr++ = *pos++;
+	}
+
+	res = kd_insert(tree, buf, data);
+#ifndef NO_ALLOCA
+	if(tree->dim > 256)
+#else
+	if(tree->dim > 16)
+#endif
+		free(buf);
+	return res;
+}
+
+int kd_insert3(struct kdtree *tree, double x, double y, double z, void *data)
+{
+	double buf[3];
+	buf[0] = x;
+	buf[1] = y;
+	buf[2] = z;
+	return kd_insert(tree, buf, data);
+}
+
+int kd_insert3f(struct kdtree *tree, float x, float y, float z, void *data)
+{
+	double buf[3];
+	buf[0] = x;
+	buf[1] = y;
+	buf[2] = z;
+	return kd_insert(tree, buf, data);
+}
+
+/* ---- balanced bulk build ---- */
+
+/* partially sorts "nodes" by their coordinate "dir", so that the k-th node
+ * is in place, with no greater node before it and no smaller one after it.
+ */
+static void select_nth(struct kdtree *kd, struct kdnode **nodes, int n, int k, int dir)
+{
+	int lo = 0, hi = n - 1;
+
+	while(lo < hi) {
+		double pivot = COORD(kd, nodes[lo + (hi - lo) / 2], dir);
+		int i = lo, j = hi;
+
+		while(i <= j) {
+			while(COORD(kd, nodes[i], dir) < pivot) i++;
+			while(COORD(kd, nodes[j], dir) > pivot) j--;
+			if(i <= j) {
+				struct kdnode *tmp = nodes[i];
+				nodes[i++] = nodes[j];
+				nodes[j--] = tmp;
+			}
+		}
+		if(k <= j) {
+			hi = j;
+		} else if(k >= i) {
+			lo = i;
+		} else {
+			break;
+		}
+	}
+}
+
+/* sets the summaries of the subtree at a node from those of its children */
+static void summarize(struct kdnode *node)
+{
+	struct kdnode *child[2];
+	int i;
+
+	node->tags = node->tag;
+	if(node->expires == REMOVED) {
+		node->min_expires = HUGE_VAL;
+		node->max_expires = REMOVED;
+	} else {
+		node->min_expires = node->max_expires = node->expires;
+	}
+
+	child[0] = node->left;
+	child[1] = node->right;
+	for(i=0; i<2; i++) {
+		if(!child[i]) continue;
+		node->tags |= child[i]->tags;
+		if(child[i]->min_expires < node->min_expires) {
+			node->min_expires = child[i]->min_expires;
+		}
+		if(child[i]->max_expires > node->max_expires) {
+			node->max_expires = child[i]->max_expires;
+		}
+	}
+}
+
+/* picks the axis to split the nodes on by the split policy of the tree,
+ * storing it in "dir", and returns the index of the splitting node among
+ * them once they are sorted along that axis */
+static int split_choose(struct kdtree *kd, struct kdnode **nodes, int n, int *dir)
+{
+	double best = -1.0, lo = 0.0, hi = 0.0, cut, below, above;
+	int i, j, k, left;
+
+	if(kd->split == KD_SPLIT_CYCLE || n < 2) return n / 2;
+
+	for(j=0; j<kd->dim; j++) {
+		double min = HUGE_VAL, max = -HUGE_VAL, mean = 0.0, m2 = 0.0, d;
+
+		for(i=0; i<n; i++) {
+			double x = COORD(kd, nodes[i], j);
+
+			if(x < min) min = x;
+			if(x > max) max = x;
+			if(kd->split == KD_SPLIT_VARIANCE) {
+				d = x - mean;
+				mean += d / (i + 1);
+				m2 += d * (x - mean);
+			}
+		}
+		d = kd->split == KD_SPLIT_VARIANCE ? m2 : max - min;
+		if(d > best) {
+			best = d;
+			*dir = j;
+			lo = min;
+			hi = max;
+		}
+	}
+	if(kd->split != KD_SPLIT_MIDPOINT) return n / 2;
+
+	/* split at the node next to the middle of the widest side; if all nodes
+	 * lie on one side, the plane slides to the nearest of them */
+	cut = lo + (hi - lo) / 2;
+	below = -HUGE_VAL;
+	above = HUGE_VAL;
+	left = 0;
+	for(i=0; i<n; i++) {
+		double x = COORD(kd, nodes[i], *dir);
+
+		if(x < cut) {
+			left++;
+			if(x > below) below = x;
+		} else if(x < above) {
+			above = x;
+		}
+	}
+	k = left == 0 || (left < n && above - cut <= cut - below) ? left : left - 1;
+
+	/* keep at least an eighth of the nodes on each side, so that clusters
+	 * and duplicates can't make the tree arbitrarily deep */
+	if(k < n / 8) k = n / 8;
+	if(k > n - 1 - n / 8) k = n - 1 - n / 8;
+	return k;
+}
+
+/* links the nodes into a balanced tree, splitting them as the split policy
+ * of the tree says, and returns its root */
+static struct kdnode *build_rec(struct kdtree *kd, struct kdnode **nodes, int n, int dir)
+{
+	struct kdnode *node;
+	int mid, new_dir;
+
+	if(n <= 0) return 0;
+
+	mid = split_choose(kd, nodes, n, &dir);
+	new_dir = (dir + 1) % kd->dim;
+	select_nth(kd, nodes, n, mid, dir);
+	node = nodes[mid];
+	node->dir = dir;
+	node->left = build_rec(kd, nodes, mid, new_dir);
+	node->right = build_rec(kd, nodes + mid + 1, n - mid - 1, new_dir);
+	summarize(node);
+	return node;
+}
+
+int kd_build(struct kdtree *tree, const double *pos, void **data, int n)
+{
+	struct kdnode **nodes;
+	char *block;
+	size_t nsize;
+	int i, dim = tree->dim;
+
+	if(tree->root || tree->origin || n < 0) return -1;
+	if(n == 0) return 0;
+
+	/* nodes are allocated in one block, which kd_optimize then replaces
+	 * with a copy laid out in search order */
+	nsize = node_size(tree);
+	if(!(nodes = malloc(n * sizeof *nodes))) {
+		return -1;
+	}
+	if(!(block = malloc(n * nsize))) {
+		free(nodes);
+		return -1;
+	}
+	if(!(tree->rect = hyperrect_create(dim, pos, pos))) {
+		free(block);
+		free(nodes);
+		return -1;
+	}
+	for(i=1; i<n; i++) {
+		hyperrect_extend(tree->rect, pos + (size_t)i * dim);
+	}
+
+	/* quantized trees without a box of their own take the bounding box */
+	if(tree->qbits && !tree->qmin && quant_box(tree, tree->rect->min, tree->rect->max) == -1) {
+		hyperrect_free(tree->rect);
+		tree->rect = 0;
+		free(block);
+		free(nodes);
+		return -1;
+	}
+
+	for(i=0; i<n; i++) {
+		const double *p = pos + (size_t)i * dim;
+
+		nodes[i] = (struct kdnode*)(block + i * nsize);
+		if(tree->qbits) {
+			nodes[i]->pos = 0;
+			quant_encode(tree, nodes[i], p);
+			hyperrect_extend_node(tree, tree->rect, nodes[i]);
+		} else {
+			nodes[i]->pos = (double*)(nodes[i] + 1);
+			memcpy(nodes[i]->pos, p, dim * sizeof *p);
+		}
+		nodes[i]->data = data ? data[i] : 0;
+		nodes[i]->id = i;
+		nodes[i]->tag = 0;
+		nodes[i]->expires = HUGE_VAL;
+		nodes[i]->dups = 0;
+	}
+
+	tree->root = build_rec(tree, nodes, n, 0);
+	scan_reset(tree);
+	sums_free(tree);
+	tree->pool = block;
+	tree->pool_size = n * nsize;
+	tree->size = n;
+	tree->next_id = n;
+	tree->mem += n * nsize + RECT_SIZE(dim);
+	free(nodes);
+
+	/* if there's no memory for the copy, the tree keeps the build order */
+	kd_optimize(tree);
+	return 0;
+}
+
+/* ---- cache-oblivious layout ---- */
+
+static int height_rec(struct kdnode *node)
+{
+	int hl, hr;
+
+	if(!node) return 0;
+	hl = height_rec(node->left);
+	hr = height_rec(node->right);
+	return 1 + (hl > hr ? hl : hr);
+}
+
+static void veb_rec(struct kdnode *node, int height, struct kdnode **order, int *count);
+
+/* lays out the subtrees "depth" levels below node, from left to right */
+static void veb_bottom(struct kdnode *node, int depth, int height, struct kdnode **order, int *count)
+{
+	if(!node) return;
+
+	if(depth == 0) {
+		veb_rec(node, height, order, count);
+		return;
+	}
+	veb_bottom(node->left, depth - 1, height, order, count);
+	veb_bottom(node->right, depth - 1, height, order, count);
+}
+
+/* appends the nodes of the top "height" levels below node to order, in van
+ * Emde Boas order: the top half of the levels first, then each subtree
+ * hanging off it. Any root-to-leaf path then crosses O(log n / log B)
+ * blocks of B nodes, for every block size B.
+ */
+static void veb_rec(struct kdnode *node, int height, struct kdnode **order, int *count)
+{
+	int top;
+
+	if(!node) return;
+
+	if(height == 1) {
+		order[(*count)++] = node;
+		return;
+	}
+	top = height / 2;
+	veb_rec(node, top, order, count);
+	veb_bottom(node, top, height - top, order, count);
+}
+
+int kd_optimize(struct kdtree *tree)
+{
+	struct kdnode **order, *node, *copy;
+	char *pool;
+	size_t nsize = node_size(tree);
+	int i, n = 0;
+
+	/* snapshots may be searching the nodes which are about to move */
+	if(tree->origin || kd_snapshot_count(tree) > 0) return -1;
+	if(!tree->root) return 0;
+
+	/* there may be fewer nodes than points, see kd_merge_duplicates, and
+	 * more, see kd_expire */
+	if(!(order = malloc((tree->size + tree->removed) * sizeof *order))) {
+		return -1;
+	}
+	veb_rec(tree->root, height_rec(tree->root), order, &n);
+	if(!(pool = malloc(n * nsize))) {
+		free(order);
+		return -1;
+	}
+
+	/* copy each node and its coordinates into place, and leave the address
+	 * of the copy in the pos field of the old node */
+	for(i=0; i<n; i++) {
+		node = order[i];
+		copy = (struct kdnode*)(pool + i * nsize);
+		if(tree->qbits) {
+			memcpy(copy, node, nsize);
+		} else {
+			*copy = *node;
+			copy->pos = (double*)(copy + 1);
+			memcpy(copy->pos, node->pos, tree->dim * sizeof *copy->pos);
+			if(!IN_POOL(tree->pool, tree->pool_size, node)) {
+				free(node->pos);
+			}
+		}
+		node->pos = (double*)copy;
+	}
+	tree->root = (struct kdnode*)tree->root->pos;
+
+	for(i=0; i<n; i++) {
+		copy = (struct kdnode*)(pool + i * nsize);
+		if(copy->left) {
+			copy->left = (struct kdnode*)copy->left->pos;
+		}
+		if(copy->right) {
+			copy->right = (struct kdnode*)copy->right->pos;
+		}
+	}
+
+	for(i=0; i<n; i++) {
+		if(!IN_POOL(tree->pool, tree->pool_size, order[i])) {
+			free(order[i]);
+		}
+	}
+	free(tree->pool);
+	free(order);
+	cache_flush(tree);
+	ids_drop(tree);
+	scan_reset(tree);
+	sums_free(tree);
+	tree->changes++;
+
+	tree->pool = pool;
+	tree->pool_size = n * nsize;
+	return 0;
+}
+
+/* ---- expiry ---- */
+
+/* counts the points, removed nodes and bytes of a subtree */
+static void count_rec(const struct kdtree *kd, const struct kdnode *node, int *points, int *removed, size_t *mem)
+{
+	const struct dup_chunk *chunk;
+	int i;
+
+	if(!node) return;
+
+	if(node->expires == REMOVED) {
+		(*removed)++;
+	} else {
+		for(i=0; node_value(kd, node, i, 0) != -1; i++);
+		*points += i;
+	}
+	*mem += node_size(kd);
+	for(chunk = node->dups; chunk; chunk = chunk->next) {
+		*mem += DUP_CHUNK_SIZE(chunk->cap);
+	}
+	count_rec(kd, node->left, points, removed, mem);
+	count_rec(kd, node->right, points, removed, mem);
+}
+
+/* releases the values of a node, which stays in the tree as a removed
+ * node. Returns the number of values released. */
+static int remove_node(struct kdtree *kd, struct kdnode *node)
+{
+	struct dup_chunk *chunk;
+	int count = 1;
+
+	for(chunk = node->dups; chunk; chunk = chunk->next) {
+		count += chunk->count;
+		kd->mem -= DUP_CHUNK_SIZE(chunk->cap);
+	}
+	if(kd->destr) {
+		kd->destr(node->data);
+	}
+	clear_dups(node->dups, kd->destr);
+	node->data = 0;
+	node->dups = 0;
+	node->expires = REMOVED;
+	kd->removed++;
+	return count;
+}
+
+/* removes the points of a subtree which expired at or before "now", and
+ * returns their number. Subtrees without expired points are skipped, and
+ * subtrees without any point left are freed at once. */
+static int expire_rec(struct kdtree *kd, struct kdnode **nptr, double now)
+{
+	struct kdnode *node = *nptr;
+	int points = 0, removed = 0;
+	size_t mem = 0;
+
+	if(!node || node->min_expires > now) return 0;
+
+	if(node->max_expires <= now) {
+		count_rec(kd, node, &points, &removed, &mem);
+		clear_rec(node, kd->destr, kd->pool, kd->pool_size);
+		*nptr = 0;
+		kd->removed -= removed;
+		kd->mem -= mem;
+		return points;
+	}
+
+	points = expire_rec(kd, &node->left, now) + expire_rec(kd, &node->right, now);
+	if(node->expires <= now && node->expires != REMOVED) {
+		points += remove_node(kd, node);
+	}
+	summarize(node);
+	return points;
+}
+
+/* collects the live nodes of a subtree, and frees the removed ones */
+static void collect_live(struct kdtree *kd, struct kdnode *node, struct kdnode **nodes, int *n)
+{
+	struct kdnode *left, *right;
+
+	if(!node) return;
+
+	left = node->left;
+	right = node->right;
+	if(node->expires != REMOVED) {
+		nodes[(*n)++] = node;
+	} else {
+		kd->mem -= node_size(kd);
+		if(!IN_POOL(kd->pool, kd->pool_size, node)) {
+			free(node->pos);
+			free(node);
+		}
+	}
+	collect_live(kd, left, nodes, n);
+	collect_live(kd, right, nodes, n);
+}
+
+/* rebuilds a balanced tree from the live nodes, dropping the removed ones */
+static int rebuild(struct kdtree *kd)
+{
+	struct kdnode **nodes;
+	int i, j, n = 0;
+
+	if(!(nodes = malloc((kd->size + kd->removed) * sizeof *nodes))) {
+		return -1;
+	}
+	collect_live(kd, kd->root, nodes, &n);
+	kd->removed = 0;
+	kd->root = build_rec(kd, nodes, n, 0);
+
+	/* the bounding box may have shrunk */
+	if(n > 0) {
+		for(j=0; j<kd->dim; j++) {
+			kd->rect->min[j] = kd->rect->max[j] = COORD(kd, nodes[0], j);
+		}
+		for(i=1; i<n; i++) {
+			hyperrect_extend_node(kd, kd->rect, nodes[i]);
+		}
+	}
+	free(nodes);
+	return kd_optimize(kd);
+}
+
+int kd_split(struct kdtree *tree, int policy)
+{
+	if(tree->origin || policy < KD_SPLIT_CYCLE || policy > KD_SPLIT_MIDPOINT) return -1;
+	tree->split = policy;
+	return 0;
+}
+
+int kd_rebuild(struct kdtree *tree)
+{
+	/* snapshots may be searching the nodes which are about to move */
+	if(tree->origin || kd_snapshot_count(tree) > 0) return -1;
+	if(!tree->root) return 0;
+
+	cache_flush(tree);
+	ids_drop(tree);
+	scan_reset(tree);
+	sums_free(tree);
+	tree->changes++;
+	return rebuild(tree);
+}
+
+int kd_expire(struct kdtree *tree, double now)
+{
+	int points;
+
+	/* snapshots may be searching the nodes which are about to be freed */
+	if(tree->origin || kd_snapshot_count(tree) > 0) return -1;
+
+	cache_flush(tree);
+	ids_drop(tree);
+	scan_reset(tree);
+	sums_free(tree);
+	tree->changes++;
+	points = expire_rec(tree, &tree->root, now);
+	tree->size -= points;
+
+	/* rebuild once there are as many removed nodes as points */
+	if(tree->root && tree->removed > 0 && tree->removed >= tree->size) {
+		rebuild(tree);
+	}
+
+	if(!tree->root) {
+		free(tree->pool);
+		tree->pool = 0;
+		tree->pool_size = 0;
+		if(tree->rect) {
+			hyperrect_free(tree->rect);
+			tree->rect = 0;
+			tree->mem -= RECT_SIZE(tree->dim);
+		}
+	}
+	return points;
+}
+
+/* ---- updates ---- */
+
+/* makes room in the id index for "id", if there is one */
+static int ids_reserve(struct kdtree *kd, int id)
+{
+	struct kdnode **by_id;
+	int cap;
+
+	if(!kd->by_id || id < kd->by_id_cap) return 0;
+
+	cap = kd->by_id_cap * 2 > id ? kd->by_id_cap * 2 : id + 1;
+	if(!(by_id = realloc(kd->by_id, cap * sizeof *by_id))) {
+		return -1;
+	}
+	memset(by_id + kd->by_id_cap, 0, (cap - kd->by_id_cap) * sizeof *by_id);
+	kd->mem += (cap - kd->by_id_cap) * sizeof *by_id;
+	kd->by_id = by_id;
+	kd->by_id_cap = cap;
+	return 0;
+}
+
+/* drops the id index, when nodes are moved or freed */
+static void ids_drop(struct kdtree *kd)
+{
+	if(!kd->by_id) return;
+
+	kd->mem -= kd->by_id_cap * sizeof *kd->by_id;
+	free(kd->by_id);
+	kd->by_id = 0;
+	kd->by_id_cap = 0;
+}
+
+static void ids_rec(struct kdtree *kd, struct kdnode *node)
+{
+	int i, id;
+
+	if(!node) return;
+
+	if(node->expires != REMOVED) {
+		for(i=0; (id = node_value(kd, node, i, 0)) != -1; i++) {
+			kd->by_id[id] = node;
+		}
+	}
+	ids_rec(kd, node->left);
+	ids_rec(kd, node->right);
+}
+
+/* indexes the node holding each id */
+static int ids_create(struct kdtree *kd)
+{
+	int cap = kd->next_id > 16 ? kd->next_id : 16;
+
+	if(!(kd->by_id = calloc(cap, sizeof *kd->by_id))) {
+		return -1;
+	}
+	kd->by_id_cap = cap;
+	kd->mem += cap * sizeof *kd->by_id;
+	ids_rec(kd, kd->root);
+	return 0;
+}
+
+/* removes the value with the given id from a node holding several, and
+ * returns its data */
+static void *dup_remove(struct kdtree *kd, struct kdnode *node, int id)
+{
+	struct dup_chunk *chunk, *prev, *last = 0, *last_prev = 0;
+	struct dup_item *hole = 0, *it;
+	void *data = 0;
+	int i;
+
+	if(node->id == id) {
+		/* the first duplicate takes the place of the node's own value */
+		data = node->data;
+		node->id = node->dups->items[0].id;
+		node->data = node->dups->items[0].data;
+		hole = node->dups->items;
+	}
+
+	/* move the values after the removed one forward, to fill its place */
+	for(prev = 0, chunk = node->dups; chunk; prev = chunk, chunk = chunk->next) {
+		for(i=0; i<chunk->count; i++) {
+			it = chunk->items + i;
+			if(hole) {
+				if(hole != it) {
+					*hole = *it;
+					hole = it;
+				}
+			} else if(it->id == id) {
+				data = it->data;
+				hole = it;
+			}
+		}
+		last = chunk;
+		last_prev = prev;
+	}
+
+	/* chunks are filled in order, so only the last one can become empty */
+	if(--last->count == 0) {
+		if(last_prev) {
+			last_prev->next = 0;
+		} else {
+			node->dups = 0;
+		}
+		kd->mem -= DUP_CHUNK_SIZE(last->cap);
+		free(last);
+	}
+	return data;
+}
+
+/* the way from the root to a node, as the addresses of the links to each
+ * node on the way. Paths up to PATH_STACK links deep stay on the stack. */
+#define PATH_STACK		64
+
+struct path {
+	struct kdnode ***links;
+	int cap;
+	struct kdnode **stack[PATH_STACK];
+};
+
+/* stores the path from "link" down to "node", and returns its length, 0 if
+ * the node was not found, or -1 on error. Nodes at the coordinate of the
+ * splitting plane of a node may be on either side of it. */
+static int find_path(struct kdtree *kd, struct kdnode **link, const struct kdnode *node,
+		struct path *path, int depth)
+{
+	struct kdnode ***grown;
+	double a, b;
+	int len;
+
+	if(!*link) return 0;
+
+	if(depth == path->cap) {
+		if(path->links == path->stack) {
+			if((grown = malloc(2 * path->cap * sizeof *grown))) {
+				memcpy(grown, path->stack, path->cap * sizeof *grown);
+			}
+		} else {
+			grown = realloc(path->links, 2 * path->cap * sizeof *grown);
+		}
+		if(!grown) {
+			return -1;
+		}
+		path->links = grown;
+		path->cap *= 2;
+	}
+	path->links[depth] = link;
+	if(*link == node) {
+		return depth + 1;
+	}
+
+	a = COORD(kd, node, (*link)->dir);
+	b = COORD(kd, *link, (*link)->dir);
+	if(a <= b && (len = find_path(kd, &(*link)->left, node, path, depth + 1)) != 0) {
+		return len;
+	}
+	if(a >= b) {
+		return find_path(kd, &(*link)->right, node, path, depth + 1);
+	}
+	return 0;
+}
+
+static void path_free(struct path *path)
+{
+	if(path->links != path->stack) {
+		free(path->links);
+	}
+}
+
+/* makes room for one more value at the node below "cur" which insert_rec
+ * would merge a point at "pos" into, if any, so that linking the point
+ * again cannot fail once it has left its place. Returns -1 if memory runs
+ * out. */
+static int merge_reserve(struct kdtree *kd, struct kdnode *cur, const double *pos,
+		unsigned int tag, double expires)
+{
+	int i;
+
+	while(cur) {
+		if(pos[cur->dir] < COORD(kd, cur, cur->dir)) {
+			cur = cur->left;
+			continue;
+		}
+		if(kd->merge && tag == cur->tag && expires == cur->expires) {
+			for(i=0; i<kd->dim && pos[i] == COORD(kd, cur, i); i++);
+			if(i == kd->dim) {
+				return dup_room(kd, cur) ? 0 : -1;
+			}
+		}
+		cur = cur->right;
+	}
+	return 0;
+}
+
+/* links a moved node below "link", where it may be merged into another.
+ * Room for the merge was made by merge_reserve, so this cannot fail. */
+static void relink(struct kdtree *kd, struct kdnode **link, struct kdnode *moved)
+{
+	kd->by_id[moved->id] = moved;
+	if(insert_rec(kd, link, moved, (*link)->dir) == 1) {
+		kd->mem -= node_size(kd);
+		if(!IN_POOL(kd->pool, kd->pool_size, moved)) {
+			free(moved->pos);
+			free(moved);
+		}
+	}
+}
+
+/* moves a node with a single value to "pos", given as stored coordinates.
+ * Everything the move needs is allocated before the node leaves its place,
+ * so on failure the point stays where it was. */
+static int update_node(struct kdtree *kd, struct kdnode *node, const double *pos)
+{
+	struct path p;
+	struct kdnode ***path, **link, *moved = 0, *cur;
+	int len, cross;
+
+	p.links = p.stack;
+	p.cap = PATH_STACK;
+	if((len = find_path(kd, &kd->root, node, &p, 0)) <= 0) {
+		path_free(&p);
+		return -1;
+	}
+	path = p.links;
+
+	/* find the first node above whose splitting plane the point crosses */
+	for(cross = 0; cross < len - 1; cross++) {
+		cur = *path[cross];
+		if(path[cross + 1] == &cur->left ? pos[cur->dir] > COORD(kd, cur, cur->dir)
+				: pos[cur->dir] < COORD(kd, cur, cur->dir)) {
+			break;
+		}
+	}
+	link = path[cross];
+
+	/* the nodes below a node must stay on their side of its plane */
+	if(cross == len - 1 && ((!node->left && !node->right) || pos[node->dir] == COORD(kd, node, node->dir))) {
+		path_free(&p);
+		cache_invalidate_at(kd, node, pos);
+		if(kd->qbits) {
+			quant_encode(kd, node, pos);
+		} else {
+			memcpy(node->pos, pos, kd->dim * sizeof *pos);
+		}
+		hyperrect_extend(kd->rect, pos);
+		return 0;
+	}
+
+	/* otherwise insert the point again below the node whose plane it
+	 * crosses. A leaf moves along, while other nodes stay in place as
+	 * removed nodes so that the nodes below them keep their place. */
+	if(node->left || node->right) {
+		if(!(moved = node_create(kd, pos, node->data, node->id, node->tag))) {
+			path_free(&p);
+			return -1;
+		}
+		moved->expires = moved->min_expires = moved->max_expires = node->expires;
+	}
+	if(merge_reserve(kd, *link, pos, node->tag, node->expires) == -1) {
+		if(moved) {
+			free(moved->pos);
+			free(moved);
+		}
+		path_free(&p);
+		return -1;
+	}
+
+	cache_invalidate_at(kd, node, pos);
+	if(!moved) {
+		*path[len - 1] = 0;
+		moved = node;
+		if(kd->qbits) {
+			quant_encode(kd, moved, pos);
+		} else {
+			memcpy(moved->pos, pos, kd->dim * sizeof *pos);
+		}
+		summarize(moved);
+	} else {
+		node->data = 0;
+		node->expires = REMOVED;
+		summarize(node);
+		kd->removed++;
+		kd->mem += node_size(kd);
+	}
+	path_free(&p);
+
+	relink(kd, link, moved);
+	hyperrect_extend(kd->rect, pos);
+
+	/* rebuild once there are as many removed nodes as points */
+	if(kd->removed >= kd->size) {
+		rebuild(kd);
+	}
+	return 0;
+}
+
+int kd_update(struct kdtree *tree, int id, const double *pos)
+{
+	struct kdnode *node, *moved;
+	double sbuf[16], *stored = sbuf;
+	int i, ret = 0;
+
+	/* snapshots may be searching the node */
+	if(tree->origin || kd_snapshot_count(tree) > 0) return -1;
+	if(id < 0 || id >= tree->next_id) return -1;
+	if(!tree->by_id && ids_create(tree) == -1) return -1;
+	if(!(node = tree->by_id[id]) || node->expires == REMOVED) return -1;
+	scan_reset(tree);
+	sums_free(tree);
+	tree->changes++;
+
+	/* compare the coordinates as they will be stored */
+	if(tree->dim > 16 && !(stored = malloc(tree->dim * sizeof *stored))) {
+		return -1;
+	}
+	for(i=0; i<tree->dim; i++) {
+		stored[i] = tree->qbits ? tree->qmin[i] + quant_step(tree, pos[i], i) * tree->qstep[i] : pos[i];
+	}
+
+	if(!node->dups) {
+		ret = update_node(tree, node, stored);
+	} else {
+		/* a point which stays at a node holding several has nothing to do */
+		for(i=0; i<tree->dim && stored[i] == COORD(tree, node, i); i++);
+
+		if(i == tree->dim) {
+			ret = 0;
+		} else if(!(moved = node_create(tree, stored, 0, id, node->tag))) {
+			ret = -1;
+		} else if(merge_reserve(tree, tree->root, stored, node->tag, node->expires) == -1) {
+			free(moved->pos);
+			free(moved);
+			ret = -1;
+		} else {
+			/* the point leaves a node holding several, as a new node */
+			moved->expires = moved->min_expires = moved->max_expires = node->expires;
+			cache_invalidate_at(tree, node, stored);
+			moved->data = dup_remove(tree, node, id);
+			tree->mem += node_size(tree);
+			relink(tree, &tree->root, moved);
+			hyperrect_extend(tree->rect, stored);
+		}
+	}
+
+	if(stored != sbuf) {
+		free(stored);
+	}
+	return ret;
+}
+
+/* ---- linear scans ---- */
+
+#define SCAN_BLOCK		64
+
+#define SCAN_PROBE		64		/* one in this many searches walks the tree */
+
+/* kinds of searches, which keep separate counts of nodes visited */
+#define SCAN_NEAREST	0
+#define SCAN_RANGE		1
+
+/* the largest tree searched by linear scan in KD_SCAN_AUTO mode. For
+ * random query points in a balanced tree of uniform points, the scan wins
+ * up to about 2^(5 + 3/4 dim) points: 64 in 2-D, 2048 in 8-D and a million
+ * in 20-D. Queries close to points of the tree are answered faster by a
+ * walk in any number of dimensions, see scan_get. */
+static int scan_limit(int dim)
+{
+	int shift = 5 + 3 * dim / 4;
+
+	return shift < 31 ? 1 << shift : INT_MAX;
+}
+
+/* whether searches of the tree may scan a flat copy of its points instead
+ * of walking it, see kd_scan */
+static int scan_worthwhile(const struct kdtree *kd)
+{
+	if(kd->origin || kd->scan_mode == KD_SCAN_NEVER) return 0;
+	if(kd->scan_mode == KD_SCAN_ALWAYS) return 1;
+	return kd->size + kd->removed <= scan_limit(kd->dim);
+}
+
+static void scan_free(struct kdtree *kd)
+{
+	if(!kd->scan) return;
+	free(kd->scan->coords);
+	free(kd->scan->nodes);
+	free(kd->scan);
+	kd->scan = 0;
+}
+
+/* called whenever nodes are moved or removed; the next search fills the
+ * buffer again, if it still scans */
+static void scan_reset(struct kdtree *kd)
+{
+	if(!kd->scan) return;
+	if(scan_worthwhile(kd)) {
+		kd->scan->valid = 0;
+	} else {
+		scan_free(kd);
+	}
+}
+
+/* makes room for "cap" points, keeping the first "keep" of them, and
+ * pads the rest with points at infinity */
+static int scan_grow(struct kdtree *kd, int cap, int keep)
+{
+	struct kdscan *s = kd->scan;
+	double *coords;
+	struct kdnode **nodes;
+	int i, j;
+
+	if(!(coords = malloc((size_t)cap * kd->dim * sizeof *coords))) {
+		return -1;
+	}
+	if(!(nodes = realloc(s->nodes, cap * sizeof *nodes))) {
+		free(coords);
+		return -1;
+	}
+	for(j=0; j<kd->dim; j++) {
+		if(keep > 0) {
+			memcpy(coords + (size_t)j * cap, s->coords + (size_t)j * s->cap, keep * sizeof *coords);
+		}
+		for(i=keep; i<cap; i++) {
+			coords[(size_t)j * cap + i] = HUGE_VAL;
+		}
+	}
+	for(i=keep; i<cap; i++) {
+		nodes[i] = 0;
+	}
+	free(s->coords);
+	s->coords = coords;
+	s->nodes = nodes;
+	s->cap = cap;
+	return 0;
+}
+
+/* copies the live nodes of the tree into the buffer */
+static int scan_fill(struct kdtree *kd)
+{
+	struct kdscan *s = kd->scan;
+	struct kdnode **stack, *node;
+	int j, cap, n = 0, top = 0, nodes = kd->size + kd->removed;
+
+	if(!s) {
+		if(!(s = calloc(1, sizeof *s))) {
+			return -1;
+		}
+		kd->scan = s;
+	}
+	/* there may be fewer nodes than points, see kd_merge_duplicates */
+	cap = (nodes / SCAN_BLOCK + 1) * SCAN_BLOCK;
+	if(scan_grow(kd, cap, 0) == -1) {
+		return -1;
+	}
+	if(!(stack = malloc((nodes + 1) * sizeof *stack))) {
+		return -1;
+	}
+	if(kd->root) {
+		stack[top++] = kd->root;
+	}
+	while(top > 0) {
+		node = stack[--top];
+		if(node->left) stack[top++] = node->left;
+		if(node->right) stack[top++] = node->right;
+		if(node->expires == REMOVED) continue;
+
+		s->nodes[n] = node;
+		for(j=0; j<kd->dim; j++) {
+			s->coords[(size_t)j * cap + n] = COORD(kd, node, j);
+		}
+		n++;
+	}
+	free(stack);
+	s->size = n;
+	s->valid = 1;
+	return 0;
+}
+
+/* adds a new node to a filled buffer */
+static void scan_append(struct kdtree *kd, struct kdnode *node)
+{
+	struct kdscan *s = kd->scan;
+	int j;
+
+	if(!s) return;
+	if(!scan_worthwhile(kd)) {
+		scan_free(kd);
+		return;
+	}
+	if(!s->valid) return;
+	if(s->size == s->cap && scan_grow(kd, s->cap * 2, s->size) == -1) {
+		s->valid = 0;
+		return;
+	}
+	s->nodes[s->size] = node;
+	for(j=0; j<kd->dim; j++) {
+		s->coords[(size_t)j * s->cap + s->size] = COORD(kd, node, j);
+	}
+	s->size++;
+}
+
+/* returns the buffer to search, filling it first if needed, or null if
+ * the search walks the tree. In KD_SCAN_AUTO mode, searches scan if the
+ * nodes visited by recent searches of the same kind which walked the tree
+ * cost more than scanning all points; a visited node costs several times
+ * as much as a scanned point. Every SCAN_PROBE-th search walks the tree
+ * anyway, to keep the count current. */
+static struct kdscan *scan_get(struct kdtree *kd, int kind)
+{
+	struct kdscan *s = 0;
+	int scan;
+
+	if(!scan_worthwhile(kd)) return 0;
+
+	/* concurrent searches fill the buffer once; inserts don't run
+	 * alongside searches of the tree */
+	LOCK(kd);
+	scan = kd->scan_mode == KD_SCAN_ALWAYS || (kd->walk_nodes[kind] >= 0.0 &&
+			kd->walk_nodes[kind] * (4 * kd->dim + 64) > (double)kd->size * (kd->dim + 1) &&
+			++kd->searches % SCAN_PROBE != 0);
+	if(scan && ((kd->scan && kd->scan->valid) || scan_fill(kd) == 0)) {
+		s = kd->scan;
+	}
+	UNLOCK(kd);
+	return s;
+}
+
+/* adds the nodes visited by a search which walked the tree to the running
+ * average of scan_get */
+static void scan_count(struct kdtree *kd, int kind, int visits)
+{
+	double *avg = kd->walk_nodes + kind;
+
+	if(kd->scan_mode != KD_SCAN_AUTO || !scan_worthwhile(kd)) return;
+
+	LOCK(kd);
+	*avg = *avg < 0.0 ? visits : *avg + (visits - *avg) / 8;
+	UNLOCK(kd);
+}
+
+/* forgets the nodes visited by past searches */
+static void scan_uncount(struct kdtree *kd)
+{
+	kd->walk_nodes[SCAN_NEAREST] = kd->walk_nodes[SCAN_RANGE] = -1.0;
+	kd->searches = 0;
+}
+
+/* squared distances of the points of block "b" to "pos". The loops run
+ * over whole blocks of one axis at a time, so that compilers vectorize
+ * them. */
+static void scan_block(const struct kdscan *s, int dim, const double *pos, int b, double *dist)
+{
+	const double *x;
+	double sum[SCAN_BLOCK], p, d;
+	int i, j;
+
+	/* sums are kept in a local array, which can't overlap the coordinates */
+	for(i=0; i<SCAN_BLOCK; i++) {
+		sum[i] = 0.0;
+	}
+	for(j=0; j<dim; j++) {
+		x = s->coords + (size_t)j * s->cap + b;
+		p = pos[j];
+		for(i=0; i<SCAN_BLOCK; i++) {
+			d = x[i] - p;
+			sum[i] += d * d;
+		}
+	}
+	memcpy(dist, sum, sizeof sum);
+}
+
+/* the nearest point found by a query, like nearest_node */
+static struct kdnode *scan_nearest(struct kdtree *kd, const struct kdscan *s, const double *pos,
+		const struct kdquery *q)
+{
+	struct kdnode *result = 0;
+	double dist[SCAN_BLOCK], best, limit_sq = QUERY_LIMIT_SQ(q);
+	int b, i, n;
+
+	best = limit_sq < HUGE_VAL ? nextafter(limit_sq, HUGE_VAL) : HUGE_VAL;
+	for(b=0; b<s->size; b+=SCAN_BLOCK) {
+		scan_block(s, kd->dim, pos, b, dist);
+		n = s->size - b < SCAN_BLOCK ? s->size - b : SCAN_BLOCK;
+		for(i=0; i<n; i++) {
+			STAT(dists);
+			if(dist[i] < best && MATCH(q, s->nodes[b + i])) {
+				best = dist[i];
+				result = s->nodes[b + i];
+			}
+		}
+	}
+	return result;
+}
+
+/* adds the points within "range" found by a query to "list", like
+ * find_nearest, and returns their number */
+static int scan_range(struct kdtree *kd, const struct kdscan *s, const double *pos, double range,
+		const struct kdquery *q, struct res_node *list)
+{
+	double dist[SCAN_BLOCK], range_sq = SQ(range);
+	int b, i, n, count = 0;
+
+	for(b=0; b<s->size; b+=SCAN_BLOCK) {
+		scan_block(s, kd->dim, pos, b, dist);
+		n = s->size - b < SCAN_BLOCK ? s->size - b : SCAN_BLOCK;
+		for(i=0; i<n; i++) {
+			STAT(dists);
+			if(dist[i] <= range_sq && MATCH(q, s->nodes[b + i])) {
+				if(rlist_insert(list, s->nodes[b + i], -1.0) == -1) {
+					return -1;
+				}
+				count++;
+			}
+		}
+	}
+	return count;
+}
+
+int kd_scan(struct kdtree *tree, int mode)
+{
+	if(tree->origin || mode < KD_SCAN_AUTO || mode > KD_SCAN_NEVER) return -1;
+	tree->scan_mode = mode;
+	scan_uncount(tree);
+	scan_reset(tree);
+	return 0;
+}
+
+/* ---- index files ----
+ *
+ * An index file starts with a header of the magic "KDINDEX1" and the
+ * int32 fields dim, nodes, next_id and a reserved 0, followed by the nodes
+ * in depth first order, each as the int32 fields id, dir, tag and flags
+ * (INDEX_LEFT/INDEX_RIGHT if it has that child, INDEX_DUPS if it holds
+ * merged duplicates), the double expires and "dim" double coordinates.
+ * A node with INDEX_DUPS is followed by the int32 number of duplicates and
+ * their ids. Numbers are in the byte order of the machine.
+ */
+#define INDEX_MAGIC		"KDINDEX1"
+#define INDEX_LEFT		1
+#define INDEX_RIGHT		2
+#define INDEX_DUPS		4
+
+static int write_ints(FILE *fp, const int *v, int n)
+{
+	return fwrite(v, sizeof *v, n, fp) == (size_t)n ? 0 : -1;
+}
+
+static int read_ints(FILE *fp, int *v, int n)
+{
+	return fread(v, sizeof *v, n, fp) == (size_t)n ? 0 : -1;
+}
+
+/* lists the visible nodes of a tree in depth first order, returns their
+ * number or -1 if memory ran out */
+static int index_order(struct kdtree *kd, struct kdnode ***order)
+{
+	struct kdnode **stack = 0, **list = 0, **tmp, *node;
+	int top = 0, n = 0, cap = 64;
+
+	if(!(stack = malloc(cap * sizeof *stack)) || !(list = malloc(cap * sizeof *list))) {
+		goto err;
+	}
+	if(VISIBLE(kd, kd->root)) {
+		stack[top++] = kd->root;
+	}
+	while(top > 0) {
+		node = stack[--top];
+		/* the stack never holds more nodes than the list */
+		if(n + 2 >= cap) {
+			cap *= 2;
+			if(!(tmp = realloc(stack, cap * sizeof *stack))) goto err;
+			stack = tmp;
+			if(!(tmp = realloc(list, cap * sizeof *list))) goto err;
+			list = tmp;
+		}
+		list[n++] = node;
+		if(VISIBLE(kd, node->right)) stack[top++] = node->right;
+		if(VISIBLE(kd, node->left)) stack[top++] = node->left;
+	}
+	free(stack);
+	*order = list;
+	return n;
+
+err:
+	free(stack);
+	free(list);
+	return -1;
+}
+
+int kd_save(struct kdtree *kd, FILE *fp)
+{
+	struct kdnode **order, *node;
+	struct dup_chunk *chunk;
+	double *buf;
+	int i, j, n, ndups, head[4], rec[4];
+
+	if((n = index_order(kd, &order)) == -1) {
+		return -1;
+	}
+	if(!(buf = malloc((kd->dim + 1) * sizeof *buf))) {
+		free(order);
+		return -1;
+	}
+
+	head[0] = kd->dim;
+	head[1] = n;
+	head[2] = kd->origin ? kd->limit : kd->next_id;
+	head[3] = 0;
+	if(fwrite(INDEX_MAGIC, 1, 8, fp) != 8 || write_ints(fp, head, 4) == -1) {
+		goto err;
+	}
+	for(i=0; i<n; i++) {
+		node = order[i];
+		ndups = 0;
+		for(chunk = node->dups; chunk; chunk = chunk->next) {
+			for(j=0; j<chunk->count; j++) {
+				ndups += chunk->items[j].id < kd->limit;
+			}
+		}
+		rec[0] = node->id;
+		rec[1] = node->dir;
+		rec[2] = (int)node->tag;
+		rec[3] = (VISIBLE(kd, node->left) ? INDEX_LEFT : 0) | (VISIBLE(kd, node->right) ? INDEX_RIGHT : 0) |
+			(ndups ? INDEX_DUPS : 0);
+		buf[0] = node->expires;
+		for(j=0; j<kd->dim; j++) {
+			buf[j + 1] = COORD(kd, node, j);
+		}
+		if(write_ints(fp, rec, 4) == -1 || fwrite(buf, sizeof *buf, kd->dim + 1, fp) != (size_t)kd->dim + 1) {
+			goto err;
+		}
+		if(!ndups) continue;
+		if(write_ints(fp, &ndups, 1) == -1) {
+			goto err;
+		}
+		for(chunk = node->dups; chunk; chunk = chunk->next) {
+			for(j=0; j<chunk->count; j++) {
+				if(chunk->items[j].id < kd->limit && write_ints(fp, &chunk->items[j].id, 1) == -1) {
+					goto err;
+				}
+			}
+		}
+	}
+	free(order);
+	free(buf);
+	return fflush(fp) == 0 ? 0 : -1;
+
+err:
+	free(order);
+	free(buf);
+	return -1;
+}
+
+struct kdtree *kd_load(FILE *fp)
+{
+	struct kdtree *kd;
+	struct kdnode *node, ***slots = 0;
+	char magic[8], *block = 0;
+	size_t nsize, count;
+	int i, j, top = 0, ndups, head[4], rec[4];
+
+	if(fread(magic, 1, 8, fp) != 8 || memcmp(magic, INDEX_MAGIC, 8) != 0 ||
+			read_ints(fp, head, 4) == -1 || head[0] <= 0 || head[1] < 0 || head[2] < head[1]) {
+		return 0;
+	}
+	if(!(kd = kd_create(head[0]))) {
+		return 0;
+	}
+	if(head[1] == 0) {
+		kd->next_id = head[2];
+		return kd;
+	}
+
+	/* the nodes are read into one block, like kd_build, and linked into the
+	 * child links waiting for them on a stack */
+	nsize = node_size(kd);
+	count = (size_t)head[1];
+
+	/* a count whose blocks can't be addressed is as bad as a short file */
+	if(count > ((size_t)-1) / nsize || count >= ((size_t)-1) / sizeof *slots) {
+		goto err;
+	}
+	if(!(block = malloc(count * nsize)) || !(slots = malloc((count + 1) * sizeof *slots))) {
+		goto err;
+	}
+	kd->pool = block;
+	kd->pool_size = count * nsize;
+	kd->mem += count * nsize;
+	slots[top++] = &kd->root;
+
+	for(i=0; i<head[1]; i++) {
+		node = (struct kdnode*)(block + i * nsize);
+		node->pos = (double*)(node + 1);
+		node->data = 0;
+		node->dups = 0;
+		node->left = node->right = 0;
+		if(top == 0 || read_ints(fp, rec, 4) == -1 || fread(&node->expires, sizeof(double), 1, fp) != 1 ||
+				fread(node->pos, sizeof(double), kd->dim, fp) != (size_t)kd->dim ||
+				rec[0] < 0 || rec[0] >= head[2] || rec[1] < 0 || rec[1] >= kd->dim) {
+			goto err;
+		}
+		node->id = rec[0];
+		node->dir = rec[1];
+		node->tag = (unsigned int)rec[2];
+		*slots[--top] = node;
+		if(rec[3] & INDEX_RIGHT) slots[top++] = &node->right;
+		if(rec[3] & INDEX_LEFT) slots[top++] = &node->left;
+		if(top > head[1] - i) {
+			goto err;
+		}
+
+		if(node->expires == REMOVED) {
+			kd->removed++;
+		} else {
+			kd->size++;
+			if(kd->rect) {
+				hyperrect_extend(kd->rect, node->pos);
+			} else if(!(kd->rect = hyperrect_create(kd->dim, node->pos, node->pos))) {
+				goto err;
+			} else {
+				kd->mem += RECT_SIZE(kd->dim);
+			}
+		}
+		if(rec[3] & INDEX_DUPS) {
+			if(read_ints(fp, &ndups, 1) == -1 || ndups < 0) {
+				goto err;
+			}
+			for(j=0; j<ndups; j++) {
+				int id;
+				if(read_ints(fp, &id, 1) == -1 || id < 0 || id >= head[2] || dup_append(kd, node, 0, id) == -1) {
+					goto err;
+				}
+			}
+			kd->size += ndups;
+			kd->merge = 1;
+		}
+	}
+	if(top != 0 || !kd->rect) {
+		goto err;
+	}
+
+	/* children follow their parents, so this summarizes them first */
+	for(i=head[1] - 1; i>=0; i--) {
+		summarize((struct kdnode*)(block + i * nsize));
+	}
+	kd->next_id = head[2];
+	free(slots);
+
+	/* if there's no memory for the copy, the tree keeps the file order */
+	kd_optimize(kd);
+	return kd;
+
+err:
+	free(slots);
+	if(!kd->pool) {
+		free(block);
+	}
+	kd_free(kd);
+	return 0;
+}
+
+static int find_nearest(struct kdtree *kd, struct kdnode *node, const double *pos, double range,
+		const struct kdquery *q, struct res_node *list, int ordered, int *visits)
+{
+	double dist_sq, dx;
+	int i, ret, added_res = 0, dim = kd->dim;
+
+	if(!VISIBLE(kd, node)) return 0;
+	if(!SUBTREE_MATCH(q, node)) {
+		STAT(pruned);
+		return 0;
+	}
+	STAT(nodes);
+	(*visits)++;
+
+	if(MATCH(q, node)) {
+		dist_sq = 0;
+		for(i=0; i<dim; i++) {
+			dist_sq += SQ(COORD(kd, node, i) - pos[i]);
+		}
+		STAT(dists);
+		if(dist_sq <= SQ(range)) {
+			if(rlist_insert(list, node, ordered ? dist_sq : -1.0) == -1) {
+				return -1;
+			}
+			added_res = 1;
+		}
+	}
+
+	dx = pos[node->dir] - COORD(kd, node, node->dir);
+
+	ret = find_nearest(kd, dx <= 0.0 ? node->left : node->right, pos, range, q, list, ordered, visits);
+	if(ret >= 0 && fabs(dx) <= range) {
+		added_res += ret;
+		ret = find_nearest(kd, dx <= 0.0 ? node->right : node->left, pos, range, q, list, ordered, visits);
+	}
+#ifdef KD_STATS
+	else if(ret >= 0 && VISIBLE(kd, dx <= 0.0 ? node->right : node->left)) {
+		STAT(pruned);
+	}
+#endif
+	if(ret == -1) {
+		return -1;
+	}
+	added_res += ret;
+
+	return added_res;
+}
+
+/* state of a nearest N search: the best "num" points found so far are kept in
+ * "list", ordered by distance, and "max_sq" is the distance of the farthest.
+ */
+struct nearest_n {
+	struct kdtree *kd;
+	const struct kdquery *q;
+	const double *pos;
+	int num, size;
+	double max_sq;
+	double limit_sq;		/* points farther away are not found */
+	struct res_node *list;
+};
+
+static int find_nearest_n(struct kdnode *node, struct nearest_n *nn)
+{
+	double dist_sq, dx;
+	int i;
+
+	if(!VISIBLE(nn->kd, node)) return 0;
+	if(!SUBTREE_MATCH(nn->q, node)) {
+		STAT(pruned);
+		return 0;
+	}
+	STAT(nodes);
+
+	/* if the point is close enough, add it to the result list */
+	if(MATCH(nn->q, node)) {
+		dist_sq = 0;
+		for(i=0; i<nn->kd->dim; i++) {
+			dist_sq += SQ(COORD(nn->kd, node, i) - nn->pos[i]);
+		}
+		STAT(dists);
+		if(dist_sq <= nn->limit_sq && (nn->size < nn->num || dist_sq < nn->max_sq)) {
+			if(rlist_insert_n(nn, node, dist_sq) == -1) {
+				return -1;
+			}
+		}
+	}
+
+	/* find signed distance from the splitting plane */
+	dx = nn->pos[node->dir] - COORD(nn->kd, node, node->dir);
+
+	if(find_nearest_n(dx <= 0.0 ? node->left : node->right, nn) == -1) {
+		return -1;
+	}
+	if(nn->size < nn->num ? SQ(dx) <= nn->limit_sq : SQ(dx) < nn->max_sq) {
+		return find_nearest_n(dx <= 0.0 ? node->right : node->left, nn);
+	}
+	STAT(pruned);
+	return 0;
+}
+
+static void kd_nearest_i(struct kdtree *kd, struct kdnode *node, const double *pos, const struct kdquery *q,
+		struct kdnode **result, double *result_dist_sq, struct kdhyperrect* rect, int *visits)
+{
+	int dir = node->dir;
+	int i;
+	double dummy, dist_sq, split;
+	struct kdnode *nearer_subtree, *farther_subtree;
+	double *nearer_hyperrect_coord, *farther_hyperrect_coord;
+
+	STAT(nodes);
+	(*visits)++;
+
+	/* Decide whether to go left or right in the tree */
+	split = COORD(kd, node, dir);
+	dummy = pos[dir] - split;
+	if (dummy <= 0) {
+		nearer_subtree = node->left;
+		farther_subtree = node->right;
+		nearer_hyperrect_coord = rect->max + dir;
+		farther_hyperrect_coord = rect->min + dir;
+	} else {
+		nearer_subtree = node->right;
+		farther_subtree = node->left;
+		nearer_hyperrect_coord = rect->min + dir;
+		farther_hyperrect_coord = rect->max + dir;
+	}
+
+	if (VISIBLE(kd, nearer_subtree) && SUBTREE_MATCH(q, nearer_subtree)) {
+		/* Slice the hyperrect to get the hyperrect of the nearer subtree */
+		dummy = *nearer_hyperrect_coord;
+		*nearer_hyperrect_coord = split;
+		/* Recurse down into nearer subtree */
+		kd_nearest_i(kd, nearer_subtree, pos, q, result, result_dist_sq, rect, visits);
+		/* Undo the slice */
+		*nearer_hyperrect_coord = dummy;
+	}
+
+	/* Check the distance of the point at the current node, compare it
+	 * with our best so far */
+	if (MATCH(q, node)) {
+		dist_sq = 0;
+		for(i=0; i < rect->dim; i++) {
+			dist_sq += SQ(COORD(kd, node, i) - pos[i]);
+		}
+		STAT(dists);
+		if (dist_sq < *result_dist_sq) {
+			*result = node;
+			*result_dist_sq = dist_sq;
+		}
+	}
+
+	if (VISIBLE(kd, farther_subtree) && SUBTREE_MATCH(q, farther_subtree)) {
+		/* Get the hyperrect of the farther subtree */
+		dummy = *farther_hyperrect_coord;
+		*farther_hyperrect_coord = split;
+		/* Check if we have to recurse down by calculating the closest
+		 * point of the hyperrect and see if it's closer than our
+		 * minimum distance in result_dist_sq. */
+		if (hyperrect_dist_sq(rect, pos) < *result_dist_sq) {
+			/* Recurse down into farther subtree */
+			kd_nearest_i(kd, farther_subtree, pos, q, result, result_dist_sq, rect, visits);
+		} else {
+			STAT(pruned);
+		}
+		/* Undo the slice on the hyperrect */
+		*farther_hyperrect_coord = dummy;
+	}
+}
+
+struct kdres *kd_nearest(struct kdtree *kd, const double *pos)
+{
+	return kd_nearest_q(kd, pos, 0);
+}
+
+struct kdres *kd_nearest_q(struct kdtree *kd, const double *pos, const struct kdquery *q)
+{
+	/* results which depend on the time of the query are not cached */
+	if (kd && kd->cache && !(q && q->now != 0.0)) {
+		return cache_search(kd, pos, 0, q);
+	}
+	return nearest_q(kd, pos, q);
+}
+
+/* finds the node nearest to "pos" matching the query, if any is within its
+ * range. "rect" is a copy of the bounding box of the tree, which the search
+ * slices and restores again. */
+static struct kdnode *nearest_node(struct kdtree *kd, const double *pos, const struct kdquery *q,
+		struct kdhyperrect *rect)
+{
+	struct kdnode *result = 0;
+	struct kdscan *scan;
+	double dist_sq, limit_sq = QUERY_LIMIT_SQ(q);
+	int i, visits = 0;
+
+	if ((scan = scan_get(kd, SCAN_NEAREST))) {
+		return scan_nearest(kd, scan, pos, q);
+	}
+
+	/* Our first guesstimate is the root node, if the query finds it and it
+	 * is in range, otherwise the search starts pruning from the range. The
+	 * search keeps points strictly nearer than dist_sq, so a point exactly
+	 * at the limit is still found. */
+	dist_sq = limit_sq < HUGE_VAL ? nextafter(limit_sq, HUGE_VAL) : HUGE_VAL;
+	if (MATCH(q, kd->root)) {
+		double root_sq = 0;
+		for (i = 0; i < kd->dim; i++)
+			root_sq += SQ(COORD(kd, kd->root, i) - pos[i]);
+		STAT(dists);
+		if (root_sq <= limit_sq) {
+			result = kd->root;
+			dist_sq = root_sq;
+		}
+	}
+
+	/* Search for the nearest neighbour recursively */
+	if (SUBTREE_MATCH(q, kd->root)) {
+		kd_nearest_i(kd, kd->root, pos, q, &result, &dist_sq, rect, &visits);
+	}
+	scan_count(kd, SCAN_NEAREST, visits);
+	return result;
+}
+
+static struct kdres *nearest_q(struct kdtree *kd, const double *pos, const struct kdquery *q)
+{
+	struct kdhyperrect *rect;
+	struct kdnode *result;
+	struct kdres *rset;
+
+	if (!kd) return 0;
+	if (!kd->rect) return 0;
+
+	/* Allocate result set */
+	if(!(rset = malloc(sizeof *rset))) {
+		return 0;
+	}
+	if(!(rset->rlist = alloc_resnode())) {
+		free(rset);
+		return 0;
+	}
+	rset->rlist->next = 0;
+	rset->tree = kd;
+	result = 0;
+
+	/* No point can be found if the whole tree is out of range */
+	if (hyperrect_dist_sq(kd->rect, pos) > QUERY_LIMIT_SQ(q)) {
+		STAT(pruned);
+	} else {
+		/* Duplicate the bounding hyperrectangle, we will work on the copy */
+		if (!(rect = hyperrect_duplicate(kd->rect))) {
+			kd_res_free(rset);
+			return 0;
+		}
+		result = nearest_node(kd, pos, q, rect);
+		hyperrect_free(rect);
+	}
+
+	/* Store the result */
+	if (result) {
+		if (rlist_insert(rset->rlist, result, -1.0) == -1) {
+			kd_res_free(rset);
+			return 0;
+		}
+		rset->size = 1;
+	} else {
+		/* no point matches the query */
+		rset->size = 0;
+	}
+	kd_res_rewind(rset);
+	return rset;
+}
+
+/* a query of a batch, and its position along the Z-order curve */
+struct batch_key {
+	unsigned int code;
+	int index;
+};
+
+static int batch_key_cmp(const void *a, const void *b)
+{
+	const struct batch_key *x = a, *y = b;
+
+	if(x->code != y->code) {
+		return x->code < y->code ? -1 : 1;
+	}
+	return x->index - y->index;
+}
+
+/* computes the Morton code of each query: the bits of its cell in a grid
+ * over the bounding box of all queries, interleaved over the first (up to
+ * 32) dimensions */
+static void batch_codes(const double *pos, int count, int dim, struct batch_key *keys)
+{
+	double min[32], scale[32], x;
+	unsigned int cell[32], maxcell;
+	int i, j, b, ndim = dim < 32 ? dim : 32, bits = 32 / ndim;
+
+	maxcell = bits < 32 ? (1u << bits) - 1 : UINT_MAX;
+	for(j=0; j<ndim; j++) {
+		double max = min[j] = pos[j];
+		for(i=1; i<count; i++) {
+			x = pos[(size_t)i * dim + j];
+			if(x < min[j]) min[j] = x;
+			if(x > max) max = x;
+		}
+		scale[j] = max > min[j] ? maxcell / (max - min[j]) : 0.0;
+	}
+
+	for(i=0; i<count; i++) {
+		const double *p = pos + (size_t)i * dim;
+
+		for(j=0; j<ndim; j++) {
+			x = (p[j] - min[j]) * scale[j];
+			cell[j] = x > 0.0 ? (x < maxcell ? (unsigned int)x : maxcell) : 0;
+		}
+		keys[i].code = 0;
+		for(b=bits - 1; b>=0; b--) {
+			for(j=0; j<ndim; j++) {
+				keys[i].code = (keys[i].code << 1) | ((cell[j] >> b) & 1);
+			}
+		}
+		keys[i].index = i;
+	}
+}
+
+int kd_nearest_batch(struct kdtree *kd, const double *pos, int count, const struct kdquery *q,
+		int *ids, double *nearest)
+{
+	struct batch_key *keys;
+	struct kdhyperrect *rect = 0;
+	struct kdnode *node;
+	double limit_sq = QUERY_LIMIT_SQ(q);
+	int i, j, found = 0;
+
+	if(count <= 0) return 0;
+	if(!(keys = malloc(count * sizeof *keys))) {
+		return -1;
+	}
+	if(kd->rect && !(rect = hyperrect_duplicate(kd->rect))) {
+		free(keys);
+		return -1;
+	}
+
+	/* queries close to each other along the curve visit the same nodes */
+	batch_codes(pos, count, kd->dim, keys);
+	qsort(keys, count, sizeof *keys, batch_key_cmp);
+
+	for(i=0; i<count; i++) {
+		int k = keys[i].index;
+		const double *p = pos + (size_t)k * kd->dim;
+
+		node = 0;
+		if(rect && hyperrect_dist_sq(kd->rect, p) <= limit_sq) {
+			node = nearest_node(kd, p, q, rect);
+		}
+		ids[k] = node ? node->id : -1;
+		if(node) {
+			found++;
+		}
+		if(nearest) {
+			for(j=0; j<kd->dim; j++) {
+				nearest[(size_t)k * kd->dim + j] = node ? COORD(kd, node, j) : 0.0;
+			}
+		}
+	}
+
+	if(rect) {
+		hyperrect_free(rect);
+	}
+	free(keys);
+	return found;
+}
+
+struct kdres *kd_nearestf(struct kdtree *tree, const float *pos)
+{
+	static double sbuf[16];
+	double *bptr, *buf = 0;
+	int dim = tree->dim;
+	struct kdres *res;
+
+	if(dim > 16) {
+#ifndef NO_ALLOCA
+		if(dim <= 256)
+			bptr = buf = alloca(dim * sizeof *bptr);
+		else
+#endif
+			if(!(bptr = buf = malloc(dim * sizeof *bptr))) {
+				return 0;
+			}
+	} else {
+		bptr = buf = sbuf;
+	}
+
+	while(dim-- > 0) {
+		*bptr++ = *pos++;
+	}
+
+	res = kd_nearest(tree, buf);
+#ifndef NO_ALLOCA
+	if(tree->dim > 256)
+#else
+	if(tree->dim > 16)
+#endif
+		free(buf);
+	return res;
+}
+
+struct kdres *kd_nearest3(struct kdtree *tree, double x, double y, double z)
+{
+	double pos[3];
+	pos[0] = x;
+	pos[1] = y;
+	pos[2] = z;
+	return kd_nearest(tree, pos);
+}
+
+struct kdres *kd_nearest3f(struct kdtree *tree, float x, float y, float z)
+{
+	double pos[3];
+	pos[0] = x;
+	pos[1] = y;
+	pos[2] = z;
+	return kd_nearest(tree, pos);
+}
+
+/* ---- nearest N search ---- */
+struct kdres *kd_nearest_n(struct kdtree *kd, const double *pos, int num)
+{
+	return kd_nearest_n_q(kd, pos, num, 0);
+}
+
+struct kdres *kd_nearest_n_q(struct kdtree *kd, const double *pos, int num, const struct kdquery *q)
+{
+	if(kd->cache && num > 0 && !(q && q->now != 0.0)) {
+		return cache_search(kd, pos, num, q);
+	}
+	return nearest_n_q(kd, pos, num, q);
+}
+
+static struct kdres *nearest_n_q(struct kdtree *kd, const double *pos, int num, const struct kdquery *q)
+{
+	struct nearest_n nn;
+	struct kdres *rset;
+
+	if(!(rset = malloc(sizeof *rset))) {
+		return 0;
+	}
+	if(!(rset->rlist = alloc_resnode())) {
+		free(rset);
+		return 0;
+	}
+	rset->rlist->next = 0;
+	rset->tree = kd;
+
+	nn.kd = kd;
+	nn.q = q;
+	nn.pos = pos;
+	nn.num = num;
+	nn.size = 0;
+	nn.max_sq = 0;
+	nn.limit_sq = QUERY_LIMIT_SQ(q);
+	nn.list = rset->rlist;
+
+	/* skip the search if the whole tree is out of range */
+	if(num > 0 && kd->rect && hyperrect_dist_sq(kd->rect, pos) <= nn.limit_sq &&
+			find_nearest_n(kd->root, &nn) == -1) {
+		kd_res_free(rset);
+		return 0;
+	}
+	rset->size = nn.size;
+	kd_res_rewind(rset);
+	return rset;
+}
+
+struct kdres *kd_nearest_range(struct kdtree *kd, const double *pos, double range)
+{
+	return kd_nearest_range_q(kd, pos, range, 0);
+}
+
+struct kdres *kd_nearest_range_q(struct kdtree *kd, const double *pos, double range, const struct kdquery *q)
+{
+	int ret, visits = 0;
+	struct kdres *rset;
+	struct kdscan *scan;
+
+	if(!(rset = malloc(sizeof *rset))) {
+		return 0;
+	}
+	if(!(rset->rlist = alloc_resnode())) {
+		free(rset);
+		return 0;
+	}
+	rset->rlist->next = 0;
+	rset->tree = kd;
+
+	if(q && q->max_dist > 0.0 && q->max_dist < range) {
+		range = q->max_dist;
+	}
+	if((scan = scan_get(kd, SCAN_RANGE))) {
+		ret = scan_range(kd, scan, pos, range, q, rset->rlist);
+	} else {
+		ret = find_nearest(kd, kd->root, pos, range, q, rset->rlist, 0, &visits);
+		scan_count(kd, SCAN_RANGE, visits);
+	}
+	if(ret == -1) {
+		kd_res_free(rset);
+		return 0;
+	}
+	rset->size = ret;
+	kd_res_rewind(rset);
+	return rset;
+}
+
+struct kdres *kd_nearest_rangef(struct kdtree *kd, const float *pos, float range)
+{
+	static double sbuf[16];
+	double *bptr, *buf = 0;
+	int dim = kd->dim;
+	struct kdres *res;
+
+	if(dim > 16) {
+#ifndef NO_ALLOCA
+		if(dim <= 256)
+			bptr = buf = alloca(dim * sizeof *bptr);
+		else
+#endif
+			if(!(bptr = buf = malloc(dim * sizeof *bptr))) {
+				return 0;
+			}
+	} else {
+		bptr = buf = sbuf;
+	}
+
+	while(dim-- > 0) {
+		*bptr++ = *pos++;
+	}
+
+	res = kd_nearest_range(kd, buf, range);
+#ifndef NO_ALLOCA
+	if(kd->dim > 256)
+#else
+	if(kd->dim > 16)
+#endif
+		free(buf);
+	return res;
+}
+
+struct kdres *kd_nearest_range3(struct kdtree *tree, double x, double y, double z, double range)
+{
+	double buf[3];
+	buf[0] = x;
+	buf[1] = y;
+	buf[2] = z;
+	return kd_nearest_range(tree, buf, range);
+}
+
+struct kdres *kd_nearest_range3f(struct kdtree *tree, float x, float y, float z, float range)
+{
+	double buf[3];
+	buf[0] = x;
+	buf[1] = y;
+	buf[2] = z;
+	return kd_nearest_range(tree, buf, range);
+}
+
+/* ---- cursors ---- */
+
+/* an entry of the queue of a nearest cursor: a point, or a subtree whose
+ * bounding box is in slot "box" of the boxes of the cursor */
+struct cursor_entry {
+	double dist_sq;			/* of the point, or the least of the subtree */
+	struct kdnode *node;
+	int box;				/* -1 for a point */
+};
+
+/* a search which finds its results a page at a time. Range searches keep
+ * the subtrees left to search on a stack, nearer subtrees on top. Nearest
+ * searches keep subtrees and points in a queue ordered by distance, a
+ * binary heap, so each page only expands the subtrees nearer than its
+ * farthest point.
+ */
+struct kdcursor {
+	struct kdtree *tree;
+	double *pos;
+	double range_sq;
+	struct kdquery q;
+	unsigned int changes;	/* of the tree when the search started */
+
+	struct kdnode **stack;
+	int depth, cap;
+
+	struct cursor_entry *heap;	/* null for range searches */
+	int heap_size, heap_cap;
+	double *boxes;			/* minimum then maximum coordinates, per slot */
+	int *free_boxes;		/* unused slots */
+	int nfree, box_cap;
+};
+
+static struct kdcursor *cursor_create(struct kdtree *kd, const double *pos, double range, const struct kdquery *q)
+{
+	struct kdcursor *cur;
+
+	if(!(cur = calloc(1, sizeof *cur))) {
+		return 0;
+	}
+	if(!(cur->pos = malloc(kd->dim * sizeof *cur->pos))) {
+		free(cur);
+		return 0;
+	}
+	memcpy(cur->pos, pos, kd->dim * sizeof *pos);
+
+	if(q) {
+		cur->q = *q;
+	}
+	if(cur->q.max_dist > 0.0 && cur->q.max_dist < range) {
+		range = cur->q.max_dist;
+	}
+	cur->range_sq = range >= 0.0 ? SQ(range) : -1.0;
+	cur->tree = kd;
+	cur->changes = kd->changes;
+	return cur;
+}
+
+void kd_cursor_free(struct kdcursor *cur)
+{
+	if(cur) {
+		free(cur->pos);
+		free(cur->stack);
+		free(cur->heap);
+		free(cur->boxes);
+		free(cur->free_boxes);
+		free(cur);
+	}
+}
+
+int kd_cursor_done(struct kdcursor *cur)
+{
+	return cur->heap ? cur->heap_size == 0 : cur->depth == 0;
+}
+
+/* whether a subtree may hold results of a cursor */
+#define CURSOR_SUBTREE(cur, n)	(VISIBLE((cur)->tree, (n)) && SUBTREE_MATCH(&(cur)->q, (n)))
+
+/* adds a node to a page of results, which already holds "found" of at most
+ * "num" points. A page ends before a node whose values don't fit, unless
+ * the page is empty. Returns the number of values added, 0 if they don't
+ * fit, or -1 if memory ran out.
+ */
+static int page_add(struct kdres *rset, struct res_node **tail, struct kdnode *node, double dist_sq,
+		int found, int num)
+{
+	struct res_node *rnode;
+	int count;
+
+	for(count = 1; node_value(rset->tree, node, count, 0) != -1; count++);
+	if(found > 0 && found + count > num) {
+		return 0;
+	}
+	if(!(rnode = alloc_resnode())) {
+		return -1;
+	}
+	rnode->item = node;
+	rnode->dist_sq = dist_sq;
+	rnode->next = 0;
+	(*tail)->next = rnode;
+	*tail = rnode;
+	rset->size++;
+	return count;
+}
+
+struct kdcursor *kd_cursor_range(struct kdtree *kd, const double *pos, double range, const struct kdquery *q)
+{
+	struct kdcursor *cur;
+
+	if(!(cur = cursor_create(kd, pos, range, q))) {
+		return 0;
+	}
+	cur->cap = 32;
+	if(!(cur->stack = malloc(cur->cap * sizeof *cur->stack))) {
+		kd_cursor_free(cur);
+		return 0;
+	}
+	if(cur->range_sq >= 0.0 && CURSOR_SUBTREE(cur, kd->root)) {
+		cur->stack[cur->depth++] = kd->root;
+	}
+	return cur;
+}
+
+static int cursor_range(struct kdcursor *cur, struct kdres *rset, struct res_node *tail, int num)
+{
+	struct kdtree *kd = cur->tree;
+	struct kdnode *node, **stack, *near, *far;
+	double dist_sq, dx;
+	int i, count, found = 0;
+
+	while(cur->depth > 0) {
+		/* a node is replaced by up to two subtrees */
+		if(cur->depth == cur->cap) {
+			if(!(stack = realloc(cur->stack, 2 * cur->cap * sizeof *stack))) {
+				break;
+			}
+			cur->stack = stack;
+			cur->cap *= 2;
+		}
+		node = cur->stack[cur->depth - 1];
+		STAT(nodes);
+
+		if(MATCH(&cur->q, node)) {
+			dist_sq = 0;
+			for(i=0; i<kd->dim; i++) {
+				dist_sq += SQ(COORD(kd, node, i) - cur->pos[i]);
+			}
+			STAT(dists);
+			if(dist_sq <= cur->range_sq) {
+				if((count = page_add(rset, &tail, node, -1.0, found, num)) <= 0) {
+					break;
+				}
+				found += count;
+			}
+		}
+
+		/* the nearer subtree goes on top, and is searched first */
+		cur->depth--;
+		dx = cur->pos[node->dir] - COORD(kd, node, node->dir);
+		near = dx <= 0.0 ? node->left : node->right;
+		far = dx <= 0.0 ? node->right : node->left;
+		if(SQ(dx) <= cur->range_sq && CURSOR_SUBTREE(cur, far)) {
+			cur->stack[cur->depth++] = far;
+		}
+		if(CURSOR_SUBTREE(cur, near)) {
+			cur->stack[cur->depth++] = near;
+		}
+		if(found >= num) {
+			break;
+		}
+	}
+	return found;
+}
+
+/* the i-th slot of the boxes of a cursor, as a hyperrectangle */
+static void cursor_box(struct kdcursor *cur, int i, struct kdhyperrect *rect)
+{
+	rect->dim = cur->tree->dim;
+	rect->min = cur->boxes + (size_t)i * 2 * rect->dim;
+	rect->max = rect->min + rect->dim;
+}
+
+static void heap_push(struct kdcursor *cur, double dist_sq, struct kdnode *node, int box)
+{
+	struct cursor_entry *heap = cur->heap;
+	int i = cur->heap_size++;
+
+	while(i > 0 && heap[(i - 1) / 2].dist_sq > dist_sq) {
+		heap[i] = heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap[i].dist_sq = dist_sq;
+	heap[i].node = node;
+	heap[i].box = box;
+}
+
+static void heap_pop(struct kdcursor *cur)
+{
+	struct cursor_entry *heap = cur->heap, last = heap[--cur->heap_size];
+	int i = 0, child;
+
+	while((child = 2 * i + 1) < cur->heap_size) {
+		if(child + 1 < cur->heap_size && heap[child + 1].dist_sq < heap[child].dist_sq) {
+			child++;
+		}
+		if(heap[child].dist_sq >= last.dist_sq) {
+			break;
+		}
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = last;
+}
+
+/* pushes a subtree of a nearest cursor with the box in slot "box", or
+ * frees the slot if the subtree holds no results */
+static void cursor_push_box(struct kdcursor *cur, struct kdnode *node, int box)
+{
+	struct kdhyperrect rect;
+	double dist_sq;
+
+	if(CURSOR_SUBTREE(cur, node)) {
+		cursor_box(cur, box, &rect);
+		if((dist_sq = hyperrect_dist_sq(&rect, cur->pos)) <= cur->range_sq) {
+			heap_push(cur, dist_sq, node, box);
+			return;
+		}
+		STAT(pruned);
+	}
+	cur->free_boxes[cur->nfree++] = box;
+}
+
+/* replaces the subtree at the top of the queue by its point and its two
+ * subtrees, whose boxes are cut from its box at its splitting plane.
+ * Returns -1 if memory ran out, leaving the queue as it was.
+ */
+static int cursor_expand(struct kdcursor *cur)
+{
+	struct kdtree *kd = cur->tree;
+	struct cursor_entry *heap, top = cur->heap[0];
+	struct kdhyperrect rect, left;
+	double *boxes, dist_sq, split;
+	int *free_boxes, i, dim = kd->dim, box;
+
+	if(cur->heap_size + 2 > cur->heap_cap) {
+		if(!(heap = realloc(cur->heap, 2 * cur->heap_cap * sizeof *heap))) {
+			return -1;
+		}
+		cur->heap = heap;
+		cur->heap_cap *= 2;
+	}
+	if(cur->nfree == 0) {
+		if(!(free_boxes = realloc(cur->free_boxes, 2 * cur->box_cap * sizeof *free_boxes))) {
+			return -1;
+		}
+		cur->free_boxes = free_boxes;
+		if(!(boxes = realloc(cur->boxes, (size_t)4 * cur->box_cap * dim * sizeof *boxes))) {
+			return -1;
+		}
+		cur->boxes = boxes;
+		for(i=cur->box_cap; i<2 * cur->box_cap; i++) {
+			cur->free_boxes[cur->nfree++] = i;
+		}
+		cur->box_cap *= 2;
+	}
+	heap_pop(cur);
+	STAT(nodes);
+
+	if(MATCH(&cur->q, top.node)) {
+		dist_sq = 0;
+		for(i=0; i<dim; i++) {
+			dist_sq += SQ(COORD(kd, top.node, i) - cur->pos[i]);
+		}
+		STAT(dists);
+		if(dist_sq <= cur->range_sq) {
+			heap_push(cur, dist_sq, top.node, -1);
+		}
+	}
+
+	/* the left subtree gets a new slot, the right one keeps the slot */
+	split = COORD(kd, top.node, top.node->dir);
+	box = cur->free_boxes[--cur->nfree];
+	cursor_box(cur, top.box, &rect);
+	cursor_box(cur, box, &left);
+	memcpy(left.min, rect.min, 2 * dim * sizeof *left.min);
+	if(left.max[top.node->dir] > split) {
+		left.max[top.node->dir] = split;
+	}
+	if(rect.min[top.node->dir] < split) {
+		rect.min[top.node->dir] = split;
+	}
+	cursor_push_box(cur, top.node->left, box);
+	cursor_push_box(cur, top.node->right, top.box);
+	return 0;
+}
+
+struct kdcursor *kd_cursor_nearest(struct kdtree *kd, const double *pos, const struct kdquery *q)
+{
+	struct kdcursor *cur;
+	struct kdhyperrect rect;
+	int i, box;
+
+	if(!(cur = cursor_create(kd, pos, HUGE_VAL, q))) {
+		return 0;
+	}
+	cur->heap_cap = 32;
+	cur->box_cap = 16;
+	cur->heap = malloc(cur->heap_cap * sizeof *cur->heap);
+	cur->boxes = malloc((size_t)2 * cur->box_cap * kd->dim * sizeof *cur->boxes);
+	cur->free_boxes = malloc(cur->box_cap * sizeof *cur->free_boxes);
+	if(!cur->heap || !cur->boxes || !cur->free_boxes) {
+		kd_cursor_free(cur);
+		return 0;
+	}
+	for(i=cur->box_cap - 1; i>=0; i--) {
+		cur->free_boxes[cur->nfree++] = i;
+	}
+
+	/* the root starts from the bounding box of the tree */
+	box = cur->free_boxes[--cur->nfree];
+	cursor_box(cur, box, &rect);
+	for(i=0; i<kd->dim; i++) {
+		rect.min[i] = kd->rect ? kd->rect->min[i] : -HUGE_VAL;
+		rect.max[i] = kd->rect ? kd->rect->max[i] : HUGE_VAL;
+	}
+	cursor_push_box(cur, kd->root, box);
+	return cur;
+}
+
+static int cursor_nearest(struct kdcursor *cur, struct kdres *rset, struct res_node *tail, int num)
+{
+	struct cursor_entry *top;
+	int count, found = 0;
+
+	while(cur->heap_size > 0) {
+		top = cur->heap;
+		if(top->box != -1) {
+			if(cursor_expand(cur) == -1) {
+				break;
+			}
+			continue;
+		}
+		if((count = page_add(rset, &tail, top->node, top->dist_sq, found, num)) <= 0) {
+			break;
+		}
+		heap_pop(cur);
+		found += count;
+		if(found >= num) {
+			break;
+		}
+	}
+	return found;
+}
+
+struct kdres *kd_cursor_next(struct kdcursor *cur, int num)
+{
+	struct kdres *rset;
+
+	/* the nodes left to search may have moved or been freed */
+	if(cur->changes != cur->tree->changes) {
+		return 0;
+	}
+	if(!(rset = malloc(sizeof *rset))) {
+		return 0;
+	}
+	if(!(rset->rlist = alloc_resnode())) {
+		free(rset);
+		return 0;
+	}
+	rset->rlist->next = 0;
+	rset->tree = cur->tree;
+	rset->size = 0;
+
+	if(cur->heap) {
+		cursor_nearest(cur, rset, rset->rlist, num < 1 ? 1 : num);
+	} else {
+		cursor_range(cur, rset, rset->rlist, num < 1 ? 1 : num);
+	}
+
+	/* an empty page before the end means memory ran out; the search
+	 * continues from the same place on the next call */
+	if(rset->size == 0 && !kd_cursor_done(cur)) {
+		kd_res_free(rset);
+		return 0;
+	}
+	kd_res_rewind(rset);
+	return rset;
+}
+
+/* ---- kernel density ---- */
+
+/* state of the density searches of kd_density */
+struct density {
+	struct kdtree *kd;
+	const struct kdquery *q;
+	const double *pos;
+	struct kdsum *nodes;
+	double *min, *max;		/* box of the subtree searched */
+	int kernel;
+	double scale;			/* 1 / 2h^2 for gaussians, 1 / h^2 otherwise */
+	double limit_sq;		/* beyond which the kernel is 0 */
+	double tolerance;
+	int approx;				/* whether sums may stand for subtrees */
+};
+
+/* called whenever points are added, moved or removed, or their data
+ * changes; the next density search sums up the weights again */
+static void sums_free(struct kdtree *kd)
+{
+	struct kdsums *s;
+
+	while((s = kd->sums)) {
+		kd->sums = s->next;
+		free(s->nodes);
+		free(s);
+	}
+}
+
+static int sums_count(struct kdtree *kd, struct kdnode *node)
+{
+	if(!VISIBLE(kd, node)) return 0;
+	return 1 + sums_count(kd, node->left) + sums_count(kd, node->right);
+}
+
+/* fills in the subtree of "node" from index "i" on, and returns the index
+ * after it */
+static int sums_rec(struct kdtree *kd, struct kdnode *node, struct kdsums *s, int i)
+{
+	struct kdsum *e = s->nodes + i;
+	void *data;
+	int j;
+
+	e->node = node;
+	e->own = 0.0;
+	if(MATCH((const struct kdquery*)0, node)) {
+		for(j=0; node_value(kd, node, j, &data) != -1; j++) {
+			e->own += s->weight ? s->weight(data) : 1.0;
+		}
+	}
+	e->sum = e->own;
+	e->end = i + 1;
+	if(VISIBLE(kd, node->left)) {
+		s->nodes[i].end = sums_rec(kd, node->left, s, e->end);
+		s->nodes[i].sum += s->nodes[i + 1].sum;
+	}
+	if(VISIBLE(kd, node->right)) {
+		j = s->nodes[i].end;
+		s->nodes[i].end = sums_rec(kd, node->right, s, j);
+		s->nodes[i].sum += s->nodes[j].sum;
+	}
+	return s->nodes[i].end;
+}
+
+/* returns the weights of the points of the tree by the weight function,
+ * summing them up if needed, or null if memory ran out */
+static struct kdsum *sums_get(struct kdtree *kd, double (*weight)(void*))
+{
+	struct kdsums *s;
+	int size;
+
+	/* concurrent searches sum up the weights once */
+	LOCK(kd);
+	for(s = kd->sums; s && s->weight != weight; s = s->next);
+	if(!s && (s = malloc(sizeof *s))) {
+		size = sums_count(kd, kd->root);
+		if(!(s->nodes = malloc((size > 0 ? size : 1) * sizeof *s->nodes))) {
+			free(s);
+			s = 0;
+		} else {
+			s->weight = weight;
+			s->size = size;
+			if(size > 0) {
+				sums_rec(kd, kd->root, s, 0);
+			}
+			s->next = kd->sums;
+			kd->sums = s;
+		}
+	}
+	UNLOCK(kd);
+	return s ? s->nodes : 0;
+}
+
+static double kernel(const struct density *ds, double dist_sq)
+{
+	if(dist_sq > ds->limit_sq) {
+		return 0.0;
+	}
+	switch(ds->kernel) {
+	case KD_KERNEL_GAUSSIAN:
+		return exp(-dist_sq * ds->scale);
+	case KD_KERNEL_EPANECHNIKOV:
+		return 1.0 - dist_sq * ds->scale;
+	default:
+		return 1.0;
+	}
+}
+
+/* sums up the subtree at index "i" of the weights */
+static double density_rec(struct density *ds, int i)
+{
+	struct kdtree *kd = ds->kd;
+	struct kdsum *e = ds->nodes + i;
+	struct kdnode *node = e->node;
+	struct kdhyperrect rect;
+	double near_sq, far_sq, hi, lo, dist_sq, split, save, total = 0.0;
+	int j, dir;
+
+	if(!SUBTREE_MATCH(ds->q, node)) {
+		STAT(pruned);
+		return 0.0;
+	}
+
+	rect.dim = kd->dim;
+	rect.min = ds->min;
+	rect.max = ds->max;
+	if((near_sq = hyperrect_dist_sq(&rect, ds->pos)) > ds->limit_sq) {
+		STAT(pruned);
+		return 0.0;
+	}
+
+	/* the kernel of every point of the subtree lies between those of the
+	 * nearest and farthest corner of its box; if they are close enough,
+	 * their mean stands for all of them */
+	if(ds->approx) {
+		far_sq = 0.0;
+		for(j=0; j<kd->dim; j++) {
+			far_sq += SQ(fabs(ds->pos[j] - ds->min[j]) > fabs(ds->pos[j] - ds->max[j]) ?
+					ds->pos[j] - ds->min[j] : ds->pos[j] - ds->max[j]);
+		}
+		hi = kernel(ds, near_sq);
+		lo = kernel(ds, far_sq);
+		if(hi - lo <= 2.0 * ds->tolerance) {
+			STAT(pruned);
+			return e->sum * (hi + lo) / 2.0;
+		}
+	}
+	STAT(nodes);
+
+	if(MATCH(ds->q, node)) {
+		dist_sq = 0.0;
+		for(j=0; j<kd->dim; j++) {
+			dist_sq += SQ(COORD(kd, node, j) - ds->pos[j]);
+		}
+		STAT(dists);
+		total = kernel(ds, dist_sq) * e->own;
+	}
+
+	/* the boxes of the subtrees are cut at the splitting plane */
+	dir = node->dir;
+	split = COORD(kd, node, dir);
+	j = i + 1;
+	if(VISIBLE(kd, node->left)) {
+		save = ds->max[dir];
+		if(split < save) {
+			ds->max[dir] = split;
+		}
+		total += density_rec(ds, j);
+		ds->max[dir] = save;
+		j = ds->nodes[j].end;
+	}
+	if(VISIBLE(kd, node->right)) {
+		save = ds->min[dir];
+		if(split > save) {
+			ds->min[dir] = split;
+		}
+		total += density_rec(ds, j);
+		ds->min[dir] = save;
+	}
+	return total;
+}
+
+int kd_density(struct kdtree *kd, const double *pos, int count, const struct kddensity *opt,
+		const struct kdquery *q, double *out)
+{
+	struct density ds;
+	struct batch_key *keys;
+	double *box, h_sq = SQ(opt->bandwidth);
+	int i, j, k;
+
+	if(!(opt->bandwidth > 0.0) || opt->kernel < KD_KERNEL_GAUSSIAN || opt->kernel > KD_KERNEL_UNIFORM) {
+		return -1;
+	}
+	if(count <= 0) return 0;
+	if(!VISIBLE(kd, kd->root) || !kd->rect) {
+		for(i=0; i<count; i++) {
+			out[i] = 0.0;
+		}
+		return 0;
+	}
+	if(!(ds.nodes = sums_get(kd, opt->weight))) {
+		return -1;
+	}
+	if(!(keys = malloc(count * sizeof *keys))) {
+		return -1;
+	}
+	if(!(box = malloc(2 * kd->dim * sizeof *box))) {
+		free(keys);
+		return -1;
+	}
+
+	ds.kd = kd;
+	ds.q = q;
+	ds.min = box;
+	ds.max = box + kd->dim;
+	ds.kernel = opt->kernel;
+	ds.scale = opt->kernel == KD_KERNEL_GAUSSIAN ? 0.5 / h_sq : 1.0 / h_sq;
+	ds.limit_sq = QUERY_LIMIT_SQ(q);
+	if(opt->kernel != KD_KERNEL_GAUSSIAN && h_sq < ds.limit_sq) {
+		ds.limit_sq = h_sq;
+	}
+	ds.tolerance = opt->tolerance > 0.0 ? opt->tolerance : 0.0;
+	/* the sums hold all points, not only those a filter finds */
+	ds.approx = !q || (!q->mask && q->now == 0.0);
+
+	/* queries close to each other along the curve visit the same nodes */
+	batch_codes(pos, count, kd->dim, keys);
+	qsort(keys, count, sizeof *keys, batch_key_cmp);
+
+	for(i=0; i<count; i++) {
+		k = keys[i].index;
+		for(j=0; j<kd->dim; j++) {
+			ds.min[j] = kd->rect->min[j];
+			ds.max[j] = kd->rect->max[j];
+		}
+		ds.pos = pos + (size_t)k * kd->dim;
+		out[k] = density_rec(&ds, 0);
+	}
+
+	free(box);
+	free(keys);
+	return 0;
+}
+
+/* ---- search result cache ---- */
+static void cache_unlink(struct kdcache *c, struct cache_entry *e)
+{
+	if(e->prev) e->prev->next = e->next; else c->head = e->next;
+	if(e->next) e->next->prev = e->prev; else c->tail = e->prev;
+}
+
+static void cache_push(struct kdcache *c, struct cache_entry *e)
+{
+	e->prev = 0;
+	e->next = c->head;
+	if(c->head) c->head->prev = e; else c->tail = e;
+	c->head = e;
+}
 
-	res = kd_nearest(tree, buf);
-#ifndef NO_ALLOCA
-	if(tree->dim > 256)
-#else
-	if(tree->dim > 16)
-#endif
-		free(buf);
-	return res;
+/* removes an entry from its hash bucket and the LRU list, and frees it */
+static void cache_remove(struct kdcache *c, struct cache_entry *e, unsigned int h)
+{
+	struct cache_entry **ep = c->buckets + h;
+
+	while(*ep != e) {
+		ep = &(*ep)->hnext;
+	}
+	*ep = e->hnext;
+	cache_unlink(c, e);
+	free(e);
+	c->stats.size--;
 }
 
-struct kdres *kd_nearest3(struct kdtree *tree, double x, double y, double z)
+static unsigned int cache_hash(const struct kdcache *c, const double *pos, int dim, int num, unsigned int mask)
 {
-	double pos[3];
-	pos[0] = x;
-	pos[1] = y;
-	pos[2] = z;
-	return kd_nearest(tree, pos);
+	const unsigned char *p = (const unsigned char*)pos;
+	unsigned int h = 2166136261u ^ (unsigned int)num ^ (mask * 16777619u);
+	size_t i;
+
+	/* FNV-1a over the bytes of the coordinates */
+	for(i=0; i<dim * sizeof *pos; i++) {
+		h = (h ^ p[i]) * 16777619u;
+	}
+	return h & (c->nbuckets - 1);
 }
 
-struct kdres *kd_nearest3f(struct kdtree *tree, float x, float y, float z)
+static struct cache_entry *cache_find(struct kdcache *c, unsigned int h, const double *pos, int dim, int num,
+		const struct kdquery *q)
 {
-	double pos[3];
-	pos[0] = x;
-	pos[1] = y;
-	pos[2] = z;
-	return kd_nearest(tree, pos);
+	struct cache_entry *e;
+	unsigned int mask = q ? q->mask : 0;
+	double max_dist = q && q->max_dist > 0.0 ? q->max_dist : 0.0;
+
+	for(e = c->buckets[h]; e; e = e->hnext) {
+		if(e->num == num && e->mask == mask && e->max_dist == max_dist &&
+				memcmp(e->pos, pos, dim * sizeof *pos) == 0) {
+			return e;
+		}
+	}
+	return 0;
 }
 
-/* ---- nearest N search ---- */
-/*
-static kdres *kd_nearest_n(struct kdtree *kd, const double *pos, int num)
+/* builds a result set from a cache entry */
+static struct kdres *cache_results(struct kdtree *kd, const struct cache_entry *e)
 {
-	int ret;
 	struct kdres *rset;
+	struct res_node *tail, *rnode;
+	int i;
 
 	if(!(rset = malloc(sizeof *rset))) {
 		return 0;
@@ -519,90 +3694,225 @@ static kdres *kd_nearest_n(struct kdtree *kd, const double *pos, int num)
 	}
 	rset->rlist->next = 0;
 	rset->tree = kd;
+	rset->size = e->count;
 
-	if((ret = find_nearest_n(kd->root, pos, range, num, rset->rlist, kd->dim)) == -1) {
-		kd_res_free(rset);
-		return 0;
+	tail = rset->rlist;
+	for(i=0; i<e->count; i++) {
+		if(!(rnode = alloc_resnode())) {
+			kd_res_free(rset);
+			return 0;
+		}
+		rnode->item = e->items[i];
+		rnode->dist_sq = e->dists[i];
+		rnode->next = 0;
+		tail->next = rnode;
+		tail = rnode;
 	}
-	rset->size = ret;
 	kd_res_rewind(rset);
 	return rset;
-}*/
+}
 
-struct kdres *kd_nearest_range(struct kdtree *kd, const double *pos, double range)
+/* copies a result set into a new cache entry */
+static struct cache_entry *cache_entry_create(struct kdtree *kd, const double *pos, int num, const struct kdquery *q,
+		struct kdres *rset)
 {
-	int ret;
-	struct kdres *rset;
+	struct cache_entry *e;
+	struct res_node *rnode;
+	int i, j;
 
-	if(!(rset = malloc(sizeof *rset))) {
+	if(!(e = malloc(sizeof *e + (kd->dim + rset->size) * sizeof(double) + rset->size * sizeof(struct kdnode*)))) {
 		return 0;
 	}
-	if(!(rset->rlist = alloc_resnode())) {
-		free(rset);
-		return 0;
+	e->num = num;
+	e->mask = q ? q->mask : 0;
+	e->max_dist = q && q->max_dist > 0.0 ? q->max_dist : 0.0;
+	e->count = rset->size;
+	e->pos = (double*)(e + 1);
+	e->dists = e->pos + kd->dim;
+	e->items = (struct kdnode**)(e->dists + e->count);
+	memcpy(e->pos, pos, kd->dim * sizeof *pos);
+
+	/* with fewer results than searched for, any point in range changes them */
+	e->radius_sq = e->count < (num ? num : 1) ? QUERY_LIMIT_SQ(q) : 0.0;
+	for(i=0, rnode = rset->rlist->next; rnode; i++, rnode = rnode->next) {
+		e->items[i] = rnode->item;
+		/* kd_nearest does not record the distance */
+		e->dists[i] = 0;
+		for(j=0; j<kd->dim; j++) {
+			e->dists[i] += SQ(COORD(kd, rnode->item, j) - pos[j]);
+		}
+		if(e->dists[i] > e->radius_sq) {
+			e->radius_sq = e->dists[i];
+		}
 	}
-	rset->rlist->next = 0;
-	rset->tree = kd;
+	return e;
+}
 
-	if((ret = find_nearest(kd->root, pos, range, rset->rlist, 0, kd->dim)) == -1) {
-		kd_res_free(rset);
+static struct kdres *cache_search(struct kdtree *kd, const double *pos, int num, const struct kdquery *q)
+{
+	struct kdcache *c = kd->cache;
+	struct cache_entry *e;
+	struct kdres *rset;
+	double sbuf[16], *key = sbuf;
+	unsigned int h, mask = q ? q->mask : 0;
+	int i;
+
+	if(kd->dim > 16 && !(key = malloc(kd->dim * sizeof *key))) {
 		return 0;
 	}
-	rset->size = ret;
-	kd_res_rewind(rset);
+	/* nearby points share the result for the point they round to */
+	for(i=0; i<kd->dim; i++) {
+		key[i] = c->quantum > 0.0 ? floor(pos[i] / c->quantum + 0.5) * c->quantum : pos[i];
+	}
+	h = cache_hash(c, key, kd->dim, num, mask);
+
+	LOCK(kd);
+	if((e = cache_find(c, h, key, kd->dim, num, q))) {
+		c->stats.hits++;
+		cache_unlink(c, e);
+		cache_push(c, e);
+		rset = cache_results(kd, e);
+		UNLOCK(kd);
+		goto done;
+	}
+	c->stats.misses++;
+	UNLOCK(kd);
+
+	rset = num ? nearest_n_q(kd, key, num, q) : nearest_q(kd, key, q);
+	if(!rset || !(e = cache_entry_create(kd, key, num, q, rset))) {
+		goto done;
+	}
+
+	LOCK(kd);
+	/* another thread may have stored the same search meanwhile */
+	if(cache_find(c, h, key, kd->dim, num, q)) {
+		free(e);
+	} else {
+		if(c->stats.size >= c->capacity) {
+			struct cache_entry *lru = c->tail;
+			cache_remove(c, lru, cache_hash(c, lru->pos, kd->dim, lru->num, lru->mask));
+		}
+		e->hnext = c->buckets[h];
+		c->buckets[h] = e;
+		cache_push(c, e);
+		c->stats.size++;
+	}
+	UNLOCK(kd);
+
+done:
+	if(key != sbuf) {
+		free(key);
+	}
 	return rset;
 }
 
-struct kdres *kd_nearest_rangef(struct kdtree *kd, const float *pos, float range)
+/* drops the cached searches whose results a new or moved node may change:
+ * those which found it, and those which it matches and lies within the
+ * radius of */
+static void cache_invalidate(struct kdtree *kd, const struct kdnode *node)
 {
-	static double sbuf[16];
-	double *bptr, *buf = 0;
-	int dim = kd->dim;
-	struct kdres *res;
+	cache_invalidate_at(kd, node, 0);
+}
 
-	if(dim > 16) {
-#ifndef NO_ALLOCA
-		if(dim <= 256)
-			bptr = buf = alloca(dim * sizeof *bptr);
-		else
-#endif
-			if(!(bptr = buf = malloc(dim * sizeof *bptr))) {
-				return 0;
-			}
-	} else {
-		bptr = buf = sbuf;
-	}
+/* like cache_invalidate, for a node about to move to "pos" (stored
+ * coordinates), or still at its place if "pos" is null */
+static void cache_invalidate_at(struct kdtree *kd, const struct kdnode *node, const double *pos)
+{
+	struct kdcache *c = kd->cache;
+	struct cache_entry *e, *next;
+	double dist_sq;
+	int i;
 
-	while(dim-- > 0) {
-		*bptr++ = *pos++;
+	if(!c) return;
+
+	LOCK(kd);
+	for(e = c->head; e; e = next) {
+		next = e->next;
+		for(i=0; i<e->count && e->items[i] != node; i++);
+		if(i < e->count) {
+			cache_remove(c, e, cache_hash(c, e->pos, kd->dim, e->num, e->mask));
+			c->stats.invalidated++;
+			continue;
+		}
+		if(e->mask && !(node->tag & e->mask)) {
+			continue;
+		}
+		dist_sq = 0;
+		for(i=0; i<kd->dim && dist_sq <= e->radius_sq; i++) {
+			dist_sq += SQ((pos ? pos[i] : COORD(kd, node, i)) - e->pos[i]);
+		}
+		if(dist_sq <= e->radius_sq) {
+			cache_remove(c, e, cache_hash(c, e->pos, kd->dim, e->num, e->mask));
+			c->stats.invalidated++;
+		}
 	}
+	UNLOCK(kd);
+}
 
-	res = kd_nearest_range(kd, buf, range);
-#ifndef NO_ALLOCA
-	if(kd->dim > 256)
-#else
-	if(kd->dim > 16)
-#endif
-		free(buf);
-	return res;
+/* drops all cached searches, when nodes are moved or freed */
+static void cache_flush(struct kdtree *kd)
+{
+	struct kdcache *c = kd->cache;
+	struct cache_entry *e, *next;
+
+	if(!c) return;
+
+	LOCK(kd);
+	for(e = c->head; e; e = next) {
+		next = e->next;
+		free(e);
+	}
+	memset(c->buckets, 0, c->nbuckets * sizeof *c->buckets);
+	c->head = c->tail = 0;
+	c->stats.size = 0;
+	UNLOCK(kd);
 }
 
-struct kdres *kd_nearest_range3(struct kdtree *tree, double x, double y, double z, double range)
+int kd_cache(struct kdtree *tree, int capacity, double quantum)
 {
-	double buf[3];
-	buf[0] = x;
-	buf[1] = y;
-	buf[2] = z;
-	return kd_nearest_range(tree, buf, range);
+	struct kdcache *c = 0;
+	unsigned int nbuckets = 1;
+
+	if(tree->origin) return -1;
+
+	if(capacity > 0) {
+		while(nbuckets < (unsigned int)capacity && nbuckets < (1u << 30)) {
+			nbuckets <<= 1;
+		}
+		if(!(c = calloc(1, sizeof *c))) {
+			return -1;
+		}
+		if(!(c->buckets = calloc(nbuckets, sizeof *c->buckets))) {
+			free(c);
+			return -1;
+		}
+		c->capacity = capacity;
+		c->quantum = quantum;
+		c->nbuckets = nbuckets;
+	}
+
+	cache_flush(tree);
+	if(tree->cache) {
+		free(tree->cache->buckets);
+		free(tree->cache);
+	}
+	tree->cache = c;
+	return 0;
 }
 
-struct kdres *kd_nearest_range3f(struct kdtree *tree, float x, float y, float z, float range)
+int kd_cache_stats(struct kdtree *tree, struct kdcachestats *st, int reset)
 {
-	double buf[3];
-	buf[0] = x;
-	buf[1] = y;
-	buf[2] = z;
-	return kd_nearest_range(tree, buf, range);
+	struct kdcache *c = tree->cache;
+
+	if(!c) return -1;
+
+	LOCK(tree);
+	*st = c->stats;
+	if(reset) {
+		c->stats.hits = c->stats.misses = c->stats.invalidated = 0;
+	}
+	UNLOCK(tree);
+	return 0;
 }
 
 void kd_res_free(struct kdres *rset)
@@ -637,7 +3947,10 @@ void *kd_res_item(struct kdres *rset, double *pos)
 {
 	if(rset->riter) {
 		if(pos) {
-			memcpy(pos, rset->riter->item->pos, rset->tree->dim * sizeof *pos);
+			int i;
+			for(i=0; i<rset->tree->dim; i++) {
+				pos[i] = COORD(rset->tree, rset->riter->item, i);
+			}
 		}
 		return rset->riter->item->data;
 	}
@@ -650,7 +3963,7 @@ void *kd_res_itemf(struct kdres *rset, float *pos)
 		if(pos) {
 			int i;
 			for(i=0; i<rset->tree->dim; i++) {
-				pos[i] = rset->riter->item->pos[i];
+				pos[i] = COORD(rset->tree, rset->riter->item, i);
 			}
 		}
 		return rset->riter->item->data;
@@ -661,9 +3974,9 @@ void *kd_res_itemf(struct kdres *rset, float *pos)
 void *kd_res_item3(struct kdres *rset, double *x, double *y, double *z)
 {
 	if(rset->riter) {
-		if(*x) *x = rset->riter->item->pos[0];
-		if(*y) *y = rset->riter->item->pos[1];
-		if(*z) *z = rset->riter->item->pos[2];
+		if(*x) *x = COORD(rset->tree, rset->riter->item, 0);
+		if(*y) *y = COORD(rset->tree, rset->riter->item, 1);
+		if(*z) *z = COORD(rset->tree, rset->riter->item, 2);
 	}
 	return 0;
 }
@@ -671,18 +3984,229 @@ void *kd_res_item3(struct kdres *rset, double *x, double *y, double *z)
 void *kd_res_item3f(struct kdres *rset, float *x, float *y, float *z)
 {
 	if(rset->riter) {
-		if(*x) *x = rset->riter->item->pos[0];
-		if(*y) *y = rset->riter->item->pos[1];
-		if(*z) *z = rset->riter->item->pos[2];
+		if(*x) *x = COORD(rset->tree, rset->riter->item, 0);
+		if(*y) *y = COORD(rset->tree, rset->riter->item, 1);
+		if(*z) *z = COORD(rset->tree, rset->riter->item, 2);
 	}
 	return 0;
 }
 
+int kd_res_item_count(struct kdres *rset)
+{
+	int count = 0;
+
+	if(!rset->riter) return 0;
+	while(node_value(rset->tree, rset->riter->item, count, 0) != -1) {
+		count++;
+	}
+	return count;
+}
+
+void *kd_res_item_value(struct kdres *rset, int i, int *id)
+{
+	void *data = 0;
+	int vid = -1;
+
+	if(rset->riter) {
+		vid = node_value(rset->tree, rset->riter->item, i, &data);
+	}
+	if(id) *id = vid;
+	return vid == -1 ? 0 : data;
+}
+
 void *kd_res_item_data(struct kdres *set)
 {
 	return kd_res_item(set, 0);
 }
 
+int kd_res_item_id(struct kdres *rset)
+{
+	return rset->riter ? rset->riter->item->id : -1;
+}
+
+/* ---- dual-tree radius join ---- */
+struct join_state {
+	struct kdtree *ta, *tb;
+	double range, range_sq;
+	int dim, count;
+	int (*func)(int, int, void*);
+	void *arg;
+};
+
+/* reports the pairs of values at "p" and "q", which are in range */
+static int join_emit(struct join_state *js, const struct kdnode *p, const struct kdnode *q, int p_is_a)
+{
+	struct kdtree *tp = p_is_a ? js->ta : js->tb, *tq = p_is_a ? js->tb : js->ta;
+	int i, j, ip, iq;
+
+	for(i=0; (ip = node_value(tp, p, i, 0)) != -1; i++) {
+		for(j=0; (iq = node_value(tq, q, j, 0)) != -1; j++) {
+			if(p_is_a ? js->func(ip, iq, js->arg) : js->func(iq, ip, js->arg)) {
+				return -1;
+			}
+			js->count++;
+		}
+	}
+	return 0;
+}
+
+/* reports every point of the subtree at "node" which is in range of point "p" */
+static int join_point(struct join_state *js, const struct kdnode *p, int p_is_a, const struct kdnode *node)
+{
+	struct kdtree *tp = p_is_a ? js->ta : js->tb, *tn = p_is_a ? js->tb : js->ta;
+	double dist_sq, dx;
+	int i;
+
+	if(!VISIBLE(tn, node)) return 0;
+	STAT(nodes);
+
+	dist_sq = 0;
+	for(i=0; i<js->dim; i++) {
+		dist_sq += SQ(COORD(tn, node, i) - COORD(tp, p, i));
+	}
+	STAT(dists);
+	if(dist_sq <= js->range_sq && p->expires != REMOVED && node->expires != REMOVED &&
+			join_emit(js, p, node, p_is_a) == -1) {
+		return -1;
+	}
+
+	dx = COORD(tp, p, node->dir) - COORD(tn, node, node->dir);
+	if(join_point(js, p, p_is_a, dx <= 0.0 ? node->left : node->right) == -1) {
+		return -1;
+	}
+	if(fabs(dx) <= js->range) {
+		return join_point(js, p, p_is_a, dx <= 0.0 ? node->right : node->left);
+	}
+	STAT(pruned);
+	return 0;
+}
+
+/* Joins the subtrees at "a" and "b", whose cells are "ra" and "rb".
+ * The point at "a" is matched against all of "b", then each child of "a"
+ * is joined against "b" with the roles swapped, so that both trees are
+ * descended in turn. Every pair is visited exactly once.
+ */
+static int join_rec(struct join_state *js, struct kdnode *a, struct kdhyperrect *ra,
+		struct kdnode *b, struct kdhyperrect *rb, int a_is_a)
+{
+	struct kdtree *ta = a_is_a ? js->ta : js->tb;
+	int dir, ret = 0;
+	double dummy;
+
+	if(!VISIBLE(ta, a) || !VISIBLE(a_is_a ? js->tb : js->ta, b)) return 0;
+	if(hyperrect_rect_dist_sq(ra, rb) > js->range_sq) {
+		STAT(pruned);
+		return 0;
+	}
+
+	if(join_point(js, a, a_is_a, b) == -1) {
+		return -1;
+	}
+
+	dir = a->dir;
+	if(a->left) {
+		dummy = ra->max[dir];
+		ra->max[dir] = COORD(ta, a, dir);
+		ret = join_rec(js, b, rb, a->left, ra, !a_is_a);
+		ra->max[dir] = dummy;
+	}
+	if(ret == 0 && a->right) {
+		dummy = ra->min[dir];
+		ra->min[dir] = COORD(ta, a, dir);
+		ret = join_rec(js, b, rb, a->right, ra, !a_is_a);
+		ra->min[dir] = dummy;
+	}
+	return ret;
+}
+
+int kd_radius_join(struct kdtree *ta, struct kdtree *tb, double range,
+		int (*func)(int, int, void*), void *arg)
+{
+	struct join_state js;
+	struct kdhyperrect *ra, *rb;
+	int ret;
+
+	if(!ta || !tb || ta->dim != tb->dim || !func) return -1;
+	if(!ta->rect || !tb->rect) return 0;
+
+	if(!(ra = hyperrect_duplicate(ta->rect))) {
+		return -1;
+	}
+	if(!(rb = hyperrect_duplicate(tb->rect))) {
+		hyperrect_free(ra);
+		return -1;
+	}
+
+	js.ta = ta;
+	js.tb = tb;
+	js.range = range;
+	js.range_sq = SQ(range);
+	js.dim = ta->dim;
+	js.count = 0;
+	js.func = func;
+	js.arg = arg;
+
+	ret = join_rec(&js, ta->root, ra, tb->root, rb, 1);
+
+	hyperrect_free(ra);
+	hyperrect_free(rb);
+	return ret == -1 ? -1 : js.count;
+}
+
+/* ---- geodesic coordinates ---- */
+#ifndef M_PI
+#define M_PI	3.14159265358979323846
+#endif
+#define RADIANS(deg)	((deg) * (M_PI / 180.0))
+#define DEGREES(rad)	((rad) * (180.0 / M_PI))
+
+void kd_geo_point(const double *latlon, double *xyz)
+{
+	double lat = RADIANS(latlon[0]), lon = RADIANS(latlon[1]);
+
+	xyz[0] = cos(lat) * cos(lon);
+	xyz[1] = cos(lat) * sin(lon);
+	xyz[2] = sin(lat);
+}
+
+void kd_geo_latlon(const double *xyz, double *latlon)
+{
+	latlon[0] = DEGREES(atan2(xyz[2], sqrt(SQ(xyz[0]) + SQ(xyz[1]))));
+	latlon[1] = DEGREES(atan2(xyz[1], xyz[0]));
+}
+
+double kd_geo_chord(double metres)
+{
+	double angle = metres / KD_EARTH_RADIUS;
+
+	/* no two points are farther apart than the poles, but the chord of two
+	 * antipodal points may round to just above 2 */
+	if(angle >= M_PI) {
+		return nextafter(2.0, 3.0);
+	}
+	return 2.0 * sin(angle / 2.0);
+}
+
+double kd_geo_metres(double chord)
+{
+	if(chord >= 2.0) {
+		return M_PI * KD_EARTH_RADIUS;
+	}
+	return 2.0 * asin(chord / 2.0) * KD_EARTH_RADIUS;
+}
+
+/* by the haversine formula, which stays accurate for short distances */
+double kd_geo_distance(const double *a, const double *b)
+{
+	double h = SQ(sin(RADIANS(b[0] - a[0]) / 2.0)) +
+		cos(RADIANS(a[0])) * cos(RADIANS(b[0])) * SQ(sin(RADIANS(b[1] - a[1]) / 2.0));
+
+	if(h > 1.0) {
+		h = 1.0;
+	}
+	return 2.0 * asin(sqrt(h)) * KD_EARTH_RADIUS;
+}
+
 /* ---- hyperrectangle helpers ---- */
 static struct kdhyperrect* hyperrect_create(int dim, const double *min, const double *max)
 {
@@ -751,6 +4275,22 @@ static double hyperrect_dist_sq(struct kdhyperrect *rect, const double *pos)
 	return result;
 }
 
+static double hyperrect_rect_dist_sq(const struct kdhyperrect *a, const struct kdhyperrect *b)
+{
+	int i;
+	double result = 0;
+
+	for (i=0; i < a->dim; i++) {
+		if (a->max[i] < b->min[i]) {
+			result += SQ(b->min[i] - a->max[i]);
+		} else if (b->max[i] < a->min[i]) {
+			result += SQ(a->min[i] - b->max[i]);
+		}
+	}
+
+	return result;
+}
+
 /* ---- static helpers ---- */
 
 #ifdef USE_LIST_NODE_ALLOCATOR
@@ -822,6 +4362,34 @@ static int rlist_insert(struct res_node *list, struct kdnode *item, double dist_
 	return 0;
 }
 
+/* ordered insert into the list of a nearest N search, dropping the farthest
+ * item if the list grows beyond "num" items.
+ */
+static int rlist_insert_n(struct nearest_n *nn, struct kdnode *item, double dist_sq)
+{
+	struct res_node *last, *prev;
+
+	if(rlist_insert(nn->list, item, dist_sq) == -1) {
+		return -1;
+	}
+
+	prev = nn->list;
+	last = nn->list->next;
+	while(last->next) {
+		prev = last;
+		last = last->next;
+	}
+	if(nn->size == nn->num) {
+		prev->next = 0;
+		free_resnode(last);
+		last = prev;
+	} else {
+		nn->size++;
+	}
+	nn->max_sq = last->dist_sq;
+	return 0;
+}
+
 static void clear_results(struct kdres *rset)
 {
 	struct res_node *tmp, *node = rset->rlist->next;
@@ -27,35 +27,267 @@ OF SUCH DAMAGE.
 #ifndef _KDTREE_H_
 #define _KDTREE_H_
 
+#include <stddef.h>
+#include <stdio.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 struct kdtree;
 struct kdres;
+struct kdcursor;
+
+/* shape and memory use of a tree, see kd_info */
+struct kdinfo {
+	int size;			/* number of points */
+	int max_depth;		/* depth of the deepest node, the root has depth 1 */
+	double avg_depth;	/* average depth of all nodes */
+	double balance;		/* depth of a perfectly balanced tree of the same size
+						   divided by max_depth, 1.0 for a balanced tree */
+	size_t mem;			/* bytes allocated for the tree, see kd_mem_usage */
+};
+
+/* options of a search, see kd_nearest_q */
+struct kdquery {
+	unsigned int mask;	/* only find points with a tag sharing a bit with
+						   the mask, see kd_insert_tag; 0 finds all points */
+	double now;			/* if not 0, skip points which expired at or before
+						   this time, see kd_insert_expiring */
+	double max_dist;	/* if greater than 0, only find points within this
+						   distance of the query point */
+};
+
+/* search statistics, see kd_stats_attach */
+struct kdstats {
+	long nodes;		/* tree nodes visited */
+	long dists;		/* point distance evaluations */
+	long pruned;	/* subtrees skipped by a distance bound */
+};
+
+/* counters of the search cache of a tree, see kd_cache */
+struct kdcachestats {
+	long hits;			/* searches answered from the cache */
+	long misses;		/* searches which walked the tree */
+	long invalidated;	/* cached searches dropped by inserts */
+	int size;			/* number of cached searches */
+};
 
 
 /* create a kd-tree for "k"-dimensional data */
 struct kdtree *kd_create(int k);
 
+/* create a kd-tree which stores coordinates as 16 or 32 bit integers
+ * ("bits"), in steps of (max - min) / (2^bits - 1) along each axis of the
+ * box from "min" to "max". Points are rounded to the nearest step, and
+ * clamped to the box. If "min" and "max" are null, the box is the
+ * bounding box of the points passed to kd_build, and inserting before
+ * that fails.
+ */
+struct kdtree *kd_create_quantized(int k, const double *min, const double *max, int bits);
+
 /* free the struct kdtree */
 void kd_free(struct kdtree *tree);
 
 /* remove all the elements from the tree */
 void kd_clear(struct kdtree *tree);
 
+/* Create a snapshot of the tree: a read-only tree holding the points
+ * inserted so far, which is not affected by later insertions or kd_clear.
+ * Snapshots share all nodes with the tree, so they are cheap to create.
+ *
+ * A snapshot may be searched from any thread while points are inserted
+ * into the tree, but it must be created by the thread modifying the tree.
+ * Free it with kd_free; the nodes of a cleared or freed tree are only
+ * released when its last snapshot is freed.
+ * Returns null on error.
+ */
+struct kdtree *kd_snapshot(struct kdtree *tree);
+
+/* returns non-zero if the tree is a snapshot, see kd_snapshot */
+int kd_is_snapshot(struct kdtree *tree);
+
+/* returns the number of live snapshots of a tree */
+int kd_snapshot_count(struct kdtree *tree);
+
 /* if called with non-null 2nd argument, the function provided
  * will be called on data pointers (see kd_insert) when nodes
  * are to be removed from the tree.
  */
 void kd_data_destructor(struct kdtree *tree, void (*destr)(void*));
 
+/* calls the data destructor on the data pointers of all nodes, and sets
+ * them to null. The points stay in the tree.
+ */
+void kd_free_data(struct kdtree *tree);
+
+/* if "merge" is non-zero, points inserted afterwards at the exact position
+ * of a point already in the tree share its node, which then holds several
+ * data pointers, see kd_res_item_value. Each point keeps its own id.
+ * kd_build does not merge the points passed to it.
+ * Returns -1 for snapshots.
+ */
+int kd_merge_duplicates(struct kdtree *tree, int merge);
+
+/* returns the dimensions of the tree */
+int kd_dimension(struct kdtree *tree);
+
+/* returns the number of points in the tree, see also kd_expire */
+int kd_size(struct kdtree *tree);
+
+/* returns the id the next point inserted into the tree will get, see
+ * kd_res_item_id */
+int kd_next_id(struct kdtree *tree);
+
+/* returns the number of bytes allocated by the tree, not counting the
+ * memory pointed to by data pointers. This does not walk the tree.
+ */
+size_t kd_mem_usage(struct kdtree *tree);
+
+/* fills "info" with the shape and memory use of the tree. This walks
+ * the whole tree.
+ */
+void kd_info(struct kdtree *tree, struct kdinfo *info);
+
+/* Add the statistics of all following searches made by the calling thread
+ * to the counters in "st", until called again with a null pointer.
+ * The counters are only updated if the library was built with KD_STATS
+ * defined; otherwise this function does nothing.
+ */
+void kd_stats_attach(struct kdstats *st);
+
 /* insert a node, specifying its position, and optional data */
 int kd_insert(struct kdtree *tree, const double *pos, void *data);
 int kd_insertf(struct kdtree *tree, const float *pos, void *data);
 int kd_insert3(struct kdtree *tree, double x, double y, double z, void *data);
 int kd_insert3f(struct kdtree *tree, float x, float y, float z, void *data);
 
+/* insert a node with a tag, which searches can filter on (see struct
+ * kdquery). Nodes inserted by the other functions have tag 0, which no
+ * mask matches. */
+int kd_insert_tag(struct kdtree *tree, const double *pos, void *data, unsigned int tag);
+
+/* insert a node which expires at time "expires", in any unit, with a tag
+ * (see kd_insert_tag). Expired points are found until kd_expire removes
+ * them, unless the query skips them (see struct kdquery). Nodes inserted
+ * by the other functions never expire.
+ */
+int kd_insert_expiring(struct kdtree *tree, const double *pos, void *data, unsigned int tag, double expires);
+
+/* Remove all points which expired at or before "now". Subtrees without
+ * expired points are skipped, and nodes whose subtrees still hold points
+ * stay in the tree, without values, until they make up half of it; then
+ * the tree is rebuilt. Ids of the remaining points don't change.
+ * Returns the number of points removed, or -1 for snapshots, or while the
+ * tree has snapshots.
+ */
+int kd_expire(struct kdtree *tree, double now);
+
+/* Move the point with the given id to "pos". If it stays on the same side
+ * of the splitting planes above its node, the node is updated in place;
+ * otherwise the point is inserted again below the node whose plane it
+ * crosses, leaving a removed node behind if other nodes hang below it (see
+ * kd_expire). The first call indexes the nodes by id, which takes O(n).
+ * Returns 0 on success, or -1 if there is no point with this id, on error,
+ * for snapshots, or while the tree has snapshots. On error the point stays
+ * where it was.
+ */
+int kd_update(struct kdtree *tree, int id, const double *pos);
+
+/* Insert "n" points into an empty tree at once, building a balanced tree.
+ * "pos" holds the n * k coordinates of the points one after the other, and
+ * "data" holds their n data pointers, or is null if there are none.
+ * The points are given ids in array order.
+ * Returns 0 on success, or -1 on error or if the tree is not empty.
+ */
+int kd_build(struct kdtree *tree, const double *pos, void **data, int n);
+
+/* split policies, see kd_split */
+#define KD_SPLIT_CYCLE		0	/* cycle through the axes, splitting at the median */
+#define KD_SPLIT_SPREAD		1	/* split the axis of widest spread at the median */
+#define KD_SPLIT_VARIANCE	2	/* split the axis of largest variance at the median */
+#define KD_SPLIT_MIDPOINT	3	/* sliding midpoint of the axis of widest spread */
+
+/* Choose how kd_build, kd_rebuild and the rebuilds of kd_expire pick the
+ * splitting plane of each node. The default, KD_SPLIT_CYCLE, cycles through
+ * the axes by depth, which gives thin cells on data much wider along some
+ * axes than others; the other policies split the subtree of each node along
+ * its widest axis, by spread or variance. KD_SPLIT_MIDPOINT splits it near
+ * the middle of that axis instead of at the median, at the node nearest to
+ * the middle, but never with fewer than an eighth of the nodes on one side.
+ * Points inserted one by one still cycle through the axes below their
+ * parent. Returns -1 for snapshots or an unknown policy.
+ */
+int kd_split(struct kdtree *tree, int policy);
+
+/* Rebuild the tree into a balanced tree by its split policy, dropping the
+ * nodes left behind by kd_expire and kd_update, and lay it out like
+ * kd_optimize. Ids of the points don't change.
+ * Returns 0 on success, or -1 on error, for snapshots, or while the tree
+ * has snapshots.
+ */
+int kd_rebuild(struct kdtree *tree);
+
+/* Move all nodes of the tree into one block of memory, in van Emde Boas
+ * order, so that searches touch fewer cache lines and pages. kd_build does
+ * this by itself; call it again after many inserts.
+ * Returns 0 on success, or -1 on error, for snapshots, or while the tree
+ * has snapshots.
+ */
+int kd_optimize(struct kdtree *tree);
+
+/* search modes, see kd_scan */
+#define KD_SCAN_AUTO		0	/* scan when searches visit most nodes */
+#define KD_SCAN_ALWAYS		1	/* always scan */
+#define KD_SCAN_NEVER		2	/* always walk the tree */
+
+/* Choose whether kd_nearest_q and kd_nearest_range_q (and the functions
+ * based on them) walk the tree, or compute the distances to all points in
+ * a flat copy of their coordinates, one axis after the other, which
+ * compilers vectorize. In small trees and trees of many dimensions,
+ * searches visit most nodes anyway, and the scan is faster and takes the
+ * same time for every query. KD_SCAN_AUTO, the default, scans trees up to
+ * a size which grows with the number of dimensions, once searches which
+ * walked the tree visited enough nodes to make a scan cheaper; one in 64
+ * searches still walks the tree, to notice when queries change.
+ * The copy takes the memory of the coordinates again, and is made by the
+ * first search after the tree changed, other than by inserts. Snapshots
+ * always walk the tree. Returns -1 for snapshots or an unknown mode.
+ */
+int kd_scan(struct kdtree *tree, int mode);
+
+/* Write the points of a tree to an index file, with their ids, tags and
+ * expiry times but without their data, keeping the shape of the tree, so
+ * that kd_load can read it back without searching for medians again.
+ * Coordinates are written as doubles, so a quantized tree is read back as
+ * a tree of doubles. Returns 0 on success, or -1 on a write error or if
+ * memory ran out.
+ */
+int kd_save(struct kdtree *tree, FILE *fp);
+
+/* Read a tree written by kd_save, with null data pointers, laid out like
+ * kd_optimize. Returns the new tree, or null if the file is not a valid
+ * index file or memory ran out.
+ */
+struct kdtree *kd_load(FILE *fp);
+
+/* Cache the results of up to "capacity" searches made by kd_nearest_q and
+ * kd_nearest_n_q (and the functions based on them), dropping the least
+ * recently used ones. A search for the same point, number of neighbours
+ * and mask then returns the cached result without walking the tree.
+ * If "quantum" is positive, each coordinate of a query point is rounded to
+ * a multiple of it first, and the search is made for the rounded point.
+ *
+ * Inserting a point only drops the cached searches whose results it could
+ * change; kd_clear and kd_optimize drop all of them. A "capacity" of 0
+ * removes the cache. Returns -1 on error or for snapshots.
+ */
+int kd_cache(struct kdtree *tree, int capacity, double quantum);
+
+/* fills "st" with the counters of the cache of the tree, and resets them
+ * if "reset" is non-zero. Returns -1 if the tree has no cache. */
+int kd_cache_stats(struct kdtree *tree, struct kdcachestats *st, int reset);
+
 /* Find the nearest node from a given point.
  *
  * This function returns a pointer to a result set with at most one element.
@@ -65,16 +297,36 @@ struct kdres *kd_nearestf(struct kdtree *tree, const float *pos);
 struct kdres *kd_nearest3(struct kdtree *tree, double x, double y, double z);
 struct kdres *kd_nearest3f(struct kdtree *tree, float x, float y, float z);
 
+/* like kd_nearest, but only finds points matching the query "q". Subtrees
+ * without any matching point are skipped. The result set is empty if no
+ * point matches. */
+struct kdres *kd_nearest_q(struct kdtree *tree, const double *pos, const struct kdquery *q);
+
+/* Find the nearest node for each of "count" query points, like kd_nearest_q,
+ * given one after the other in "pos". The queries are run in the order of
+ * their Morton codes, so that consecutive queries visit the same nodes and
+ * find them in the cache of the CPU. The id of the nearest node of the i-th
+ * query, or -1 if none matches it, is written to ids[i], and if "nearest" is
+ * not null, its coordinates to the i-th point of "nearest" (zero if none).
+ * The result cache (see kd_cache) is not used.
+ *
+ * returns the number of queries which found a node, or -1 if memory ran out
+ */
+int kd_nearest_batch(struct kdtree *tree, const double *pos, int count, const struct kdquery *q,
+		int *ids, double *nearest);
+
 /* Find the N nearest nodes from a given point.
  *
- * This function returns a pointer to a result set, with at most N elements,
- * which can be manipulated with the kd_res_* functions.
+ * This function returns a pointer to a result set, with at most N elements
+ * ordered by increasing distance, which can be manipulated with the kd_res_*
+ * functions.
  * The returned pointer can be null as an indication of an error. Otherwise
  * a valid result set is always returned which may contain 0 or more elements.
  * The result set must be deallocated with kd_res_free after use.
  */
-/*
 struct kdres *kd_nearest_n(struct kdtree *tree, const double *pos, int num);
+struct kdres *kd_nearest_n_q(struct kdtree *tree, const double *pos, int num, const struct kdquery *q);
+/*
 struct kdres *kd_nearest_nf(struct kdtree *tree, const float *pos, int num);
 struct kdres *kd_nearest_n3(struct kdtree *tree, double x, double y, double z);
 struct kdres *kd_nearest_n3f(struct kdtree *tree, float x, float y, float z);
@@ -93,6 +345,81 @@ struct kdres *kd_nearest_rangef(struct kdtree *tree, const float *pos, float ran
 struct kdres *kd_nearest_range3(struct kdtree *tree, double x, double y, double z, double range);
 struct kdres *kd_nearest_range3f(struct kdtree *tree, float x, float y, float z, float range);
 
+/* like kd_nearest_range, but only finds points matching the query "q" */
+struct kdres *kd_nearest_range_q(struct kdtree *tree, const double *pos, double range, const struct kdquery *q);
+
+/* Start a search for the points within a range, like kd_nearest_range_q,
+ * whose results are read a page at a time with kd_cursor_next. The cursor
+ * keeps a stack of the subtrees left to search, so each page takes time
+ * and memory in proportion to its size and the depth of the tree, however
+ * many points are in range.
+ * Points inserted while the cursor is open may or may not be found; any
+ * other change to the tree ends the search, see kd_cursor_next. Free the
+ * cursor with kd_cursor_free, before the tree. Returns null on error.
+ */
+struct kdcursor *kd_cursor_range(struct kdtree *tree, const double *pos, double range, const struct kdquery *q);
+
+/* Start a search for the points nearest to "pos" matching "q" (which may
+ * be null), whose results are read with kd_cursor_next in order of
+ * increasing distance, like kd_nearest_n_q with a number of points which
+ * is not known in advance. The cursor keeps a queue of the subtrees and
+ * points met so far, ordered by distance, with the bounding box of each
+ * subtree cut from that of the tree; each page only searches the subtrees
+ * which may hold points nearer than its last one. See kd_cursor_range.
+ */
+struct kdcursor *kd_cursor_nearest(struct kdtree *tree, const double *pos, const struct kdquery *q);
+
+/* Continue the search of a cursor, returning a result set (see kd_res_*)
+ * with the next points found: by increasing distance for kd_cursor_nearest,
+ * otherwise in no particular order, nearer subtrees first. The set holds up to "num" points, counting each value of merged
+ * duplicates (see kd_merge_duplicates), and only holds more than that if
+ * a single node holds more. It is empty once all points were found.
+ * Returns null if memory ran out, or if the tree was cleared or points
+ * were moved or removed since the cursor was created.
+ */
+struct kdres *kd_cursor_next(struct kdcursor *cur, int num);
+
+/* returns non-zero once a cursor found all points */
+int kd_cursor_done(struct kdcursor *cur);
+
+/* frees a cursor returned by kd_cursor_range or kd_cursor_nearest */
+void kd_cursor_free(struct kdcursor *cur);
+
+/* kernels of kd_density, as functions of the distance d of a point and
+ * the bandwidth h */
+#define KD_KERNEL_GAUSSIAN		0	/* exp(-d^2 / 2h^2) */
+#define KD_KERNEL_EPANECHNIKOV	1	/* 1 - d^2 / h^2 within h, 0 beyond */
+#define KD_KERNEL_UNIFORM		2	/* 1 within h, 0 beyond */
+
+/* options of kd_density */
+struct kddensity {
+	int kernel;			/* one of KD_KERNEL_* */
+	double bandwidth;
+	double tolerance;	/* largest error of the kernel value of a point */
+	double (*weight)(void *data);	/* weight of a point by its data
+									   pointer, or null to count points */
+};
+
+/* Compute, for each of "count" query points given one after the other in
+ * "pos", the sum over all points matching "q" (which may be null) of the
+ * kernel value of their distance times their weight, and write it to
+ * out[i]. With the uniform kernel, this is the total weight of the points
+ * within the bandwidth. The sums are computed while walking the tree,
+ * without result sets, with the queries in the order of kd_nearest_batch.
+ * Subtrees are skipped once the kernel is 0 beyond the nearest corner of
+ * their bounding box. Without a mask or time in "q", a subtree in which
+ * the kernel values of the nearest and farthest corner differ by at most
+ * twice the tolerance counts as its total weight times their mean, so
+ * that each sum is within "tolerance" times the total absolute weight of
+ * the points of the exact sum; a tolerance of 0 is exact, and still sums
+ * whole subtrees in range of the uniform kernel at once. The total weight
+ * of each subtree is kept for each weight function, and summed up again
+ * by the first search after points were added, moved or removed.
+ * Returns 0, or -1 if memory ran out or the kernel or bandwidth is invalid.
+ */
+int kd_density(struct kdtree *tree, const double *pos, int count, const struct kddensity *opt,
+		const struct kdquery *q, double *out);
+
 /* frees a result set returned by kd_nearest_range() */
 void kd_res_free(struct kdres *set);
 
@@ -121,6 +448,61 @@ void *kd_res_item3f(struct kdres *set, float *x, float *y, float *z);
 /* equivalent to kd_res_item(set, 0) */
 void *kd_res_item_data(struct kdres *set);
 
+/* returns the number of data pointers at the position of the current
+ * result set item, which is more than one if duplicates were merged into
+ * it (see kd_merge_duplicates), or 0 past the end */
+int kd_res_item_count(struct kdres *set);
+
+/* returns the i-th data pointer at the position of the current result set
+ * item, in insertion order, and stores the id of the point in "id" if it
+ * is not null. The first one is the data returned by kd_res_item.
+ * Returns null, and sets the id to -1, if "i" is out of range.
+ */
+void *kd_res_item_value(struct kdres *set, int i, int *id);
+
+/* returns the id of the current result set item, or -1 past the end.
+ * Ids are assigned in insertion order, starting from 0 after kd_create
+ * or kd_clear.
+ */
+int kd_res_item_id(struct kdres *set);
+
+/* Find every pair of points, one from each tree, which lie within "range"
+ * of each other. Both trees are descended together, and pairs of subtrees
+ * whose bounding hyperrectangles are farther apart than "range" are pruned.
+ *
+ * "func" is called with the ids of the two points (in "ta" and "tb") for
+ * each pair found; a non-zero return value aborts the join.
+ * Returns the number of pairs found, or -1 on error or abort.
+ */
+int kd_radius_join(struct kdtree *ta, struct kdtree *tb, double range,
+		int (*func)(int, int, void*), void *arg);
+
+/* Points on the earth, given by latitude and longitude in degrees, are
+ * stored in a 3-dimensional tree as points on the unit sphere. The
+ * straight line (chord) between two such points grows with their
+ * great-circle distance, so the searches of the tree find the points
+ * nearest by great-circle distance, and the bounding boxes of its subtrees
+ * bound it from below. Ranges and max_dist are given as chords, see
+ * kd_geo_chord.
+ */
+#define KD_EARTH_RADIUS		6371008.8	/* mean radius in metres */
+
+/* converts the latitude and longitude in "latlon" to a point on the unit
+ * sphere in "xyz" */
+void kd_geo_point(const double *latlon, double *xyz);
+
+/* converts a point on the unit sphere back to latitude and longitude */
+void kd_geo_latlon(const double *xyz, double *latlon);
+
+/* returns the chord of a great-circle distance in metres, and the
+ * great-circle distance in metres of a chord */
+double kd_geo_chord(double metres);
+double kd_geo_metres(double chord);
+
+/* returns the great-circle distance in metres between two points given by
+ * latitude and longitude */
+double kd_geo_distance(const double *a, const double *b);
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,280 @@
+/**
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+
+#include <v8.h>
+#include <node.h>
+#include <sstream>
+#include <vector>
+#include <nan.h>
+#include <kddyn.h>
+#include "node-kdtree.h"
+
+using namespace v8;
+using namespace node;
+
+/**
+ * A kd-tree index for a continuous stream of inserts mixed with queries.
+ *
+ * Points are kept in a small insert buffer and a set of balanced trees of
+ * doubling sizes, which are merged as the index grows. Unlike KDTree, the
+ * index stays balanced no matter in which order points are inserted.
+ */
+class DynamicKDTree : public ObjectWrap {
+  public:
+    static void
+    Initialize (v8::Handle<v8::Object> exports){
+        Nan::HandleScope scope;
+
+        Local<FunctionTemplate> t = Nan::New<FunctionTemplate>(New);
+
+        t->InstanceTemplate()->SetInternalFieldCount(1);
+        t->SetClassName(Nan::New("DynamicKDTree").ToLocalChecked());
+
+        Nan::SetPrototypeMethod(t, "dimensions", Dimensions);
+        Nan::SetPrototypeMethod(t, "size", Size);
+        Nan::SetPrototypeMethod(t, "insert", Insert);
+        Nan::SetPrototypeMethod(t, "nearest", Nearest);
+        Nan::SetPrototypeMethod(t, "nearestN", NearestN);
+        Nan::SetPrototypeMethod(t, "nearestRange", NearestRange);
+
+        exports->Set(Nan::New("DynamicKDTree").ToLocalChecked(), t->GetFunction());
+    }
+
+  protected:
+
+    /**
+     * Read the coordinates of a point from the first len arguments,
+     * throwing an error if they do not match the dimensions of the index.
+     *
+     * @return true if the point was read successfully
+     */
+    bool ReadPoint(Nan::NAN_METHOD_ARGS_TYPE info, int len, std::vector<double> &pos,
+                   const char *method){
+      if (len != dim_){
+        std::stringstream ss;
+        ss << method << "(): Wrong number of parameters. Passed: "
+           << len << " Expected: " << dim_;
+        Nan::ThrowError(Nan::New(ss.str()).ToLocalChecked());
+        return false;
+      }
+
+      pos.resize(len);
+      for (int i = 0; i < len; i++){
+        pos[i] = info[i]->NumberValue();
+      }
+      return true;
+    }
+
+    static int _CollectRange(const struct kddyn_hit *hit, void *arg){
+      std::vector<struct kddyn_hit> *hits = (std::vector<struct kddyn_hit> *)arg;
+      hits->push_back(*hit);
+      return 0;
+    }
+
+    static NAN_METHOD(Dimensions){
+      DynamicKDTree *kd = ObjectWrap::Unwrap<DynamicKDTree>(info.This());
+      info.GetReturnValue().Set(Nan::New<Number>(kd->dim_));
+    }
+
+    static NAN_METHOD(Size){
+      DynamicKDTree *kd = ObjectWrap::Unwrap<DynamicKDTree>(info.This());
+      info.GetReturnValue().Set(Nan::New<Number>(kddyn_size(kd->dyn_)));
+    }
+
+    /**
+     * Insert a point, with an optional data value, into the index.
+     * Returns true if the point was inserted successfully.
+     */
+    static NAN_METHOD(Insert){
+      DynamicKDTree *kd = ObjectWrap::Unwrap<DynamicKDTree>(info.This());
+      std::vector<double> pos;
+      int len = info.Length();
+      bool hasData = (len == kd->dim_ + 1);
+
+      if (!kd->ReadPoint(info, hasData ? len - 1 : len, pos, "Insert")) {
+        return;
+      }
+
+      Nan::Persistent<Value>* per = NULL;
+      if (hasData) {
+        per = new Nan::Persistent<Value>(info[len - 1]);
+      }
+
+      bool inserted = (kddyn_insert(kd->dyn_, &pos[0], per) == 0);
+      if (!inserted) {
+        freeNodeData(per);
+      }
+      kd->SyncExternalMemory();
+      info.GetReturnValue().Set(Nan::New<Boolean>(inserted));
+    }
+
+    /**
+     * Find the point nearest to the given point, see KDTree.nearest()
+     */
+    static NAN_METHOD(Nearest){
+      DynamicKDTree *kd = ObjectWrap::Unwrap<DynamicKDTree>(info.This());
+      Nan::HandleScope scope;
+      std::vector<double> pos;
+      struct kddyn_hit hit;
+
+      if (!kd->ReadPoint(info, info.Length(), pos, "Nearest")) {
+        return;
+      }
+
+      int found = kddyn_nearest_n(kd->dyn_, &pos[0], 1, &hit);
+      if (found < 0) {
+        Nan::ThrowError("Nearest(): Out of memory.");
+      } else if (found == 0) {
+        info.GetReturnValue().Set(Nan::New<Array>());
+      } else {
+        info.GetReturnValue().Set(pointToArray(hit.pos, kd->dim_, hit.data));
+      }
+    }
+
+    /**
+     * Find the N points nearest to the given point, see KDTree.nearestN()
+     */
+    static NAN_METHOD(NearestN){
+      DynamicKDTree *kd = ObjectWrap::Unwrap<DynamicKDTree>(info.This());
+      Nan::HandleScope scope;
+      std::vector<double> pos;
+
+      if (info.Length() == 0) {
+        Nan::ThrowError("NearestN(): No parameters were provided.");
+        return;
+      }
+      if (!kd->ReadPoint(info, info.Length() - 1, pos, "NearestN")) {
+        return;
+      }
+
+      // No more points can be found than the index holds
+      int num = info[info.Length() - 1]->Int32Value();
+      if (num > kddyn_size(kd->dyn_)) {
+        num = kddyn_size(kd->dyn_);
+      }
+      std::vector<struct kddyn_hit> hits(num > 0 ? num : 1);
+      int found = kddyn_nearest_n(kd->dyn_, &pos[0], num, &hits[0]);
+      if (found < 0) {
+        Nan::ThrowError("NearestN(): Out of memory.");
+        return;
+      }
+
+      Local<Array> result = Nan::New<Array>(found);
+      for (int i = 0; i < found; i++) {
+        result->Set(i, pointToArray(hits[i].pos, kd->dim_, hits[i].data));
+      }
+      info.GetReturnValue().Set(result);
+    }
+
+    /**
+     * Find the points within a given range, see KDTree.nearestRange()
+     */
+    static NAN_METHOD(NearestRange){
+      DynamicKDTree *kd = ObjectWrap::Unwrap<DynamicKDTree>(info.This());
+      Nan::HandleScope scope;
+      std::vector<double> pos;
+      std::vector<struct kddyn_hit> hits;
+
+      if (info.Length() == 0) {
+        Nan::ThrowError("NearestRange(): No parameters were provided.");
+        return;
+      }
+      if (!kd->ReadPoint(info, info.Length() - 1, pos, "NearestRange")) {
+        return;
+      }
+
+      double range = info[info.Length() - 1]->NumberValue();
+      if (kddyn_nearest_range(kd->dyn_, &pos[0], range, _CollectRange, &hits) < 0) {
+        Nan::ThrowError("NearestRange(): Out of memory.");
+        return;
+      }
+
+      Local<Array> result = Nan::New<Array>((int)hits.size());
+      for (size_t i = 0; i < hits.size(); i++) {
+        result->Set(i, pointToArray(hits[i].pos, kd->dim_, hits[i].data));
+      }
+      info.GetReturnValue().Set(result);
+    }
+
+    /**
+     * "External" constructor called by the Addon framework
+     *
+     * Arguments are the dimensions of each point (default 3), and the size
+     * of the insert buffer.
+     */
+    static NAN_METHOD(New){
+        int dimension = 3; // Default
+        int bufsize = 0;
+        if (info.Length() > 0){
+          dimension = info[0]->Int32Value();
+        }
+        if (info.Length() > 1){
+          bufsize = info[1]->Int32Value();
+        }
+
+        DynamicKDTree *kd = new DynamicKDTree(dimension, bufsize);
+        kd->Wrap(info.This());
+
+        info.GetReturnValue().Set(info.This());
+    }
+
+    /**
+     * Constructor
+     *
+     * @param dim       Dimensions of each point in the index
+     * @param bufsize   Number of points in the insert buffer, 0 for a default size
+     */
+    DynamicKDTree (int dim, int bufsize) : ObjectWrap (){
+        dyn_ = kddyn_create(dim, bufsize);
+        dim_ = dim;
+        external_ = 0;
+        kddyn_data_destructor(dyn_, freeNodeData);
+        SyncExternalMemory();
+    }
+
+    /**
+     * Destructor
+     */
+    ~DynamicKDTree(){
+        if (dyn_ != NULL){
+            kddyn_free(dyn_);
+        }
+        Nan::AdjustExternalMemory(static_cast<int>(-external_));
+    }
+
+    /**
+     * Report any change in native memory use to V8, see KDTree
+     */
+    void SyncExternalMemory(){
+      int64_t bytes = dyn_ ? (int64_t)kddyn_mem_usage(dyn_) : 0;
+      if (bytes != external_) {
+        Nan::AdjustExternalMemory(static_cast<int>(bytes - external_));
+        external_ = bytes;
+      }
+    }
+
+  private:
+    /**
+     * Pointer to the index itself
+     */
+    struct kddyn* dyn_;
+
+    /**
+     * Dimension of each point in the index
+     */
+    int dim_;
+
+    /**
+     * Native memory currently reported to V8
+     */
+    int64_t external_;
+};
+
+void InitDynamicKDTree(Handle<Object> exports){
+  DynamicKDTree::Initialize(exports);
+}
@@ -0,0 +1,428 @@
+/**
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+
+#include <v8.h>
+#include <node.h>
+#include <sstream>
+#include <vector>
+#include <nan.h>
+#include <kdshard.h>
+#include "node-kdtree.h"
+
+using namespace v8;
+using namespace node;
+
+/**
+ * A kd-tree index split into shards by regions of space.
+ *
+ * Each shard has a tree of its own, so that a batch of points is inserted
+ * by one thread per shard, and queries only search the shards near them.
+ */
+class ShardedKDTree : public ObjectWrap {
+  public:
+    static void
+    Initialize (v8::Handle<v8::Object> exports){
+        Nan::HandleScope scope;
+
+        Local<FunctionTemplate> t = Nan::New<FunctionTemplate>(New);
+
+        t->InstanceTemplate()->SetInternalFieldCount(1);
+        t->SetClassName(Nan::New("ShardedKDTree").ToLocalChecked());
+
+        Nan::SetPrototypeMethod(t, "dimensions", Dimensions);
+        Nan::SetPrototypeMethod(t, "size", Size);
+        Nan::SetPrototypeMethod(t, "shardSizes", ShardSizes);
+        Nan::SetPrototypeMethod(t, "insert", Insert);
+        Nan::SetPrototypeMethod(t, "insertBatch", InsertBatch);
+        Nan::SetPrototypeMethod(t, "nearest", Nearest);
+        Nan::SetPrototypeMethod(t, "nearestN", NearestN);
+        Nan::SetPrototypeMethod(t, "nearestRange", NearestRange);
+
+        exports->Set(Nan::New("ShardedKDTree").ToLocalChecked(), t->GetFunction());
+    }
+
+  protected:
+
+    /**
+     * Read the coordinates of a point from the first len arguments,
+     * throwing an error if they do not match the dimensions of the index.
+     *
+     * @return true if the point was read successfully
+     */
+    bool ReadPoint(Nan::NAN_METHOD_ARGS_TYPE info, int len, std::vector<double> &pos,
+                   const char *method){
+      if (len != dim_){
+        std::stringstream ss;
+        ss << method << "(): Wrong number of parameters. Passed: "
+           << len << " Expected: " << dim_;
+        Nan::ThrowError(Nan::New(ss.str()).ToLocalChecked());
+        return false;
+      }
+
+      pos.resize(len);
+      for (int i = 0; i < len; i++){
+        pos[i] = info[i]->NumberValue();
+      }
+      return true;
+    }
+
+    /**
+     * Read an array of numbers, or a Float64Array, into "values".
+     *
+     * @return false if "value" is neither
+     */
+    static bool ReadNumbers(Local<Value> value, std::vector<double> &values){
+      if (value->IsFloat64Array()) {
+        Nan::TypedArrayContents<double> contents(value);
+        values.assign(*contents, *contents + contents.length());
+        return true;
+      }
+      if (!value->IsArray()) {
+        return false;
+      }
+      Local<Array> array = value.As<Array>();
+      values.resize(array->Length());
+      for (uint32_t i = 0; i < array->Length(); i++) {
+        values[i] = array->Get(i)->NumberValue();
+      }
+      return true;
+    }
+
+    static NAN_METHOD(Dimensions){
+      ShardedKDTree *kd = ObjectWrap::Unwrap<ShardedKDTree>(info.This());
+      info.GetReturnValue().Set(Nan::New<Number>(kd->dim_));
+    }
+
+    static NAN_METHOD(Size){
+      ShardedKDTree *kd = ObjectWrap::Unwrap<ShardedKDTree>(info.This());
+      info.GetReturnValue().Set(Nan::New<Number>(kdshards_size(kd->shards_, -1)));
+    }
+
+    /**
+     * Returns an array with the number of points in each shard
+     */
+    static NAN_METHOD(ShardSizes){
+      ShardedKDTree *kd = ObjectWrap::Unwrap<ShardedKDTree>(info.This());
+      int count = kdshards_count(kd->shards_);
+      Local<Array> sizes = Nan::New<Array>(count);
+
+      for (int i = 0; i < count; i++) {
+        sizes->Set(i, Nan::New<Number>(kdshards_size(kd->shards_, i)));
+      }
+      info.GetReturnValue().Set(sizes);
+    }
+
+    /**
+     * Insert a point, with an optional data value, into the index.
+     * Returns true if the point was inserted successfully. Unlike
+     * KDTree.insert() there is no id to return, since each shard numbers
+     * its points on its own.
+     */
+    static NAN_METHOD(Insert){
+      ShardedKDTree *kd = ObjectWrap::Unwrap<ShardedKDTree>(info.This());
+      std::vector<double> pos;
+      int len = info.Length();
+      bool hasData = (len == kd->dim_ + 1);
+
+      if (!kd->ReadPoint(info, hasData ? len - 1 : len, pos, "Insert")) {
+        return;
+      }
+
+      void *per = NULL;
+      if (hasData) {
+        per = new Nan::Persistent<Value>(info[len - 1]);
+      }
+
+      bool inserted = (kdshards_insert(kd->shards_, &pos[0], hasData ? &per : NULL, 1, NULL) == 1);
+      if (!inserted) {
+        freeNodeData(per);
+      }
+      kd->SyncExternalMemory();
+      info.GetReturnValue().Set(Nan::New<Boolean>(inserted));
+    }
+
+    /**
+     * Insert many points at once, given one after the other in a
+     * Float64Array, optionally followed by an array of their values.
+     * The points of each shard are inserted on a thread of their own.
+     * Returns the number of points inserted.
+     */
+    static NAN_METHOD(InsertBatch){
+      ShardedKDTree *kd = ObjectWrap::Unwrap<ShardedKDTree>(info.This());
+
+      if (info.Length() == 0 || !info[0]->IsFloat64Array()) {
+        Nan::ThrowTypeError("InsertBatch(): Expected a Float64Array of points.");
+        return;
+      }
+      Nan::TypedArrayContents<double> points(info[0]);
+      if (points.length() % kd->dim_ != 0) {
+        Nan::ThrowError("InsertBatch(): Wrong number of coordinates.");
+        return;
+      }
+      int count = points.length() / kd->dim_;
+
+      std::vector<void *> data;
+      if (info.Length() > 1 && info[1]->IsArray()) {
+        Local<Array> values = info[1].As<Array>();
+        if ((int)values->Length() != count) {
+          Nan::ThrowError("InsertBatch(): Expected one value for each point.");
+          return;
+        }
+        data.resize(count);
+        for (int i = 0; i < count; i++) {
+          data[i] = new Nan::Persistent<Value>(values->Get(i));
+        }
+      }
+
+      std::vector<char> inserted(count > 0 ? count : 1);
+      int added = kdshards_insert(kd->shards_, *points, data.empty() ? NULL : &data[0],
+                                  count, &inserted[0]);
+      for (size_t i = 0; i < data.size(); i++) {
+        if (added < 0 || !inserted[i]) {
+          freeNodeData(data[i]);
+        }
+      }
+      kd->SyncExternalMemory();
+      if (added < 0) {
+        Nan::ThrowError("InsertBatch(): Out of memory.");
+        return;
+      }
+      info.GetReturnValue().Set(Nan::New<Number>(added));
+    }
+
+    /**
+     * Find the point nearest to the given point, see KDTree.nearest()
+     */
+    static NAN_METHOD(Nearest){
+      ShardedKDTree *kd = ObjectWrap::Unwrap<ShardedKDTree>(info.This());
+      Nan::HandleScope scope;
+      std::vector<double> pos, coords;
+      struct kdshards_hit hit;
+
+      if (!kd->ReadPoint(info, info.Length(), pos, "Nearest")) {
+        return;
+      }
+
+      coords.resize(kd->dim_);
+      int found = kdshards_nearest_n(kd->shards_, &pos[0], 1, &hit, &coords[0]);
+      if (found < 0) {
+        Nan::ThrowError("Nearest(): Out of memory.");
+      } else if (found == 0) {
+        info.GetReturnValue().Set(Nan::New<Array>(kd->dim_ + 1));
+      } else {
+        info.GetReturnValue().Set(pointToArray(hit.pos, kd->dim_, hit.data));
+      }
+    }
+
+    /**
+     * Find the N points nearest to the given point, see KDTree.nearestN()
+     */
+    static NAN_METHOD(NearestN){
+      ShardedKDTree *kd = ObjectWrap::Unwrap<ShardedKDTree>(info.This());
+      Nan::HandleScope scope;
+      std::vector<double> pos;
+
+      if (info.Length() == 0) {
+        Nan::ThrowError("NearestN(): No parameters were provided.");
+        return;
+      }
+      if (!kd->ReadPoint(info, info.Length() - 1, pos, "NearestN")) {
+        return;
+      }
+
+      // No more points can be found than the index holds
+      int num = info[info.Length() - 1]->Int32Value();
+      if (num > kdshards_size(kd->shards_, -1)) {
+        num = kdshards_size(kd->shards_, -1);
+      }
+      std::vector<struct kdshards_hit> hits(num > 0 ? num : 1);
+      std::vector<double> coords((size_t)(num > 0 ? num : 1) * kd->dim_);
+      int found = kdshards_nearest_n(kd->shards_, &pos[0], num, &hits[0], &coords[0]);
+      if (found < 0) {
+        Nan::ThrowError("NearestN(): Out of memory.");
+        return;
+      }
+
+      Local<Array> result = Nan::New<Array>(found);
+      for (int i = 0; i < found; i++) {
+        result->Set(i, pointToArray(hits[i].pos, kd->dim_, hits[i].data));
+      }
+      info.GetReturnValue().Set(result);
+    }
+
+    /**
+     * Find the points within a given range, see KDTree.nearestRange()
+     */
+    static NAN_METHOD(NearestRange){
+      ShardedKDTree *kd = ObjectWrap::Unwrap<ShardedKDTree>(info.This());
+      Nan::HandleScope scope;
+      std::vector<double> pos;
+      std::vector<struct kdshards_hit> hits;
+      std::vector<double> coords;
+      RangeHits found = { &hits, &coords, kd->dim_ };
+
+      if (info.Length() == 0) {
+        Nan::ThrowError("NearestRange(): No parameters were provided.");
+        return;
+      }
+      if (!kd->ReadPoint(info, info.Length() - 1, pos, "NearestRange")) {
+        return;
+      }
+
+      double range = info[info.Length() - 1]->NumberValue();
+      if (kdshards_nearest_range(kd->shards_, &pos[0], range, _CollectHit, &found) < 0) {
+        Nan::ThrowError("NearestRange(): Out of memory.");
+        return;
+      }
+
+      Local<Array> result = Nan::New<Array>((int)hits.size());
+      for (size_t i = 0; i < hits.size(); i++) {
+        result->Set(i, pointToArray(&coords[i * kd->dim_], kd->dim_, hits[i].data));
+      }
+      info.GetReturnValue().Set(result);
+    }
+
+    /**
+     * "External" constructor called by the Addon framework
+     *
+     * Arguments are the dimensions of each point, and an object with the
+     * options of the index:
+     *
+     *   shards   number of shards (default 4)
+     *   sample   points, in an array or Float64Array, whose medians divide
+     *            space into the shards
+     *   min/max  corners of a box which is divided into shards of equal
+     *            size, if there is no sample
+     */
+    static NAN_METHOD(New){
+        int dimension = 3; // Default
+        int count = 4;
+        if (info.Length() > 0){
+          dimension = info[0]->Int32Value();
+        }
+        if (dimension <= 0) {
+          Nan::ThrowRangeError("ShardedKDTree(): The dimensions must be positive.");
+          return;
+        }
+        if (info.Length() < 2 || !info[1]->IsObject()) {
+          Nan::ThrowTypeError("ShardedKDTree(): Expected an object with a sample or a min and max.");
+          return;
+        }
+
+        Local<Object> options = info[1].As<Object>();
+        Local<Value> shards = Nan::Get(options, Nan::New("shards").ToLocalChecked()).ToLocalChecked();
+        if (!shards->IsUndefined()) {
+          count = shards->Int32Value();
+        }
+        if (count <= 0) {
+          Nan::ThrowRangeError("ShardedKDTree(): The number of shards must be positive.");
+          return;
+        }
+
+        std::vector<double> sample, min, max;
+        struct kdshards *index;
+        if (ReadNumbers(Nan::Get(options, Nan::New("sample").ToLocalChecked()).ToLocalChecked(), sample)) {
+          int nsample = sample.size() / dimension;
+          if (nsample < count) {
+            Nan::ThrowError("ShardedKDTree(): The sample needs at least one point for each shard.");
+            return;
+          }
+          index = kdshards_create(dimension, count, &sample[0], nsample);
+        } else if (ReadNumbers(Nan::Get(options, Nan::New("min").ToLocalChecked()).ToLocalChecked(), min) &&
+                   ReadNumbers(Nan::Get(options, Nan::New("max").ToLocalChecked()).ToLocalChecked(), max)) {
+          if ((int)min.size() != dimension || (int)max.size() != dimension) {
+            Nan::ThrowError("ShardedKDTree(): min and max need one value for each dimension.");
+            return;
+          }
+          index = kdshards_create_grid(dimension, count, &min[0], &max[0]);
+        } else {
+          Nan::ThrowTypeError("ShardedKDTree(): Expected an object with a sample or a min and max.");
+          return;
+        }
+        if (index == NULL) {
+          Nan::ThrowError("ShardedKDTree(): Out of memory.");
+          return;
+        }
+
+        ShardedKDTree *kd = new ShardedKDTree(dimension, index);
+        kd->Wrap(info.This());
+
+        info.GetReturnValue().Set(info.This());
+    }
+
+    /**
+     * Constructor
+     *
+     * @param dim       Dimensions of each point in the index
+     * @param shards    The shards of the index, owned by this object
+     */
+    ShardedKDTree (int dim, struct kdshards *shards) : ObjectWrap (){
+        shards_ = shards;
+        dim_ = dim;
+        external_ = 0;
+        kdshards_data_destructor(shards_, freeNodeData);
+        SyncExternalMemory();
+    }
+
+    /**
+     * Destructor
+     */
+    ~ShardedKDTree(){
+        if (shards_ != NULL){
+            kdshards_free(shards_);
+        }
+        Nan::AdjustExternalMemory(static_cast<int>(-external_));
+    }
+
+    /**
+     * Report any change in native memory use to V8, see KDTree
+     */
+    void SyncExternalMemory(){
+      int64_t bytes = shards_ ? (int64_t)kdshards_mem_usage(shards_) : 0;
+      if (bytes != external_) {
+        Nan::AdjustExternalMemory(static_cast<int>(bytes - external_));
+        external_ = bytes;
+      }
+    }
+
+  private:
+    /**
+     * The points found by a range search, with copies of their coordinates
+     */
+    struct RangeHits {
+      std::vector<struct kdshards_hit> *hits;
+      std::vector<double> *coords;
+      int dim;
+    };
+
+    static int _CollectHit(const struct kdshards_hit *hit, void *arg){
+      RangeHits *found = (RangeHits *)arg;
+      found->hits->push_back(*hit);
+      found->coords->insert(found->coords->end(), hit->pos, hit->pos + found->dim);
+      return 0;
+    }
+
+    /**
+     * Pointer to the index itself
+     */
+    struct kdshards* shards_;
+
+    /**
+     * Dimension of each point in the index
+     */
+    int dim_;
+
+    /**
+     * Native memory currently reported to V8
+     */
+    int64_t external_;
+};
+
+void InitShardedKDTree(Handle<Object> exports){
+  ShardedKDTree::Initialize(exports);
+}
@@ -11,9 +11,16 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cassert>
+#include <cstring>
+#include <cmath>
+#include <chrono>
 #include <sstream>
+#include <vector>
+#include <map>
+#include <uv.h>
 #include <nan.h>
 #include <kdtree.h>
+#include "node-kdtree.h"
 
 using namespace v8;
 using namespace node;
@@ -30,6 +37,561 @@ void freeNodeData(void *data){
   }
 }
 
+/**
+ * Convert a point to an array of its coordinates, followed by the
+ * point's data element if present.
+ */
+Local<Array> pointToArray(const double *pos, int dim, void *data){
+  Nan::EscapableHandleScope scope;
+  Local<Array> rv = Nan::New<Array>(dim + 1);
+
+  for (int i = 0; i < dim; i++) {
+    rv->Set(i, Nan::New<Number>(pos[i]));
+  }
+
+  // Append data element, if present
+  if (data != NULL) {
+    Nan::Persistent<Value>* hdata = (Nan::Persistent<Value>*)data;
+    rv->Set(dim, Nan::New(*hdata));
+  }
+  return scope.Escape(rv);
+}
+
+/**
+ * Read the coordinates of the current point of a result set into "pos",
+ * and return its data. The points of geodesic trees are read as latitude
+ * and longitude, see KDTree::TreePoint().
+ */
+static void *resultItem(kdres *results, double *pos, bool geo){
+  if (!geo) {
+    return kd_res_item(results, pos);
+  }
+  double xyz[3];
+  void *data = kd_res_item(results, xyz);
+  kd_geo_latlon(xyz, pos);
+  return data;
+}
+
+/**
+ * Convert a point found by a search to an array, see pointToArray(). If
+ * "query" is not NULL, the point was found by a geodesic tree, and its
+ * distance in metres from the query point is set as the "distance"
+ * property of the array.
+ */
+static Local<Array> foundToArray(const double *pos, int dim, void *data, const double *query){
+  Nan::EscapableHandleScope scope;
+  Local<Array> rv = pointToArray(pos, dim, data);
+
+  if (query != NULL) {
+    Nan::Set(rv, Nan::New("distance").ToLocalChecked(), Nan::New<Number>(kd_geo_distance(query, pos)));
+  }
+  return scope.Escape(rv);
+}
+
+#ifdef KD_STATS
+#define HISTOGRAM_BUCKETS 32
+
+/**
+ * Query statistics accumulated by a tree. Bucket i of a histogram counts
+ * the queries whose value was in [2^i, 2^(i+1)); bucket 0 also counts 0.
+ */
+struct QueryStats {
+  double queries, nodes, dists, pruned, results, timeUs;
+  double nodesHistogram[HISTOGRAM_BUCKETS];
+  double latencyHistogram[HISTOGRAM_BUCKETS];
+};
+
+static int histogramBucket(double value){
+  int bucket = 0;
+  while (value >= 2 && bucket < HISTOGRAM_BUCKETS - 1) {
+    value /= 2;
+    bucket++;
+  }
+  return bucket;
+}
+
+/**
+ * Gathers the statistics of a single query, and adds them to the
+ * totals of the tree when it goes out of scope.
+ */
+class QueryProbe {
+  public:
+    QueryProbe(QueryStats *totals) : totals_(totals), results_(0) {
+      memset(&stats_, 0, sizeof stats_);
+      start_ = uv_hrtime();
+      kd_stats_attach(&stats_);
+    }
+
+    void Results(int count){
+      results_ = count;
+    }
+
+    ~QueryProbe(){
+      double us = (uv_hrtime() - start_) / 1e3;
+      kd_stats_attach(NULL);
+
+      totals_->queries++;
+      totals_->nodes += stats_.nodes;
+      totals_->dists += stats_.dists;
+      totals_->pruned += stats_.pruned;
+      totals_->results += results_;
+      totals_->timeUs += us;
+      totals_->nodesHistogram[histogramBucket(stats_.nodes)]++;
+      totals_->latencyHistogram[histogramBucket(us)]++;
+    }
+
+  private:
+    QueryStats *totals_;
+    struct kdstats stats_;
+    uint64_t start_;
+    int results_;
+};
+
+#define QUERY_PROBE(name)         QueryProbe name(&stats_)
+#define QUERY_RESULTS(name, n)    name.Results(n)
+#else
+#define QUERY_PROBE(name)
+#define QUERY_RESULTS(name, n)
+#endif
+
+/**
+ * A tree shared by KDTree objects in several threads, see KDTree.share().
+ *
+ * Queries hold the read lock and inserts the write lock. The tree is freed
+ * along with the last object which refers to it.
+ */
+struct SharedTree {
+  kdtree *kd;
+  int dim;
+  bool geo;
+  uint32_t id;
+  int refs;
+  uv_rwlock_t lock;
+};
+
+static uv_once_t registryOnce = UV_ONCE_INIT;
+static uv_mutex_t registryLock;
+static std::map<uint32_t, SharedTree*> registry;
+static uint32_t registryNextId = 1;
+
+static void initRegistry(){
+  uv_mutex_init(&registryLock);
+}
+
+/**
+ * Holds the lock of a shared tree for the lifetime of this object, or
+ * does nothing if the tree is not shared.
+ */
+class TreeLock {
+  public:
+    TreeLock(SharedTree *shared, bool write) : shared_(shared), write_(write) {
+      if (shared_ == NULL) return;
+      if (write_) {
+        uv_rwlock_wrlock(&shared_->lock);
+      } else {
+        uv_rwlock_rdlock(&shared_->lock);
+      }
+    }
+
+    ~TreeLock(){
+      if (shared_ == NULL) return;
+      if (write_) {
+        uv_rwlock_wrunlock(&shared_->lock);
+      } else {
+        uv_rwlock_rdunlock(&shared_->lock);
+      }
+    }
+
+  private:
+    SharedTree *shared_;
+    bool write_;
+};
+
+/**
+ * The current time in milliseconds since the epoch, like Date.now(). This
+ * is the clock of the ttl option, see InsertWith().
+ */
+static double NowMs(){
+  return (double)std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Storage for the coordinates of a point, on the stack for points with up
+ * to POINT_STACK_DIM dimensions, so that calls don't allocate.
+ */
+#define POINT_STACK_DIM 16
+
+class PointBuffer {
+  public:
+    explicit PointBuffer(int len){
+      pos_ = len <= POINT_STACK_DIM ? stack_ : new double[len];
+    }
+
+    ~PointBuffer(){
+      if (pos_ != stack_) {
+        delete[] pos_;
+      }
+    }
+
+    double *get(){ return pos_; }
+
+  private:
+    double stack_[POINT_STACK_DIM];
+    double *pos_;
+};
+
+/**
+ * The arguments of a query method: the query point, either as separate
+ * numbers or as one Float64Array, then "extra" arguments such as the range,
+ * then optionally a Float64Array to write the results to, and optionally an
+ * object with the options of the query.
+ *
+ * For example: (x, y, range), (point, range, out) or (point, { mask: 2 }).
+ */
+class QueryArgs {
+  public:
+    QueryArgs(Nan::NAN_METHOD_ARGS_TYPE info, int extra) : info_(info), buffer_(info.Length()){
+      int last = info.Length();
+
+      memset(&query, 0, sizeof query);
+      out = NULL;
+      outLength = 0;
+
+      // Options object, which is neither a point nor an output array
+      if (last > 0 && info[last - 1]->IsObject() && !info[last - 1]->IsArrayBufferView()) {
+        ReadOptions(info[last - 1].As<Object>());
+        last--;
+      }
+      // Output array, if it isn't the query point itself
+      if (last > 1 && info[last - 1]->IsFloat64Array()) {
+        Nan::TypedArrayContents<double> contents(info[last - 1]);
+        out = *contents;
+        outLength = contents.length();
+        last--;
+      }
+
+      if (last > 0 && info[0]->IsFloat64Array()) {
+        Nan::TypedArrayContents<double> contents(info[0]);
+        pos = *contents;
+        length = contents.length();
+        first_ = 1;
+      } else {
+        length = last - extra;
+        if (length < 0) {
+          length = 0;
+        }
+        for (int i = 0; i < length; i++) {
+          buffer_.get()[i] = info[i]->NumberValue();
+        }
+        pos = buffer_.get();
+        first_ = length;
+      }
+      extra_ = last - first_;
+    }
+
+    /**
+     * Returns the i-th extra argument, or undefined if it is missing
+     */
+    Local<Value> Extra(int i){
+      if (i >= extra_) {
+        return Nan::Undefined();
+      }
+      return info_[first_ + i];
+    }
+
+    const double *pos;      // Coordinates of the query point
+    int length;             // Number of coordinates
+    double *out;            // Array for the results, or NULL
+    size_t outLength;       // Length of "out"
+    kdquery query;          // Options of the query
+
+  private:
+    /**
+     * Read the options of a query. Supported options are:
+     *
+     *   mask         only find points whose tag shares a bit with the mask
+     *   now          skip points which expired at or before this time
+     *   maxDistance  only find points within this distance
+     */
+    void ReadOptions(Local<Object> options){
+      Local<Value> mask = Nan::Get(options, Nan::New("mask").ToLocalChecked()).ToLocalChecked();
+      if (!mask->IsUndefined()) {
+        query.mask = mask->Uint32Value();
+      }
+      Local<Value> now = Nan::Get(options, Nan::New("now").ToLocalChecked()).ToLocalChecked();
+      if (!now->IsUndefined()) {
+        query.now = now->NumberValue();
+      }
+      Local<Value> maxDistance = Nan::Get(options, Nan::New("maxDistance").ToLocalChecked()).ToLocalChecked();
+      if (!maxDistance->IsUndefined()) {
+        query.max_dist = maxDistance->NumberValue();
+      }
+    }
+
+    Nan::NAN_METHOD_ARGS_TYPE info_;
+    PointBuffer buffer_;
+    int first_, extra_;
+};
+
+/**
+ * A search whose results are read a page at a time, see KDTree.rangeCursor()
+ * and KDTree.nearestCursor(). The cursor keeps the tree object alive until
+ * all points were found or it is closed.
+ */
+class Cursor : public ObjectWrap {
+  public:
+    static void
+    Initialize (){
+        Nan::HandleScope scope;
+
+        Local<FunctionTemplate> t = Nan::New<FunctionTemplate>(New);
+
+        t->InstanceTemplate()->SetInternalFieldCount(1);
+        t->SetClassName(Nan::New("Cursor").ToLocalChecked());
+
+        Nan::SetPrototypeMethod(t, "next", Next);
+        Nan::SetPrototypeMethod(t, "close", Close);
+        Nan::SetPrototypeMethod(t, "return", Close);
+        t->PrototypeTemplate()->Set(Symbol::GetIterator(Isolate::GetCurrent()),
+                                    Nan::New<FunctionTemplate>(Iterator));
+
+        constructor.Reset(t);
+    }
+
+    /**
+     * Create a cursor object for a search of the given tree object.
+     *
+     * @param cursor  The search, which the cursor object frees
+     * @param tree    The KDTree object searched
+     * @param dim     Dimension of the tree
+     * @param shared  The shared tree, or NULL, see TreeLock
+     * @param values  True if the data values of the tree belong to this thread
+     * @param query   For geodesic trees the query point, and NULL otherwise
+     */
+    static Local<Value> Create(kdcursor *cursor, Local<Object> tree, int dim,
+                               SharedTree *shared, bool values, const double *query){
+      Nan::EscapableHandleScope scope;
+      Nan::MaybeLocal<Object> obj = Nan::NewInstance(
+          Nan::New(constructor)->GetFunction(), 0, NULL);
+      if (obj.IsEmpty()) {
+        kd_cursor_free(cursor);
+        return scope.Escape(Nan::Undefined());
+      }
+
+      Cursor *rc = ObjectWrap::Unwrap<Cursor>(obj.ToLocalChecked());
+      rc->cursor_ = cursor;
+      rc->tree_.Reset(tree);
+      rc->dim_ = dim;
+      rc->shared_ = shared;
+      rc->values_ = values;
+      rc->geo_ = (query != NULL);
+      if (rc->geo_) {
+        rc->query_[0] = query[0];
+        rc->query_[1] = query[1];
+      }
+      return scope.Escape(obj.ToLocalChecked());
+    }
+
+  protected:
+    /**
+     * Find up to "num" more points, appending them to "rv" from index
+     * "count" on, in the form of KDTree.nearestRange().
+     *
+     * @return The number of arrays appended, or -1 if an error was thrown
+     */
+    int Fetch(int num, Local<Array> rv, int count){
+      if (cursor_ == NULL) {
+        return 0;
+      }
+
+      kdres *results;
+      {
+        TreeLock lock(shared_, false);
+        results = kd_cursor_next(cursor_, num);
+        if (results == NULL) {
+          Nan::ThrowError("Next(): Points were moved or removed since the cursor was created, or out of memory.");
+          return -1;
+        }
+
+        PointBuffer respos(dim_);
+        int first = count;
+        while (!kd_res_end(results)) {
+          resultItem(results, respos.get(), geo_);
+          int values = kd_res_item_count(results);
+          for (int j = 0; j < values; j++) {
+            void *pdata = kd_res_item_value(results, j, NULL);
+            rv->Set(count++, foundToArray(respos.get(), dim_, values_ ? pdata : NULL,
+                                          geo_ ? query_ : NULL));
+          }
+          kd_res_next(results);
+        }
+        kd_res_free(results);
+        count -= first;
+      }
+
+      if (kd_cursor_done(cursor_)) {
+        Release();
+      }
+      return count;
+    }
+
+    /**
+     * Free the search and let go of the tree
+     */
+    void Release(){
+      if (cursor_ != NULL) {
+        kd_cursor_free(cursor_);
+        cursor_ = NULL;
+      }
+      tree_.Reset();
+      page_.Reset();
+    }
+
+    /**
+     * Without an argument, return the next point in the form of the
+     * iterator protocol, { value: point, done: false }, or { done: true }
+     * after the last one; the points are fetched a page of PAGE_SIZE at a
+     * time. With a number n, return an array of up to n more points, which
+     * is empty after the last one.
+     *
+     * For example:
+     *
+     *  > var cursor = tree.rangeCursor(1, 1, 10);
+     *  > cursor.next(2);
+     *  [ [ 1, 1 ], [ 2, 3 ] ]
+     *  > cursor.next();
+     *  { value: [ 0, 4 ], done: false }
+     */
+    static NAN_METHOD(Next){
+      Cursor *rc = ObjectWrap::Unwrap<Cursor>(info.This());
+      Nan::HandleScope scope;
+
+      if (info.Length() > 0 && !info[0]->IsUndefined()) {
+        int num = info[0]->Int32Value();
+        if (num < 1) {
+          Nan::ThrowError("Next(): The number of points must be at least 1.");
+          return;
+        }
+
+        // Points taken from the page of the iterator come first
+        Local<Array> rv = Nan::New<Array>();
+        int count = 0;
+        if (!rc->page_.IsEmpty()) {
+          Local<Array> page = Nan::New(rc->page_);
+          for (; count < num && rc->pagePos_ < (int)page->Length(); count++) {
+            rv->Set(count, page->Get(rc->pagePos_++));
+          }
+        }
+        if (count < num && rc->Fetch(num - count, rv, count) == -1) {
+          return;
+        }
+        info.GetReturnValue().Set(rv);
+        return;
+      }
+
+      if (rc->page_.IsEmpty() || rc->pagePos_ == (int)Nan::New(rc->page_)->Length()) {
+        Local<Array> page = Nan::New<Array>();
+        int count = rc->Fetch(PAGE_SIZE, page, 0);
+        if (count == -1) {
+          return;
+        }
+        rc->page_.Reset(page);
+        rc->pagePos_ = 0;
+      }
+
+      Local<Array> page = Nan::New(rc->page_);
+      Local<Object> rv = Nan::New<Object>();
+      bool done = rc->pagePos_ == (int)page->Length();
+      if (!done) {
+        Nan::Set(rv, Nan::New("value").ToLocalChecked(), page->Get(rc->pagePos_++));
+      }
+      Nan::Set(rv, Nan::New("done").ToLocalChecked(), Nan::New<Boolean>(done));
+      info.GetReturnValue().Set(rv);
+    }
+
+    /**
+     * Stop the search, so that the tree may be freed. This is also the
+     * return() method of the iterator protocol, which for...of calls when
+     * the loop is left early.
+     */
+    static NAN_METHOD(Close){
+      Cursor *rc = ObjectWrap::Unwrap<Cursor>(info.This());
+      Nan::HandleScope scope;
+      Local<Object> rv = Nan::New<Object>();
+
+      rc->Release();
+      Nan::Set(rv, Nan::New("done").ToLocalChecked(), Nan::True());
+      info.GetReturnValue().Set(rv);
+    }
+
+    /**
+     * The cursor is its own iterator, so that it can be used in for...of
+     */
+    static NAN_METHOD(Iterator){
+      info.GetReturnValue().Set(info.This());
+    }
+
+    /**
+     * Constructor of empty cursors, see Create()
+     */
+    static NAN_METHOD(New){
+        Cursor *rc = new Cursor();
+        rc->Wrap(info.This());
+        info.GetReturnValue().Set(info.This());
+    }
+
+    Cursor() : cursor_(NULL), dim_(0), shared_(NULL), values_(false), geo_(false), pagePos_(0) {
+    }
+
+    ~Cursor(){
+        Release();
+    }
+
+  private:
+    /**
+     * Number of points fetched at a time by the iterator protocol
+     */
+    static const int PAGE_SIZE = 256;
+
+    /**
+     * Template used to create Cursor objects, see KDTree::constructor
+     */
+    static thread_local Nan::Persistent<FunctionTemplate> constructor;
+
+    /**
+     * The search, or NULL once all points were found or it was closed
+     */
+    kdcursor* cursor_;
+
+    /**
+     * The KDTree object searched, which must outlive the search
+     */
+    Nan::Persistent<Object> tree_;
+
+    /**
+     * Dimension, shared tree and ownership of values of the tree, see KDTree
+     */
+    int dim_;
+    SharedTree* shared_;
+    bool values_;
+
+    /**
+     * True for searches of a geodesic tree, with the latitude and longitude
+     * of the query point, which the distances of the points are measured from
+     */
+    bool geo_;
+    double query_[2];
+
+    /**
+     * Points fetched for the iterator protocol, and the next one to return
+     */
+    Nan::Persistent<Array> page_;
+    int pagePos_;
+};
+
+thread_local Nan::Persistent<FunctionTemplate> Cursor::constructor;
+
 /**
  * The KDTree add-on
  */
@@ -46,251 +608,1441 @@ class KDTree : public ObjectWrap {
 
         Nan::SetPrototypeMethod(t, "dimensions", Dimensions);
         Nan::SetPrototypeMethod(t, "insert", Insert);
+        Nan::SetPrototypeMethod(t, "insertWith", InsertWith);
+        Nan::SetPrototypeMethod(t, "update", Update);
         Nan::SetPrototypeMethod(t, "nearest", Nearest);
         Nan::SetPrototypeMethod(t, "nearestPoint", NearestPoint);
         Nan::SetPrototypeMethod(t, "nearestValue", NearestValue);
+        Nan::SetPrototypeMethod(t, "nearestValues", NearestValues);
         Nan::SetPrototypeMethod(t, "nearestRange", NearestRange);
+        Nan::SetPrototypeMethod(t, "rangeCursor", RangeCursor);
+        Nan::SetPrototypeMethod(t, "nearestCursor", NearestCursor);
+        Nan::SetPrototypeMethod(t, "nearestN", NearestN);
+        Nan::SetPrototypeMethod(t, "nearestBatch", NearestBatch);
+        Nan::SetPrototypeMethod(t, "densityBatch", DensityBatch);
+        Nan::SetPrototypeMethod(t, "weightedSum", WeightedSum);
+        Nan::SetPrototypeMethod(t, "queryStats", QueryStatistics);
+        Nan::SetPrototypeMethod(t, "cacheStats", CacheStatistics);
+        Nan::SetPrototypeMethod(t, "stats", Stats);
+        Nan::SetPrototypeMethod(t, "snapshot", Snapshot);
+        Nan::SetPrototypeMethod(t, "share", Share);
+        Nan::SetPrototypeMethod(t, "optimize", Optimize);
+        Nan::SetPrototypeMethod(t, "rebuild", Rebuild);
+        Nan::SetPrototypeMethod(t, "save", Save);
+        Nan::SetPrototypeMethod(t, "expire", Expire);
+        Nan::SetMethod(t, "radiusJoin", RadiusJoin);
+        Nan::SetMethod(t, "attach", Attach);
+        Nan::SetMethod(t, "load", Load);
 
+        constructor.Reset(t);
         exports->Set(Nan::New("KDTree").ToLocalChecked(), t->GetFunction());
     }
 
     /**
-     * Insert a set of points into the tree.
+     * Insert a set of points into the tree.
+     *
+     * An optional data argument is present as well; 
+     * if hasValue is false, then the data param will be ignored.
+     *
+     * @param pos   An array of points
+     * @param len   Number of coordinates in the array
+     * @param hasValue  True if a value was passed for the point
+     * @param data  Optional data argument
+     * @param tag   Tag of the point, which queries can filter on
+     * @param expires Time at which the point expires, see Expire()
+     *
+     * @return The id of the point, see Update(), or -1 if it was not inserted
+     */ 
+    int Insert(const double *pos, int len, bool hasValue, Nan::Persistent<Value>* data,
+               unsigned int tag = 0, double expires = HUGE_VAL){
+      if (len != dim_){
+        Nan::ThrowError("Insert(): Wrong number of parameters.");
+        // FUTURE: Passed: " + len + " Expected: " + dim_)));
+        return -1;
+      }
+      if (kd_is_snapshot(kd_)){
+        Nan::ThrowError("Insert(): Cannot insert into a snapshot.");
+        return -1;
+      }
+      if (!values_ && hasValue){
+        Nan::ThrowError("Insert(): Values can only be stored by the thread which shared the tree.");
+        return -1;
+      }
+
+      double xyz[3];
+      TreeLock lock(shared_, true);
+      int id = kd_next_id(kd_);
+      if (kd_insert_expiring(kd_, TreePoint(pos, xyz), hasValue ? data : NULL, tag, expires) == -1) {
+        id = -1;
+      }
+      SyncExternalMemory();
+      return id;
+    }
+
+    /**
+     * Move a point to a new position.
+     *
+     * @param id    Id of the point, as returned by Insert()
+     * @param pos   New coordinates of the point
+     * @param len   Number of coordinates
+     *
+     * @return true if the point was moved, false if there is no point with this id
+     */
+    bool Update(int id, const double *pos, int len){
+      if (len != dim_){
+        Nan::ThrowError("Update(): Wrong number of parameters.");
+        return false;
+      }
+      if (kd_is_snapshot(kd_)){
+        Nan::ThrowError("Update(): Snapshots are read-only.");
+        return false;
+      }
+      if (kd_snapshot_count(kd_) > 0){
+        Nan::ThrowError("Update(): Points can not move while the tree has snapshots.");
+        return false;
+      }
+
+      double xyz[3];
+      TreeLock lock(shared_, true);
+      bool updated = (kd_update(kd_, id, TreePoint(pos, xyz)) == 0);
+      SyncExternalMemory();
+      return updated;
+    }
+
+    /**
+     * Find the point nearest to the given point.
+     *
+     * @param pos     An array of points
+     * @param len     Number of points in the array
+     * @param query   Options of the query, see QueryArgs
+     * @param respos  Receives the coordinates of the nearest point
+     * @param pdata   Receives the data of the nearest point
+     *
+     * @return true if a point was found
+     */
+    bool FindNearest(const double *pos, int len, const kdquery *query, double *respos, void **pdata){
+      if (len != dim_){
+        Nan::ThrowError("Nearest(): Wrong number of parameters.");
+        // FUTURE: Passed: " + len + " Expected: " + dim_)));
+        return false;
+      }
+
+      double xyz[3];
+      kdquery treeQuery;
+      TreeLock lock(shared_, false);
+      QUERY_PROBE(probe);
+      kdres *results = kd_nearest_q(kd_, TreePoint(pos, xyz), TreeQuery(query, &treeQuery));
+      bool found = (results != NULL && kd_res_size(results) > 0);
+
+      if (found) {
+        QUERY_RESULTS(probe, 1);
+        *pdata = resultItem(results, respos, geo_);
+        if (!values_) {
+          *pdata = NULL;
+        }
+      }
+      if (results != NULL) {
+        kd_res_free(results);
+      }
+      return found;
+    }
+
+    /**
+     * Find the point nearest to the given point.
+     *
+     * @param pos   An array of points
+     * @param len   Number of points in the array
+     * @param query Options of the query, see QueryArgs
+     *
+     * @return An array containing the nearest point, or an empty array if no point is found.
+     *         If a data element was provided for the nearest point, it will be the last
+     *         member of the returned array.
+     */ 
+    Local<Value> Nearest(const double *pos, int len, const kdquery *query = NULL){
+      Nan::EscapableHandleScope scope;
+      PointBuffer respos(dim_);
+      void *pdata;
+
+      if (!FindNearest(pos, len, query, respos.get(), &pdata)) {
+        return scope.Escape(Nan::New<Array>(dim_ + 1));
+      }
+      return scope.Escape(foundToArray(respos.get(), dim_, pdata, geo_ ? pos : NULL));
+    }
+
+    /**
+     * Find the points nearest to the given point, within a given range.
+     *
+     * @param pos   An array of points
+     * @param len   Number of points in the array
+     * @param range Range in which to search for points
+     * @param query Options of the query, see QueryArgs
+     * @param out   If not NULL, the coordinates of the points are written
+     *              here instead, and their number is returned
+     *
+     * @return An array containing the nearest points, or an empty array if no point is found.
+     *         If a data element was provided for any point, it will be the last
+     *         member of that point's returned array.
+     */ 
+    Local<Value> NearestRange(const double *pos, int len, double range, const kdquery *query = NULL,
+                              double *out = NULL, size_t outLength = 0){
+      Nan::EscapableHandleScope scope;
+      kdres *results = NULL; 
+      Local<Value> rv;
+
+      if (len != dim_){
+        std::stringstream ss;
+        ss << "Nearest(): Wrong number of parameters. Passed: "
+           << len << " Expected: " << dim_;
+        Nan::ThrowError(Nan::New(ss.str()).ToLocalChecked());
+        return scope.Escape(Nan::Undefined());
+      }
+
+      double xyz[3];
+      kdquery treeQuery;
+      TreeLock lock(shared_, false);
+      QUERY_PROBE(probe);
+      results = kd_nearest_range_q(kd_, TreePoint(pos, xyz), TreeDistance(range),
+                                   TreeQuery(query, &treeQuery));
+      if (results == NULL) {
+        Nan::ThrowError("NearestRange(): Out of memory.");
+        return scope.Escape(Nan::Undefined());
+      }
+      QUERY_RESULTS(probe, kd_res_size(results));
+      if (out != NULL) {
+        rv = Nan::New<Number>(ResultsToBuffer(results, -1, out, outLength));
+      } else {
+        rv = ResultsToArray(results, -1, pos);
+      }
+      kd_res_free(results);
+      return scope.Escape(rv);
+    }
+
+    /**
+     * Find the N points nearest to the given point.
+     *
+     * @param pos   An array of points
+     * @param len   Number of points in the array
+     * @param num   Maximum number of points to find
+     * @param query Options of the query, see QueryArgs
+     * @param out   If not NULL, the coordinates of the points are written
+     *              here instead, and their number is returned
+     *
+     * @return An array containing the nearest points ordered by increasing
+     *         distance, in the same form as the result of NearestRange().
+     */
+    Local<Value> NearestN(const double *pos, int len, int num, const kdquery *query = NULL,
+                          double *out = NULL, size_t outLength = 0){
+      Nan::EscapableHandleScope scope;
+
+      if (len != dim_){
+        std::stringstream ss;
+        ss << "NearestN(): Wrong number of parameters. Passed: "
+           << len << " Expected: " << dim_;
+        Nan::ThrowError(Nan::New(ss.str()).ToLocalChecked());
+        return scope.Escape(Nan::Undefined());
+      }
+
+      double xyz[3];
+      kdquery treeQuery;
+      TreeLock lock(shared_, false);
+      QUERY_PROBE(probe);
+      kdres *results = kd_nearest_n_q(kd_, TreePoint(pos, xyz), num, TreeQuery(query, &treeQuery));
+      if (results == NULL) {
+        Nan::ThrowError("NearestN(): Out of memory.");
+        return scope.Escape(Nan::Undefined());
+      }
+      QUERY_RESULTS(probe, kd_res_size(results));
+
+      Local<Value> rv;
+      if (out != NULL) {
+        rv = Nan::New<Number>(ResultsToBuffer(results, num, out, outLength));
+      } else {
+        rv = ResultsToArray(results, num, pos);
+      }
+      kd_res_free(results);
+      return scope.Escape(rv);
+    }
+
+    /**
+     * Find all values at the position nearest to the given point; there
+     * may be several if duplicates are merged.
+     *
+     * @param pos   An array of points
+     * @param len   Number of points in the array
+     * @param query Options of the query, see QueryArgs
+     *
+     * @return An array of the values, or an empty array if no point is found.
+     *         Points without a value are returned as undefined.
+     */
+    Local<Value> NearestValues(const double *pos, int len, const kdquery *query = NULL){
+      Nan::EscapableHandleScope scope;
+
+      if (len != dim_){
+        Nan::ThrowError("NearestValues(): Wrong number of parameters.");
+        return scope.Escape(Nan::Undefined());
+      }
+
+      double xyz[3];
+      kdquery treeQuery;
+      TreeLock lock(shared_, false);
+      QUERY_PROBE(probe);
+      kdres *results = kd_nearest_q(kd_, TreePoint(pos, xyz), TreeQuery(query, &treeQuery));
+      Local<Array> rv = Nan::New<Array>();
+
+      if (results != NULL) {
+        int count = kd_res_item_count(results);
+        QUERY_RESULTS(probe, count);
+        for (int i = 0; i < count; i++) {
+          void *pdata = kd_res_item_value(results, i, NULL);
+          if (pdata != NULL && values_) {
+            rv->Set(i, Nan::New(*(Nan::Persistent<Value>*)pdata));
+          } else {
+            rv->Set(i, Nan::Undefined());
+          }
+        }
+        kd_res_free(results);
+      }
+      return scope.Escape(rv);
+    }
+
+  protected:
+
+    /**
+     * Convert each point of a result set to an array, see pointToArray().
+     * Merged duplicates become one array per value.
+     *
+     * @param max   Maximum number of arrays to return, or -1 for all
+     * @param query The query point, which geodesic trees measure the
+     *              distances of the points from
+     */
+    Local<Array> ResultsToArray(kdres *results, int max = -1, const double *query = NULL){
+      Nan::EscapableHandleScope scope;
+      Local<Array> rv = Nan::New<Array>();
+      PointBuffer respos(dim_);
+      int i = 0;
+
+      while (!kd_res_end( results ) && i != max){
+        resultItem(results, respos.get(), geo_);
+        int count = kd_res_item_count(results);
+        for (int j = 0; j < count && i != max; j++) {
+          void *pdata = kd_res_item_value(results, j, NULL);
+          rv->Set(i++, foundToArray(respos.get(), dim_, values_ ? pdata : NULL,
+                                    geo_ ? query : NULL));
+        }
+
+        // Move to next result entry
+        kd_res_next( results );
+      }
+
+      return scope.Escape(rv);
+    }
+
+    /**
+     * Write the coordinates of each point of a result set to "out", one
+     * point after the other, for as many points as fit.
+     *
+     * @param max   Maximum number of points to count, or -1 for all
+     * @return The number of points in the result set, which may be more
+     *         than were written
+     */
+    int ResultsToBuffer(kdres *results, int max, double *out, size_t outLength){
+      size_t room = outLength / dim_;
+      int i = 0;
+
+      while (!kd_res_end( results ) && i != max){
+        int count = kd_res_item_count(results);
+        for (int j = 0; j < count && i != max; j++, i++) {
+          if ((size_t)i < room) {
+            resultItem(results, out + (size_t)i * dim_, geo_);
+          }
+        }
+        kd_res_next( results );
+      }
+      return i;
+    }
+
+    /**
+     * The coordinates of a point as stored in the tree. Geodesic trees take
+     * the latitude and longitude of points in degrees, and store them as
+     * points on the unit sphere, see kd_geo_point(); "xyz" holds 3 numbers
+     * to convert them into.
+     */
+    const double *TreePoint(const double *pos, double *xyz){
+      if (!geo_) {
+        return pos;
+      }
+      kd_geo_point(pos, xyz);
+      return xyz;
+    }
+
+    /**
+     * The coordinates of "count" points given one after the other, as
+     * stored in the tree, see TreePoint(). "xyz" receives converted points.
+     */
+    const double *TreePoints(const double *pos, int count, std::vector<double> &xyz){
+      if (!geo_) {
+        return pos;
+      }
+      xyz.resize(3 * (size_t)count);
+      for (int i = 0; i < count; i++) {
+        kd_geo_point(pos + 2 * (size_t)i, xyz.data() + 3 * (size_t)i);
+      }
+      return xyz.data();
+    }
+
+    /**
+     * A distance in the units of the tree: for geodesic trees, a distance
+     * in metres becomes the chord of the unit sphere, see kd_geo_chord()
+     */
+    double TreeDistance(double dist){
+      return geo_ ? kd_geo_chord(dist) : dist;
+    }
+
+    /**
+     * The options of a query, with maxDistance in the units of the tree,
+     * see TreeDistance(). "buf" holds converted options.
+     */
+    const kdquery *TreeQuery(const kdquery *query, kdquery *buf){
+      if (!geo_ || query == NULL || !(query->max_dist > 0)) {
+        return query;
+      }
+      *buf = *query;
+      buf->max_dist = kd_geo_chord(query->max_dist);
+      return buf;
+    }
+
+    /**
+     * Returns the tree wrapped by the given object, or NULL if the object
+     * is not a KDTree.
+     */
+    static KDTree* _Unwrap(Local<Value> obj){
+      if (!Nan::New(constructor)->HasInstance(obj)) {
+        return NULL;
+      }
+      return ObjectWrap::Unwrap<KDTree>(obj.As<Object>());
+    }
+
+    static int _JoinCollect(int ia, int ib, void *arg){
+      std::vector<uint32_t> *pairs = (std::vector<uint32_t> *)arg;
+      pairs->push_back(ia);
+      pairs->push_back(ib);
+      return 0;
+    }
+
+    static Local<Value> _Dimensions(Nan::NAN_METHOD_ARGS_TYPE info){
+        Nan::EscapableHandleScope scope;
+        KDTree *kd = ObjectWrap::Unwrap<KDTree>(info.This());
+        return scope.Escape(Nan::New<Number>(kd->dim_));
+    }
+
+    static NAN_METHOD(Dimensions){
+        info.GetReturnValue().Set(KDTree::_Dimensions(info));
+    }
+
+    /**
+     * Insert the point given by the arguments from "first" on: either its
+     * coordinates, or a Float64Array holding them, optionally followed by
+     * the value of the point.
+     */
+    static int _Insert(Nan::NAN_METHOD_ARGS_TYPE info, int first, unsigned int tag, double expires){
+      KDTree *kd = ObjectWrap::Unwrap<KDTree>(info.This());
+      int len = info.Length() - first;
+      PointBuffer buffer(len);
+      const double *pos = buffer.get();
+      bool hasValue;
+
+      if (len > 0 && info[first]->IsFloat64Array()) {
+        Nan::TypedArrayContents<double> contents(info[first]);
+        pos = *contents;
+        // The value, if any, follows the coordinates
+        hasValue = (len == 2);
+        return _InsertPoint(kd, pos, contents.length(), hasValue ? info[first + 1] : Local<Value>(),
+                            tag, expires);
+      }
+
+      for (int i = 0; i < len; i++){
+        buffer.get()[i] = info[first + i]->NumberValue();
+      }
+      hasValue = (len == kd->dim_ + 1);
+      return _InsertPoint(kd, pos, hasValue ? len - 1 : len,
+                          hasValue ? info[info.Length() - 1] : Local<Value>(), tag, expires);
+    }
+
+    /**
+     * Insert a point with "len" coordinates, and the value if it is not empty
+     */
+    static int _InsertPoint(KDTree *kd, const double *pos, int len, Local<Value> value,
+                            unsigned int tag, double expires){
+      // Only keep a handle if a data value was actually passed
+      Nan::Persistent<Value>* per = NULL;
+      if (!value.IsEmpty()) {
+        per = new Nan::Persistent<Value>(value);
+      }
+
+      int id = kd->Insert(pos, len, !value.IsEmpty(), per, tag, expires);
+      if (id == -1) {
+        freeNodeData(per);
+      }
+      return id;
+    }
+
+    /**
+     * The result of an insert: the id of the point, or false
+     */
+    static Local<Value> _InsertResult(int id){
+      Nan::EscapableHandleScope scope;
+      if (id == -1) {
+        return scope.Escape(Nan::False());
+      }
+      return scope.Escape(Nan::New<Number>(id));
+    }
+
+    /**
+     * Wrapper for Insert()
+     */
+    static NAN_METHOD(Insert){
+      info.GetReturnValue().Set(KDTree::_InsertResult(KDTree::_Insert(info, 0, 0, HUGE_VAL)));
+    }
+
+    /**
+     * Move the point with the given id, as returned by insert(), to a new
+     * position, given by its coordinates or a Float64Array. Its value stays.
+     *
+     * For example:
+     *
+     *  > var id = tree.insert(1, 1, 1, "My Value");
+     *  > tree.update(id, 1, 2, 1);
+     *  true
+     */
+    static NAN_METHOD(Update){
+      KDTree *kd = ObjectWrap::Unwrap<KDTree>(info.This());
+      int len = info.Length() - 1;
+
+      if (len < 1) {
+        Nan::ThrowError("Update(): Wrong number of parameters.");
+        return;
+      }
+      if (info[1]->IsFloat64Array()) {
+        Nan::TypedArrayContents<double> contents(info[1]);
+        info.GetReturnValue().Set(Nan::New<Boolean>(kd->Update(info[0]->Int32Value(), *contents, contents.length())));
+        return;
+      }
+
+      PointBuffer pos(len);
+      for (int i = 0; i < len; i++) {
+        pos.get()[i] = info[i + 1]->NumberValue();
+      }
+      info.GetReturnValue().Set(Nan::New<Boolean>(kd->Update(info[0]->Int32Value(), pos.get(), len)));
+    }
+
+    /**
+     * Insert a point with options, given as first argument before the
+     * coordinates and value of the point:
+     *
+     *   tag       tag of the point, an unsigned 32 bit integer which queries
+     *             can filter on with their mask option
+     *   expires   time at which the point expires, see Expire()
+     *   ttl       milliseconds from now, by Date.now(), until the point expires
+     *
+     * For example:
+     *
+     *  > tree.insertWith({ tag: 4 }, 1, 1, 1, "My Value");
+     *  > tree.nearest(0, 0, 0, { mask: 4 | 8 });
+     */
+    static NAN_METHOD(InsertWith){
+      unsigned int tag = 0;
+      double expires = HUGE_VAL;
+
+      if (info.Length() == 0 || !info[0]->IsObject() || info[0]->IsArrayBufferView()) {
+        Nan::ThrowError("InsertWith(): The first parameter must be an options object.");
+        return;
+      }
+      Local<Value> vtag = Nan::Get(info[0].As<Object>(), Nan::New("tag").ToLocalChecked()).ToLocalChecked();
+      if (!vtag->IsUndefined()) {
+        tag = vtag->Uint32Value();
+      }
+      Local<Value> vexpires = Nan::Get(info[0].As<Object>(), Nan::New("expires").ToLocalChecked()).ToLocalChecked();
+      Local<Value> vttl = Nan::Get(info[0].As<Object>(), Nan::New("ttl").ToLocalChecked()).ToLocalChecked();
+      if (!vexpires->IsUndefined()) {
+        expires = vexpires->NumberValue();
+      } else if (!vttl->IsUndefined()) {
+        expires = NowMs() + vttl->NumberValue();
+      }
+
+      info.GetReturnValue().Set(KDTree::_InsertResult(KDTree::_Insert(info, 1, tag, expires)));
+    }
+
+    /**
+     * Wrapper for Nearest()
+     */ 
+    static NAN_METHOD(Nearest){
+      KDTree *kd = ObjectWrap::Unwrap<KDTree>(info.This());
+      Nan::HandleScope scope;
+      QueryArgs args(info, 0);
+
+      info.GetReturnValue().Set(kd->Nearest(args.pos, args.length, &args.query));
+    }
+
+    /**
+     * A shortcut method for Nearest, that returns an array containing only point data.
+     * If a value is present, it will NOT be returned in the result array.
+     *
+     * If a Float64Array is passed after the query point, the coordinates are
+     * written to it instead, and the number of points found (0 or 1) is
+     * returned:
+     *
+     *  > var out = new Float64Array(3);
+     *  > tree.nearestPoint(new Float64Array([1, 1, 1]), out);
+     *  1
+     */
+    static NAN_METHOD(NearestPoint){
+      KDTree *kd = ObjectWrap::Unwrap<KDTree>(info.This());
+      Nan::HandleScope scope;
+      QueryArgs args(info, 0);
+      PointBuffer respos(kd->dim_);
+      void *pdata;
+
+      if (args.out != NULL && args.outLength < (size_t)kd->dim_) {
+        Nan::ThrowRangeError("NearestPoint(): The output array is too short.");
+        return;
+      }
+
+      double *dest = args.out != NULL ? args.out : respos.get();
+      bool found = kd->FindNearest(args.pos, args.length, &args.query, dest, &pdata);
+      if (args.out != NULL) {
+        info.GetReturnValue().Set(Nan::New<Number>(found ? 1 : 0));
+      } else {
+        // Only the coordinates, without room for a value
+        Local<Array> result = Nan::New<Array>(kd->dim_);
+        for (int i = 0; found && i < kd->dim_; i++) {
+          result->Set(i, Nan::New<Number>(dest[i]));
+        }
+        info.GetReturnValue().Set(result);
+      }
+    }
+
+    /**
+     * A shortcut method for Nearest, that returns the point's value as a scalar.
+     * If a value is not present or no point was found, this method returns null.
+     *
+     * For example:
+     *
+     *  > tree.insert(1, 1, 1, "My Value");
+     *  > tree.nearestValue(1, 1, 1);
+     *  "My Value"
+     *
+     */
+    static NAN_METHOD(NearestValue){
+      KDTree *kd = ObjectWrap::Unwrap<KDTree>(info.This());
+      Nan::HandleScope scope;
+      QueryArgs args(info, 0);
+      PointBuffer respos(kd->dim_);
+      void *pdata;
+
+      if (kd->FindNearest(args.pos, args.length, &args.query, respos.get(), &pdata) && pdata != NULL) {
+        info.GetReturnValue().Set(Nan::New(*(Nan::Persistent<Value>*)pdata));
+      } else {
+        info.GetReturnValue().SetNull();
+      }
+    }
+
+    static NAN_METHOD(NearestValues){
+      KDTree *kd = ObjectWrap::Unwrap<KDTree>(info.This());
+      Nan::HandleScope scope;
+      QueryArgs args(info, 0);
+
+      info.GetReturnValue().Set(kd->NearestValues(args.pos, args.length, &args.query));
+    }
+
+    static NAN_METHOD(NearestRange){
+      KDTree *kd = ObjectWrap::Unwrap<KDTree>(info.This());
+      Nan::HandleScope scope;
+      QueryArgs args(info, 1);
+
+      if (info.Length() == 0) {
+        Nan::ThrowError("NearestRange(): No parameters were provided.");
+        return;
+      }
+      info.GetReturnValue().Set(kd->NearestRange(args.pos, args.length, args.Extra(0)->NumberValue(),
+                                                 &args.query, args.out, args.outLength));
+    }
+
+    /**
+     * Start a range search whose results are read a page at a time, with
+     * the same arguments as nearestRange() but without an output array.
+     * Returns a Cursor, see Cursor::Next().
+     */
+    static NAN_METHOD(RangeCursor){
+      KDTree *kd = ObjectWrap::Unwrap<KDTree>(info.This());
+      Nan::HandleScope scope;
+      QueryArgs args(info, 1);
+
+      if (info.Length() == 0) {
+        Nan::ThrowError("RangeCursor(): No parameters were provided.");
+        return;
+      }
+      if (args.length != kd->dim_){
+        std::stringstream ss;
+        ss << "RangeCursor(): Wrong number of parameters. Passed: "
+           << args.length << " Expected: " << kd->dim_;
+        Nan::ThrowError(Nan::New(ss.str()).ToLocalChecked());
+        return;
+      }
+
+      kdcursor *cursor;
+      {
+        TreeLock lock(kd->shared_, false);
+        double xyz[3];
+        kdquery treeQuery;
+        cursor = kd_cursor_range(kd->kd_, kd->TreePoint(args.pos, xyz),
+                                 kd->TreeDistance(args.Extra(0)->NumberValue()),
+                                 kd->TreeQuery(&args.query, &treeQuery));
+      }
+      if (cursor == NULL) {
+        Nan::ThrowError("RangeCursor(): Out of memory.");
+        return;
+      }
+      info.GetReturnValue().Set(Cursor::Create(cursor, info.This(), kd->dim_,
+                                               kd->shared_, kd->values_,
+                                               kd->geo_ ? args.pos : NULL));
+    }
+
+    /**
+     * Start a search for the points nearest to the given point, whose
+     * results are read a page at a time by increasing distance, with the
+     * arguments of nearest(). Returns a Cursor, see Cursor::Next().
+     *
+     * For example:
+     *
+     *  > var cursor = tree.nearestCursor(1, 1);
+     *  > cursor.next(2);
+     *  [ [ 1, 1 ], [ 1, 2 ] ]
+     */
+    static NAN_METHOD(NearestCursor){
+      KDTree *kd = ObjectWrap::Unwrap<KDTree>(info.This());
+      Nan::HandleScope scope;
+      QueryArgs args(info, 0);
+
+      if (args.length != kd->dim_){
+        std::stringstream ss;
+        ss << "NearestCursor(): Wrong number of parameters. Passed: "
+           << args.length << " Expected: " << kd->dim_;
+        Nan::ThrowError(Nan::New(ss.str()).ToLocalChecked());
+        return;
+      }
+
+      kdcursor *cursor;
+      {
+        TreeLock lock(kd->shared_, false);
+        double xyz[3];
+        kdquery treeQuery;
+        cursor = kd_cursor_nearest(kd->kd_, kd->TreePoint(args.pos, xyz),
+                                   kd->TreeQuery(&args.query, &treeQuery));
+      }
+      if (cursor == NULL) {
+        Nan::ThrowError("NearestCursor(): Out of memory.");
+        return;
+      }
+      info.GetReturnValue().Set(Cursor::Create(cursor, info.This(), kd->dim_,
+                                               kd->shared_, kd->values_,
+                                               kd->geo_ ? args.pos : NULL));
+    }
+
+    static NAN_METHOD(NearestN){
+      KDTree *kd = ObjectWrap::Unwrap<KDTree>(info.This());
+      Nan::HandleScope scope;
+      QueryArgs args(info, 1);
+
+      if (info.Length() == 0) {
+        Nan::ThrowError("NearestN(): No parameters were provided.");
+        return;
+      }
+      info.GetReturnValue().Set(kd->NearestN(args.pos, args.length, args.Extra(0)->Int32Value(),
+                                             &args.query, args.out, args.outLength));
+    }
+
+    /**
+     * Find the nearest point for each of many query points, given one after
+     * the other in a Float64Array. The queries are run in an order in which
+     * consecutive ones visit the same nodes, see kd_nearest_batch().
+     * Returns an Int32Array with the id of the nearest point of each query,
+     * or -1 if none was found. The coordinates of the points are written to
+     * an optional output Float64Array.
+     *
+     * For example:
+     *
+     *  > tree.nearestBatch(new Float64Array([1, 1, 5, 5]));
+     *  Int32Array [ 0, 3 ]
+     */
+    static NAN_METHOD(NearestBatch){
+      KDTree *kd = ObjectWrap::Unwrap<KDTree>(info.This());
+      Nan::HandleScope scope;
+
+      if (info.Length() == 0 || !info[0]->IsFloat64Array()) {
+        Nan::ThrowTypeError("NearestBatch(): Expected a Float64Array of query points.");
+        return;
+      }
+      QueryArgs args(info, 0);
+      if (args.length % kd->dim_ != 0) {
+        Nan::ThrowError("NearestBatch(): Wrong number of coordinates.");
+        return;
+      }
+      if (args.out != NULL && args.outLength < (size_t)args.length) {
+        Nan::ThrowRangeError("NearestBatch(): The output array is too short.");
+        return;
+      }
+
+      int count = args.length / kd->dim_;
+      Local<ArrayBuffer> buf = ArrayBuffer::New(Isolate::GetCurrent(), count * sizeof(int32_t));
+      std::vector<double> xyz, nearest;
+      const double *pos = kd->TreePoints(args.pos, count, xyz);
+      double *out = args.out;
+      if (kd->geo_ && out != NULL) {
+        nearest.resize(3 * (size_t)count);
+        out = nearest.data();
+      }
+      kdquery treeQuery;
+      int found;
+      {
+        TreeLock lock(kd->shared_, false);
+        found = kd_nearest_batch(kd->kd_, pos, count, kd->TreeQuery(&args.query, &treeQuery),
+                                 (int *)buf->GetContents().Data(), out);
+      }
+      if (found == -1) {
+        Nan::ThrowError("NearestBatch(): Out of memory.");
+        return;
+      }
+      if (out != args.out) {
+        for (int i = 0; i < count; i++) {
+          kd_geo_latlon(nearest.data() + 3 * (size_t)i, args.out + 2 * (size_t)i);
+        }
+      }
+      info.GetReturnValue().Set(Int32Array::New(buf, 0, count));
+    }
+
+    /**
+     * The weight of a point for kd_density(): its value, if it is a number,
+     * and 0 otherwise.
+     */
+    static double _PayloadWeight(void *data){
+      if (data == NULL) {
+        return 0.0;
+      }
+      Nan::HandleScope scope;
+      Local<Value> value = Nan::New(*(Nan::Persistent<Value>*)data);
+      return value->IsNumber() ? value->NumberValue() : 0.0;
+    }
+
+    /**
+     * Sum up the kernel values of the points around each query point, see
+     * kd_density(). Writes the sums to "out", which holds "count" numbers.
+     *
+     * @return false, with an exception thrown, on error
+     */
+    bool Density(const char *method, const double *pos, int count, const kddensity *opt,
+                 const kdquery *query, double *out){
+      if (opt->weight != NULL && !values_) {
+        // Values are handles of the sharing thread's isolate
+        std::stringstream ss;
+        ss << method << "(): Values can only be summed in the thread which shared the tree.";
+        Nan::ThrowError(Nan::New(ss.str()).ToLocalChecked());
+        return false;
+      }
+      if (!(opt->bandwidth > 0)) {
+        std::stringstream ss;
+        ss << method << "(): Expected a positive bandwidth.";
+        Nan::ThrowRangeError(Nan::New(ss.str()).ToLocalChecked());
+        return false;
+      }
+
+      // The kernels of geodesic trees are of the chord, see TreeDistance()
+      std::vector<double> xyz;
+      kddensity treeOpt = *opt;
+      kdquery treeQuery;
+      treeOpt.bandwidth = TreeDistance(opt->bandwidth);
+
+      TreeLock lock(shared_, false);
+      QUERY_PROBE(probe);
+      if (kd_density(kd_, TreePoints(pos, count, xyz), count, &treeOpt,
+                     TreeQuery(query, &treeQuery), out) == -1) {
+        std::stringstream ss;
+        ss << method << "(): Out of memory.";
+        Nan::ThrowError(Nan::New(ss.str()).ToLocalChecked());
+        return false;
+      }
+      QUERY_RESULTS(probe, count);
+      return true;
+    }
+
+    /**
+     * Compute the kernel density at many query points, given one after the
+     * other in a Float64Array, with the given bandwidth. Returns a
+     * Float64Array with the density at each query point, or writes it to an
+     * optional output Float64Array. Besides the options of the query, see
+     * QueryArgs, the options object may hold:
+     *
+     *   kernel     "gaussian" (the default), "epanechnikov" or "uniform"
+     *   tolerance  largest error of the kernel value of a point, default 0;
+     *              a larger tolerance sums far away subtrees at once
+     *   weighted   weigh points by their numeric values instead of 1
+     *
+     * For example:
+     *
+     *  > tree.densityBatch(new Float64Array([1, 1, 5, 5]), 2, { kernel: 'uniform' });
+     *  Float64Array [ 3, 1 ]
+     */
+    static NAN_METHOD(DensityBatch){
+      KDTree *kd = ObjectWrap::Unwrap<KDTree>(info.This());
+      Nan::HandleScope scope;
+
+      if (info.Length() == 0 || !info[0]->IsFloat64Array()) {
+        Nan::ThrowTypeError("DensityBatch(): Expected a Float64Array of query points.");
+        return;
+      }
+      QueryArgs args(info, 1);
+      if (args.length % kd->dim_ != 0) {
+        Nan::ThrowError("DensityBatch(): Wrong number of coordinates.");
+        return;
+      }
+
+      kddensity opt;
+      opt.kernel = KD_KERNEL_GAUSSIAN;
+      opt.bandwidth = args.Extra(0)->NumberValue();
+      opt.tolerance = 0.0;
+      opt.weight = NULL;
+
+      Local<Value> last = info[info.Length() - 1];
+      if (last->IsObject() && !last->IsArrayBufferView()) {
+        Local<Object> options = last.As<Object>();
+        Local<Value> kernel = Nan::Get(options, Nan::New("kernel").ToLocalChecked()).ToLocalChecked();
+        if (!kernel->IsUndefined()) {
+          Nan::Utf8String name(kernel);
+          if (strcmp(*name, "gaussian") == 0) {
+            opt.kernel = KD_KERNEL_GAUSSIAN;
+          } else if (strcmp(*name, "epanechnikov") == 0) {
+            opt.kernel = KD_KERNEL_EPANECHNIKOV;
+          } else if (strcmp(*name, "uniform") == 0) {
+            opt.kernel = KD_KERNEL_UNIFORM;
+          } else {
+            Nan::ThrowError("DensityBatch(): Unknown kernel.");
+            return;
+          }
+        }
+        Local<Value> tolerance = Nan::Get(options, Nan::New("tolerance").ToLocalChecked()).ToLocalChecked();
+        if (!tolerance->IsUndefined()) {
+          opt.tolerance = tolerance->NumberValue();
+        }
+        if (Nan::Get(options, Nan::New("weighted").ToLocalChecked()).ToLocalChecked()->BooleanValue()) {
+          opt.weight = _PayloadWeight;
+        }
+      }
+
+      int count = args.length / kd->dim_;
+      if (args.out != NULL) {
+        if (args.outLength < (size_t)count) {
+          Nan::ThrowRangeError("DensityBatch(): The output array is too short.");
+          return;
+        }
+        if (kd->Density("DensityBatch", args.pos, count, &opt, &args.query, args.out)) {
+          info.GetReturnValue().Set(info[info.Length() - (last->IsFloat64Array() ? 1 : 2)]);
+        }
+        return;
+      }
+
+      Local<ArrayBuffer> buf = ArrayBuffer::New(Isolate::GetCurrent(), count * sizeof(double));
+      if (kd->Density("DensityBatch", args.pos, count, &opt, &args.query,
+                      (double *)buf->GetContents().Data())) {
+        info.GetReturnValue().Set(Float64Array::New(buf, 0, count));
+      }
+    }
+
+    /**
+     * Sum up the numeric values of the points within the given range of the
+     * given point, with the arguments of nearestRange() but without an
+     * output array. Points whose value is not a number count as 0. The sum
+     * is computed while walking the tree, see kd_density().
+     *
+     * For example:
+     *
+     *  > tree.insert(1, 1, 10); tree.insert(2, 2, 5);
+     *  > tree.weightedSum(1, 1, 2);
+     *  15
+     */
+    static NAN_METHOD(WeightedSum){
+      KDTree *kd = ObjectWrap::Unwrap<KDTree>(info.This());
+      Nan::HandleScope scope;
+      QueryArgs args(info, 1);
+
+      if (info.Length() == 0) {
+        Nan::ThrowError("WeightedSum(): No parameters were provided.");
+        return;
+      }
+      if (args.length != kd->dim_){
+        std::stringstream ss;
+        ss << "WeightedSum(): Wrong number of parameters. Passed: "
+           << args.length << " Expected: " << kd->dim_;
+        Nan::ThrowError(Nan::New(ss.str()).ToLocalChecked());
+        return;
+      }
+
+      kddensity opt;
+      opt.kernel = KD_KERNEL_UNIFORM;
+      opt.bandwidth = args.Extra(0)->NumberValue();
+      opt.tolerance = 0.0;
+      opt.weight = _PayloadWeight;
+
+      double sum;
+      if (kd->Density("WeightedSum", args.pos, 1, &opt, &args.query, &sum)) {
+        info.GetReturnValue().Set(Nan::New<Number>(sum));
+      }
+    }
+
+    /**
+     * Find all pairs of points within the given range of each other, one
+     * from each tree.
      *
-     * An optional data argument is present as well; 
-     * if len == dim_, then the data param will be ignored.
+     * Returns an object with two Uint32Arrays, "a" and "b", where the i-th
+     * pair is (a[i], b[i]). Each entry is the index of the point within its
+     * tree, in insertion order.
      *
-     * @param pos   An array of points
-     * @param len   Number of points in the array
-     * @param data  Optional data argument
+     * For example:
      *
-     * @return true if the point was inserted successfully, false otherwise
-     */ 
-    bool Insert(const double *pos, int len, Nan::Persistent<Value>* data){
-      if (len != dim_ && len != dim_ + 1){
-        Nan::ThrowError("Insert(): Wrong number of parameters.");
-        // FUTURE: Passed: " + len + " Expected: " + dim_)));
+     *  > KDTree.radiusJoin(events, facilities, 0.5);
+     *  { a: Uint32Array [ 0, 3 ], b: Uint32Array [ 12, 12 ] }
+     *
+     */
+    static NAN_METHOD(RadiusJoin){
+      Nan::HandleScope scope;
+
+      if (info.Length() < 3) {
+        Nan::ThrowError("RadiusJoin(): Wrong number of parameters.");
+        return;
       }
 
-      if (len == dim_)
-        return (kd_insert(kd_, pos, NULL) == 0);
-      return (kd_insert(kd_, pos, data) == 0);
-    }
+      KDTree *ta = KDTree::_Unwrap(info[0]);
+      KDTree *tb = KDTree::_Unwrap(info[1]);
+      if (ta == NULL || tb == NULL) {
+        Nan::ThrowTypeError("RadiusJoin(): Expected two KDTree objects.");
+        return;
+      }
+      if (ta->dim_ != tb->dim_ || ta->geo_ != tb->geo_) {
+        Nan::ThrowError("RadiusJoin(): Trees have different dimensions.");
+        return;
+      }
 
-    /**
-     * Find the point nearest to the given point.
-     *
-     * @param pos   An array of points
-     * @param len   Number of points in the array
-     *
-     * @return An array containing the nearest point, or an empty array if no point is found.
-     *         If a data element was provided for the nearest point, it will be the last
-     *         member of the returned array.
-     */ 
-    Local<Value> Nearest(const double *pos, int len){
-      Nan::EscapableHandleScope scope;
-      int rpos;
-      void *pdata;
+      // Take the read locks in a fixed order, so that two joins can't deadlock
+      SharedTree *first = ta->shared_, *second = tb->shared_;
+      if (first > second) std::swap(first, second);
+      TreeLock lockFirst(first, false);
+      TreeLock lockSecond(second != first ? second : NULL, false);
 
-      if (len != dim_){
-        Nan::ThrowError("Nearest(): Wrong number of parameters.");
-        // FUTURE: Passed: " + len + " Expected: " + dim_)));
+      std::vector<uint32_t> pairs;
+      if (kd_radius_join(ta->kd_, tb->kd_, ta->TreeDistance(info[2]->NumberValue()),
+                         _JoinCollect, &pairs) < 0) {
+        Nan::ThrowError("RadiusJoin(): Out of memory.");
+        return;
       }
 
-      kdres *results = kd_nearest(kd_, pos);
-      Local<Array> rv = Nan::New<Array>(dim_ + 1);
-      
-      if (results != NULL) {
-        double *respos = new double[dim_];
-        pdata = (void *)kd_res_item(results, respos); 
+      size_t count = pairs.size() / 2;
+      Isolate *isolate = Isolate::GetCurrent();
+      Local<ArrayBuffer> bufA = ArrayBuffer::New(isolate, count * sizeof(uint32_t));
+      Local<ArrayBuffer> bufB = ArrayBuffer::New(isolate, count * sizeof(uint32_t));
+      uint32_t *a = (uint32_t *)bufA->GetContents().Data();
+      uint32_t *b = (uint32_t *)bufB->GetContents().Data();
+      for (size_t i = 0; i < count; i++) {
+        a[i] = pairs[2 * i];
+        b[i] = pairs[2 * i + 1];
+      }
 
-        for(rpos = 0; rpos < dim_; rpos++){
-          rv->Set(rpos, Nan::New<Number>(respos[rpos])); 
-        }
+      Local<Object> result = Nan::New<Object>();
+      Nan::Set(result, Nan::New("a").ToLocalChecked(), Uint32Array::New(bufA, 0, count));
+      Nan::Set(result, Nan::New("b").ToLocalChecked(), Uint32Array::New(bufB, 0, count));
+      info.GetReturnValue().Set(result);
+    }
 
-        // Append data element, if present
-        if (pdata != NULL) {
-          Nan::Persistent<Value>* hdata = (Nan::Persistent<Value>*)pdata;
-          Local<Value> value = Nan::New(*hdata);
-          rv->Set(dim_, value);
-        }
+    /**
+     * Write the points of the tree to an index file, without their values,
+     * see kd_save(). KDTree.load() reads the file back.
+     */
+    static NAN_METHOD(Save){
+      KDTree *kd = ObjectWrap::Unwrap<KDTree>(info.This());
 
-        free(respos);
-        kd_res_free(results);
+      if (info.Length() < 1 || !info[0]->IsString()) {
+        Nan::ThrowTypeError("Save(): Expected the name of a file.");
+        return;
+      }
+
+      Nan::Utf8String path(info[0]);
+      FILE *fp = fopen(*path, "wb");
+      if (fp == NULL) {
+        Nan::ThrowError("Save(): The file can not be opened.");
+        return;
+      }
+
+      int ret;
+      {
+        TreeLock lock(kd->shared_, false);
+        ret = kd_save(kd->kd_, fp);
+      }
+      if (fclose(fp) != 0 || ret == -1) {
+        Nan::ThrowError("Save(): The file can not be written.");
       }
-      return scope.Escape(rv);
     }
 
     /**
-     * Find the points nearest to the given point, within a given range.
+     * Create a tree from an index file written by save() or by the
+     * kdtree-build tool. The points have no values. Pass { geodesic: true }
+     * as second argument to load a geodesic tree.
      *
-     * @param pos   An array of points
-     * @param len   Number of points in the array
-     * @param range Range in which to search for points
+     * For example:
      *
-     * @return An array containing the nearest points, or an empty array if no point is found.
-     *         If a data element was provided for any point, it will be the last
-     *         member of that point's returned array.
-     */ 
-    Local<Value> NearestRange(const double *pos, int len, double range){
-      Nan::EscapableHandleScope scope;
-      int rpos, i = 0;
-      void *pdata;
-      kdres *results = NULL; 
-      Local<Array> rv = Nan::New<Array>();
+     *  > var tree = KDTree.load("places.kd");
+     *
+     */
+    static NAN_METHOD(Load){
+      Nan::HandleScope scope;
 
-      if (len != dim_){
-        std::stringstream ss;
-        ss << "Nearest(): Wrong number of parameters. Passed: "
-           << len << " Expected: " << dim_;
-        Nan::ThrowError(Nan::New(ss.str()).ToLocalChecked());
+      if (info.Length() < 1 || !info[0]->IsString()) {
+        Nan::ThrowTypeError("Load(): Expected the name of a file.");
+        return;
       }
 
-      results = kd_nearest_range(kd_, pos, range);
-      while (!kd_res_end( results )){
-        Local<Array> rvItem = Nan::New<Array>(dim_ + 1);
-        double *respos = new double[dim_];
-        pdata = (void *)kd_res_item(results, respos); 
+      Nan::Utf8String path(info[0]);
+      FILE *fp = fopen(*path, "rb");
+      if (fp == NULL) {
+        Nan::ThrowError("Load(): The file can not be opened.");
+        return;
+      }
+      kdtree *tree = kd_load(fp);
+      fclose(fp);
+      if (tree == NULL) {
+        Nan::ThrowError("Load(): Not a valid index file.");
+        return;
+      }
+      kd_data_destructor(tree, freeNodeData);
 
-        for(rpos = 0; rpos < dim_; rpos++){
-          rvItem->Set(rpos, Nan::New<Number>(respos[rpos])); 
-        }
+      bool geo = info.Length() > 1 && info[1]->IsObject() &&
+                 Nan::Get(info[1].As<Object>(), Nan::New("geodesic").ToLocalChecked()).ToLocalChecked()->BooleanValue();
+      if (geo && kd_dimension(tree) != 3) {
+        Nan::ThrowError("Load(): Geodesic trees are stored with 3 dimensions.");
+        kd_free(tree);
+        return;
+      }
 
-        // Append data element, if present
-        if (pdata != NULL) {
-          Nan::Persistent<Value>* hdata = (Nan::Persistent<Value>*)pdata;
-          Local<Value> value = Nan::New(*hdata);
-          rvItem->Set(dim_, value);
-        }
+      Local<Value> argv[2] = { Nan::New<External>(tree), Nan::New<Number>(geo ? 2 : kd_dimension(tree)) };
+      Nan::MaybeLocal<Object> obj = Nan::NewInstance(
+          Nan::New(constructor)->GetFunction(), 2, argv);
+      if (obj.IsEmpty()) {
+        kd_free(tree);
+        return;
+      }
+      ObjectWrap::Unwrap<KDTree>(obj.ToLocalChecked())->geo_ = geo;
+      info.GetReturnValue().Set(obj.ToLocalChecked());
+    }
 
-        rv->Set(i++, rvItem);
-        delete[] respos;
+    /**
+     * Lay out the nodes of the tree in one block of memory, in the order
+     * searches visit them. Worthwhile after many inserts into a large tree.
+     */
+    static NAN_METHOD(Optimize){
+      KDTree *kd = ObjectWrap::Unwrap<KDTree>(info.This());
 
-        // Move to next result entry
-        kd_res_next( results );
+      if (kd_is_snapshot(kd->kd_)) {
+        Nan::ThrowError("Optimize(): Snapshots are read-only.");
+        return;
+      }
+      if (kd_snapshot_count(kd->kd_) > 0) {
+        Nan::ThrowError("Optimize(): Trees with snapshots can not be optimized.");
+        return;
       }
 
-      kd_res_free(results);
-      return scope.Escape(rv);
+      TreeLock lock(kd->shared_, true);
+      if (kd_optimize(kd->kd_) == -1) {
+        Nan::ThrowError("Optimize(): Out of memory.");
+      }
     }
 
-  protected:
+    /**
+     * Rebuild the tree into a balanced tree, optionally choosing a new split
+     * policy first, see SplitPolicy(). Drops the empty nodes left behind by
+     * expire() and update(), and lays out the nodes like optimize().
+     *
+     * For example:
+     *
+     *  > tree.rebuild({ split: 'spread' });
+     *
+     */
+    static NAN_METHOD(Rebuild){
+      KDTree *kd = ObjectWrap::Unwrap<KDTree>(info.This());
+      int split = -1;
 
-    static Local<Value> _Dimensions(Nan::NAN_METHOD_ARGS_TYPE info){
-        Nan::EscapableHandleScope scope;
-        KDTree *kd = ObjectWrap::Unwrap<KDTree>(info.This());
-        return scope.Escape(Nan::New<Number>(kd->dim_));
-    }
+      if (kd_is_snapshot(kd->kd_)) {
+        Nan::ThrowError("Rebuild(): Snapshots are read-only.");
+        return;
+      }
+      if (kd_snapshot_count(kd->kd_) > 0) {
+        Nan::ThrowError("Rebuild(): Trees with snapshots can not be rebuilt.");
+        return;
+      }
+      if (info.Length() > 0 && info[0]->IsObject()) {
+        Local<Value> value = Nan::Get(info[0].As<Object>(), Nan::New("split").ToLocalChecked()).ToLocalChecked();
+        if (!value->IsUndefined() && (split = SplitPolicy(value, "Rebuild")) == -1) {
+          return;
+        }
+      }
 
-    static NAN_METHOD(Dimensions){
-        info.GetReturnValue().Set(KDTree::_Dimensions(info));
+      TreeLock lock(kd->shared_, true);
+      if (split != -1) {
+        kd_split(kd->kd_, split);
+      }
+      if (kd_rebuild(kd->kd_) == -1) {
+        Nan::ThrowError("Rebuild(): Out of memory.");
+      }
+      kd->SyncExternalMemory();
     }
 
     /**
-     * Wrapper for Insert()
+     * Remove all points which expired at or before the given time, by
+     * default Date.now(), and return their number.
+     *
+     * For example:
+     *
+     *  > tree.insertWith({ expires: 1000 }, 1, 1, 1);
+     *  > tree.expire(1000);
+     *  1
      */
-    static NAN_METHOD(Insert){
+    static NAN_METHOD(Expire){
       KDTree *kd = ObjectWrap::Unwrap<KDTree>(info.This());
+      double now = (info.Length() > 0 && !info[0]->IsUndefined()) ? info[0]->NumberValue() : NowMs();
 
-      double *pos = new double[info.Length()];
-      for (int i = 0; i < info.Length(); i++){
-        pos[i] = info[i]->NumberValue();
+      if (kd_is_snapshot(kd->kd_)) {
+        Nan::ThrowError("Expire(): Snapshots are read-only.");
+        return;
+      }
+      if (kd_snapshot_count(kd->kd_) > 0) {
+        Nan::ThrowError("Expire(): Points can not expire while the tree has snapshots.");
+        return;
+      }
+      if (!kd->values_) {
+        // Values are handles of the sharing thread's isolate
+        Nan::ThrowError("Expire(): Points can only expire in the thread which shared the tree.");
+        return;
       }
 
-      Local<Value> data = info[ info.Length() - 1 ];
-      Nan::Persistent<Value>* per = new Nan::Persistent<Value>(data);
-
-      Local<Value> result = Nan::New<Boolean>( kd->Insert(pos, info.Length(), per) );
-      delete[] pos;
-      info.GetReturnValue().Set(result);
+      TreeLock lock(kd->shared_, true);
+      int removed = kd_expire(kd->kd_, now);
+      kd->SyncExternalMemory();
+      info.GetReturnValue().Set(Nan::New<Number>(removed));
     }
 
-    static Local<Value> _Nearest(Nan::NAN_METHOD_ARGS_TYPE info){
+    /**
+     * Share the tree with other threads, such as worker_threads.
+     *
+     * Returns a numeric handle, which another thread can pass to
+     * KDTree.attach() to query and insert into the same tree, without a
+     * copy of it. Values of points are only visible to the thread which
+     * shared the tree; other threads see the coordinates only.
+     */
+    static NAN_METHOD(Share){
       KDTree *kd = ObjectWrap::Unwrap<KDTree>(info.This());
-      Nan::EscapableHandleScope scope;
 
-      double *pos = new double[info.Length()];
-      for (int i = 0; i < info.Length(); i++){
-        pos[i] = info[i]->NumberValue();
+      if (kd_is_snapshot(kd->kd_)) {
+        Nan::ThrowError("Share(): Snapshots can not be shared.");
+        return;
       }
+      // Values of points are released when this object is freed, which
+      // snapshots could outlive
+      if (kd_snapshot_count(kd->kd_) > 0) {
+        Nan::ThrowError("Share(): Trees with snapshots can not be shared.");
+        return;
+      }
+
+      if (kd->shared_ == NULL) {
+        SharedTree *shared = new SharedTree();
+        shared->kd = kd->kd_;
+        shared->dim = kd->dim_;
+        shared->geo = kd->geo_;
+        shared->refs = 1;
+        uv_rwlock_init(&shared->lock);
 
-      Local<Value> result = kd->Nearest(pos, info.Length()); 
-        
-      delete[] pos;
-      return scope.Escape(result);
+        uv_once(&registryOnce, initRegistry);
+        uv_mutex_lock(&registryLock);
+        shared->id = registryNextId++;
+        registry[shared->id] = shared;
+        uv_mutex_unlock(&registryLock);
+
+        kd->shared_ = shared;
+      }
+      info.GetReturnValue().Set(Nan::New<Number>(kd->shared_->id));
     }
 
     /**
-     * Wrapper for Nearest()
-     */ 
-    static NAN_METHOD(Nearest){
+     * Create a KDTree object for a tree shared by another thread, see
+     * Share(). This is a static method of KDTree.
+     */
+    static NAN_METHOD(Attach){
       Nan::HandleScope scope;
-      Local<Value> result = KDTree::_Nearest(info);
-      info.GetReturnValue().Set(result);
+      SharedTree *shared = NULL;
+
+      uv_once(&registryOnce, initRegistry);
+      uv_mutex_lock(&registryLock);
+      std::map<uint32_t, SharedTree*>::iterator it = registry.find(info[0]->Uint32Value());
+      if (it != registry.end()) {
+        shared = it->second;
+        shared->refs++;
+      }
+      uv_mutex_unlock(&registryLock);
+
+      if (shared == NULL) {
+        Nan::ThrowError("Attach(): No tree is shared with this handle.");
+        return;
+      }
+
+      Local<Value> argv[3] = { Nan::New<External>(shared), Nan::New<Number>(shared->dim), Nan::True() };
+      Nan::MaybeLocal<Object> obj = Nan::NewInstance(
+          Nan::New(constructor)->GetFunction(), 3, argv);
+      if (obj.IsEmpty()) {
+        ReleaseShared(shared);
+        return;
+      }
+      info.GetReturnValue().Set(obj.ToLocalChecked());
     }
 
     /**
-     * A shortcut method for Nearest, that returns an array containing only point data.
-     * If a value is present, it will NOT be returned in the result array.
+     * Drop a reference to a shared tree, freeing it along with the last one.
+     *
+     * @return true if the tree was freed
      */
-    static NAN_METHOD(NearestPoint){
+    static bool ReleaseShared(SharedTree *shared){
+      uv_mutex_lock(&registryLock);
+      bool last = (--shared->refs == 0);
+      if (last) {
+        registry.erase(shared->id);
+      }
+      uv_mutex_unlock(&registryLock);
+
+      if (last) {
+        kd_free(shared->kd);
+        uv_rwlock_destroy(&shared->lock);
+        delete shared;
+      }
+      return last;
+    }
+
+    /**
+     * Create a read-only snapshot of the tree, which holds the points
+     * inserted so far and is not affected by later inserts. The snapshot
+     * shares its nodes with the tree, so it is cheap to create.
+     */
+    static NAN_METHOD(Snapshot){
+      KDTree *kd = ObjectWrap::Unwrap<KDTree>(info.This());
       Nan::HandleScope scope;
-      Handle<Array> nearest = KDTree::_Nearest(info).As<Array>();
-      int dim = KDTree::_Dimensions(info).As<Number>()->Value();
 
-      Local<Array> result = Nan::New<Array>(dim); 
-      if (nearest->Length() > 0 &&    // Data present
-          (int)nearest->Length() >= dim) { // Points present
-         for (int i = 0; i < dim; i++) {
-           result->Set(i, nearest->Get(i));
-         }
+      if (kd->shared_ != NULL) {
+        Nan::ThrowError("Snapshot(): Shared trees can not have snapshots.");
+        return;
       }
 
-      info.GetReturnValue().Set(result);
+      kdtree *snap = kd_snapshot(kd->kd_);
+      if (snap == NULL) {
+        Nan::ThrowError("Snapshot(): Out of memory.");
+        return;
+      }
+
+      Local<Value> argv[2] = { Nan::New<External>(snap), Nan::New<Number>(kd->dim_) };
+      Nan::MaybeLocal<Object> obj = Nan::NewInstance(
+          Nan::New(constructor)->GetFunction(), 2, argv);
+      if (obj.IsEmpty()) {
+        kd_free(snap);
+        return;
+      }
+      ObjectWrap::Unwrap<KDTree>(obj.ToLocalChecked())->geo_ = kd->geo_;
+      info.GetReturnValue().Set(obj.ToLocalChecked());
     }
 
     /**
-     * A shortcut method for Nearest, that returns the point's value as a scalar.
-     * If a value is not present or no point was found, this method returns null.
+     * Returns the shape and native memory use of the tree.
      *
      * For example:
      *
-     *  > tree.insert(1, 1, 1, "My Value");
-     *  > tree.nearestValue(1, 1, 1);
-     *  "My Value"
+     *  > tree.stats();
+     *  { size: 5625, maxDepth: 24, avgDepth: 14.2, balance: 0.54, nativeBytes: 315360 }
      *
      */
-    static NAN_METHOD(NearestValue){
+    static NAN_METHOD(Stats){
+      KDTree *kd = ObjectWrap::Unwrap<KDTree>(info.This());
       Nan::HandleScope scope;
-      Handle<Array> nearest = KDTree::_Nearest(info).As<Array>();
-      int dim = KDTree::_Dimensions(info).As<Number>()->Value();
+      struct kdinfo ki;
 
-      if (nearest->Length() > 0 &&         // Data present
-          (int)nearest->Length() == (dim + 1)){ // Value present
-        info.GetReturnValue().Set( nearest->Get(nearest->Length() - 1) );
-      } else {
-        info.GetReturnValue().SetNull();
+      {
+        TreeLock lock(kd->shared_, false);
+        kd_info(kd->kd_, &ki);
       }
+
+      Local<Object> result = Nan::New<Object>();
+      Nan::Set(result, Nan::New("size").ToLocalChecked(), Nan::New<Number>(ki.size));
+      Nan::Set(result, Nan::New("maxDepth").ToLocalChecked(), Nan::New<Number>(ki.max_depth));
+      Nan::Set(result, Nan::New("avgDepth").ToLocalChecked(), Nan::New<Number>(ki.avg_depth));
+      Nan::Set(result, Nan::New("balance").ToLocalChecked(), Nan::New<Number>(ki.balance));
+      Nan::Set(result, Nan::New("nativeBytes").ToLocalChecked(), Nan::New<Number>((double)ki.mem));
+      info.GetReturnValue().Set(result);
     }
 
-    static NAN_METHOD(NearestRange){
+    /**
+     * Returns the statistics gathered over all queries of this tree, or null
+     * if the add-on was built without KD_STATS. Pass true to also reset them.
+     */
+    static NAN_METHOD(QueryStatistics){
+#ifdef KD_STATS
       KDTree *kd = ObjectWrap::Unwrap<KDTree>(info.This());
       Nan::HandleScope scope;
-      Local<Value> result; 
+      QueryStats *st = &kd->stats_;
 
-      if (info.Length() == 0) {
-        Nan::ThrowError("NearestRange(): No parameters were provided."); 
+      Local<Object> result = Nan::New<Object>();
+      Local<Array> nodesHistogram = Nan::New<Array>(HISTOGRAM_BUCKETS);
+      Local<Array> latencyHistogram = Nan::New<Array>(HISTOGRAM_BUCKETS);
+      for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        nodesHistogram->Set(i, Nan::New<Number>(st->nodesHistogram[i]));
+        latencyHistogram->Set(i, Nan::New<Number>(st->latencyHistogram[i]));
       }
-      else {
-        double *pos = new double[info.Length() - 1];
-        for (int i = 0; i < info.Length() - 1; i++){
-          pos[i] = info[i]->NumberValue();
-        }
+      Nan::Set(result, Nan::New("queries").ToLocalChecked(), Nan::New<Number>(st->queries));
+      Nan::Set(result, Nan::New("nodesVisited").ToLocalChecked(), Nan::New<Number>(st->nodes));
+      Nan::Set(result, Nan::New("distanceEvaluations").ToLocalChecked(), Nan::New<Number>(st->dists));
+      Nan::Set(result, Nan::New("pruned").ToLocalChecked(), Nan::New<Number>(st->pruned));
+      Nan::Set(result, Nan::New("results").ToLocalChecked(), Nan::New<Number>(st->results));
+      Nan::Set(result, Nan::New("timeUs").ToLocalChecked(), Nan::New<Number>(st->timeUs));
+      Nan::Set(result, Nan::New("nodesHistogram").ToLocalChecked(), nodesHistogram);
+      Nan::Set(result, Nan::New("latencyHistogram").ToLocalChecked(), latencyHistogram);
+
+      if (info.Length() > 0 && info[0]->BooleanValue()) {
+        memset(st, 0, sizeof *st);
+      }
+      info.GetReturnValue().Set(result);
+#else
+      info.GetReturnValue().SetNull();
+#endif
+    }
+
+    /**
+     * Returns the counters of the result cache of the tree, see the
+     * cacheSize option, or null if the tree has no cache. Pass true to also
+     * reset them.
+     */
+    static NAN_METHOD(CacheStatistics){
+      KDTree *kd = ObjectWrap::Unwrap<KDTree>(info.This());
+      Nan::HandleScope scope;
+      kdcachestats st;
 
-        result = kd->NearestRange(pos, info.Length() - 1, info[info.Length() - 1]->NumberValue()); 
-        delete[] pos;
+      if (kd_cache_stats(kd->kd_, &st, info.Length() > 0 && info[0]->BooleanValue()) == -1) {
+        info.GetReturnValue().SetNull();
+        return;
       }
 
+      Local<Object> result = Nan::New<Object>();
+      Nan::Set(result, Nan::New("hits").ToLocalChecked(), Nan::New<Number>(st.hits));
+      Nan::Set(result, Nan::New("misses").ToLocalChecked(), Nan::New<Number>(st.misses));
+      Nan::Set(result, Nan::New("invalidated").ToLocalChecked(), Nan::New<Number>(st.invalidated));
+      Nan::Set(result, Nan::New("size").ToLocalChecked(), Nan::New<Number>(st.size));
       info.GetReturnValue().Set(result);
     }
 
@@ -298,17 +2050,169 @@ class KDTree : public ObjectWrap {
      * "External" constructor called by the Addon framework
      */
     static NAN_METHOD(New){
+        KDTree *kd;
         int dimension = 3; // Default
-        if (info.Length() > 0){
+
+        if (info.Length() == 3 && info[0]->IsExternal()){
+          // Attach to a tree shared by another thread, see Attach()
+          kd = new KDTree((SharedTree *)info[0].As<External>()->Value());
+        } else if (info.Length() == 2 && info[0]->IsExternal()){
+          // Wrap an existing tree, see Snapshot()
+          kd = new KDTree((kdtree *)info[0].As<External>()->Value(),
+                          info[1]->Int32Value());
+        } else if (info.Length() > 1 && info[1]->IsObject()){
           dimension = info[0]->Int32Value();
+          bool geo = Nan::Get(info[1].As<Object>(), Nan::New("geodesic").ToLocalChecked()).ToLocalChecked()->BooleanValue();
+          kdtree *tree = CreateTree(dimension, info[1].As<Object>(), geo);
+          if (tree == NULL) {
+            return;
+          }
+          kd_data_destructor(tree, freeNodeData);
+          kd = new KDTree(tree, dimension);
+          kd->geo_ = geo;
+        } else {
+          if (info.Length() > 0){
+            dimension = info[0]->Int32Value();
+          }
+          kd = new KDTree(dimension);
         }
-
-        KDTree *kd = new KDTree(dimension);
         kd->Wrap(info.This());
 
         info.GetReturnValue().Set(info.This());
     }
 
+    /**
+     * Create a tree from the options passed to the constructor:
+     *
+     *   quantize          16 or 32 to store quantized coordinates, within
+     *   min, max          the box given by these arrays
+     *   mergeDuplicates   true to store points at the same position in one node
+     *   cacheSize         number of nearest and nearestN results to cache
+     *   cacheQuantum      round query points to multiples of this for the cache
+     *   split             split policy of rebuilds, see SplitPolicy()
+     *   scan              "auto", "always" or "never" to search by linear scan
+     *   geodesic          true for points given by latitude and longitude in
+     *                     degrees, with distances in metres, see TreePoint()
+     *
+     * Throws and returns NULL if the options are invalid.
+     */
+    static kdtree *CreateTree(int dim, Local<Object> options, bool geo){
+      Local<Value> bits = Nan::Get(options, Nan::New("quantize").ToLocalChecked()).ToLocalChecked();
+      Local<Value> merge = Nan::Get(options, Nan::New("mergeDuplicates").ToLocalChecked()).ToLocalChecked();
+
+      if (geo && dim != 2) {
+        Nan::ThrowError("KDTree(): Geodesic trees have 2 dimensions, latitude and longitude.");
+        return NULL;
+      }
+      if (geo && !bits->IsUndefined()) {
+        Nan::ThrowError("KDTree(): Geodesic trees can not be quantized.");
+        return NULL;
+      }
+      kdtree *tree = bits->IsUndefined() ? kd_create(geo ? 3 : dim) : CreateQuantized(dim, options);
+
+      if (tree == NULL) {
+        if (bits->IsUndefined()) {
+          Nan::ThrowError("KDTree(): Out of memory.");
+        }
+        return NULL;
+      }
+      kd_merge_duplicates(tree, merge->BooleanValue());
+
+      Local<Value> split = Nan::Get(options, Nan::New("split").ToLocalChecked()).ToLocalChecked();
+      if (!split->IsUndefined()) {
+        int policy = SplitPolicy(split, "KDTree");
+        if (policy == -1) {
+          kd_free(tree);
+          return NULL;
+        }
+        kd_split(tree, policy);
+      }
+
+      Local<Value> scan = Nan::Get(options, Nan::New("scan").ToLocalChecked()).ToLocalChecked();
+      if (!scan->IsUndefined()) {
+        static const char *modes[] = { "auto", "always", "never" };
+        int mode = KD_SCAN_NEVER + 1;
+        if (scan->IsString()) {
+          Nan::Utf8String name(scan);
+          for (mode = KD_SCAN_AUTO; mode <= KD_SCAN_NEVER && strcmp(*name, modes[mode]) != 0; mode++);
+        }
+        if (mode > KD_SCAN_NEVER) {
+          Nan::ThrowError("KDTree(): Option scan must be auto, always or never.");
+          kd_free(tree);
+          return NULL;
+        }
+        kd_scan(tree, mode);
+      }
+
+      Local<Value> cacheSize = Nan::Get(options, Nan::New("cacheSize").ToLocalChecked()).ToLocalChecked();
+      Local<Value> quantum = Nan::Get(options, Nan::New("cacheQuantum").ToLocalChecked()).ToLocalChecked();
+      if (!cacheSize->IsUndefined() &&
+          kd_cache(tree, cacheSize->Int32Value(), quantum->IsUndefined() ? 0.0 : quantum->NumberValue()) == -1) {
+        Nan::ThrowError("KDTree(): Out of memory.");
+        kd_free(tree);
+        return NULL;
+      }
+      return tree;
+    }
+
+    /**
+     * Map the name of a split policy to its KD_SPLIT_* constant:
+     *
+     *   cycle      cycle through the axes, splitting at the median (default)
+     *   spread     split the axis of widest spread at the median
+     *   variance   split the axis of largest variance at the median
+     *   midpoint   sliding midpoint of the axis of widest spread
+     *
+     * Throws and returns -1 for any other value.
+     */
+    static int SplitPolicy(Local<Value> value, const char *method){
+      static const char *names[] = { "cycle", "spread", "variance", "midpoint" };
+
+      if (value->IsString()) {
+        Nan::Utf8String name(value);
+        for (int i = KD_SPLIT_CYCLE; i <= KD_SPLIT_MIDPOINT; i++) {
+          if (strcmp(*name, names[i]) == 0) {
+            return i;
+          }
+        }
+      }
+      std::stringstream ss;
+      ss << method << "(): Option split must be cycle, spread, variance or midpoint.";
+      Nan::ThrowError(Nan::New(ss.str()).ToLocalChecked());
+      return -1;
+    }
+
+    /**
+     * Create a tree with quantized coordinates, see CreateTree().
+     */
+    static kdtree *CreateQuantized(int dim, Local<Object> options){
+      Local<Value> bits = Nan::Get(options, Nan::New("quantize").ToLocalChecked()).ToLocalChecked();
+      Local<Value> min = Nan::Get(options, Nan::New("min").ToLocalChecked()).ToLocalChecked();
+      Local<Value> max = Nan::Get(options, Nan::New("max").ToLocalChecked()).ToLocalChecked();
+
+      if (!bits->IsNumber() || (bits->Int32Value() != 16 && bits->Int32Value() != 32)) {
+        Nan::ThrowError("KDTree(): Option quantize must be 16 or 32.");
+        return NULL;
+      }
+      if (!min->IsArray() || !max->IsArray() ||
+          (int)min.As<Array>()->Length() != dim || (int)max.As<Array>()->Length() != dim) {
+        Nan::ThrowError("KDTree(): Options min and max must be arrays with a number for each dimension.");
+        return NULL;
+      }
+
+      std::vector<double> lo(dim), hi(dim);
+      for (int i = 0; i < dim; i++) {
+        lo[i] = Nan::Get(min.As<Array>(), i).ToLocalChecked()->NumberValue();
+        hi[i] = Nan::Get(max.As<Array>(), i).ToLocalChecked()->NumberValue();
+      }
+
+      kdtree *tree = kd_create_quantized(dim, &lo[0], &hi[0], bits->Int32Value());
+      if (tree == NULL) {
+        Nan::ThrowError("KDTree(): Out of memory.");
+      }
+      return tree;
+    }
+
     /**
      * Constructor
      *
@@ -317,19 +2221,92 @@ class KDTree : public ObjectWrap {
     KDTree (int dim) : ObjectWrap (){
         kd_ = kd_create(dim);
         dim_ = dim;
+        geo_ = false;
+        shared_ = NULL;
+        values_ = true;
+        external_ = 0;
         kd_data_destructor(kd_, freeNodeData);
+        SyncExternalMemory();
+#ifdef KD_STATS
+        memset(&stats_, 0, sizeof stats_);
+#endif
+    }
+
+    /**
+     * Constructor for a tree created by the C library, such as a snapshot
+     *
+     * @param kd    The tree, which is freed along with this object
+     * @param dim   Dimensions of each point in the tree
+     */
+    KDTree (kdtree *kd, int dim) : ObjectWrap (){
+        kd_ = kd;
+        dim_ = dim;
+        geo_ = false;
+        shared_ = NULL;
+        values_ = true;
+        external_ = 0;
+        SyncExternalMemory();
+#ifdef KD_STATS
+        memset(&stats_, 0, sizeof stats_);
+#endif
+    }
+
+    /**
+     * Constructor for a tree shared by another thread
+     *
+     * @param shared    The shared tree, with a reference taken for this object
+     */
+    KDTree (SharedTree *shared) : ObjectWrap (){
+        kd_ = shared->kd;
+        dim_ = shared->dim;
+        geo_ = shared->geo;
+        shared_ = shared;
+        values_ = false;
+        external_ = 0;
+#ifdef KD_STATS
+        memset(&stats_, 0, sizeof stats_);
+#endif
     }
 
     /**
      * Destructor
      */
     ~KDTree(){
-        if (kd_ != NULL){
+        if (shared_ != NULL){
+            if (values_){
+              // Values are handles of this thread's isolate, so release
+              // them now rather than when another thread frees the tree
+              TreeLock lock(shared_, true);
+              kd_free_data(kd_);
+              kd_data_destructor(kd_, NULL);
+            }
+            ReleaseShared(shared_);
+        } else if (kd_ != NULL){
             kd_free(kd_);
         }
+        Nan::AdjustExternalMemory(static_cast<int>(-external_));
+    }
+
+    /**
+     * Report any change in the tree's native memory use to V8, so that
+     * garbage collection is scheduled according to the real size of the tree.
+     */
+    void SyncExternalMemory(){
+      // Only the thread which owns a shared tree accounts for its memory
+      int64_t bytes = (kd_ && values_) ? (int64_t)kd_mem_usage(kd_) : 0;
+      if (bytes != external_) {
+        Nan::AdjustExternalMemory(static_cast<int>(bytes - external_));
+        external_ = bytes;
+      }
     }
 
   private:
+    /**
+     * Template used to create and recognize KDTree objects. Each thread
+     * running node has its own isolate, and thus its own template.
+     */
+    static thread_local Nan::Persistent<FunctionTemplate> constructor;
+
     /**
      * Pointer to the tree itself
      */
@@ -339,10 +2316,46 @@ class KDTree : public ObjectWrap {
      * Dimension of each point in the tree
      */
     int dim_;
+
+    /**
+     * True if points are given by latitude and longitude, see TreePoint()
+     */
+    bool geo_;
+
+    /**
+     * The shared tree, if the tree was shared with or by another thread
+     */
+    SharedTree* shared_;
+
+    /**
+     * True if data values of the tree belong to this thread's isolate
+     */
+    bool values_;
+
+    /**
+     * Native memory currently reported to V8
+     */
+    int64_t external_;
+
+#ifdef KD_STATS
+    /**
+     * Statistics of all queries made against this tree
+     */
+    QueryStats stats_;
+#endif
 };
 
+thread_local Nan::Persistent<FunctionTemplate> KDTree::constructor;
+
 /**
  * Entry point required by node.js framework
  */
-NODE_MODULE(kdtree, KDTree::Initialize)
+NAN_MODULE_INIT(InitAll){
+  KDTree::Initialize(target);
+  Cursor::Initialize();
+  InitDynamicKDTree(target);
+  InitShardedKDTree(target);
+}
+
+NAN_MODULE_WORKER_ENABLED(kdtree, InitAll)
 
@@ -0,0 +1,35 @@
+/**
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+#ifndef NODE_KDTREE_H
+#define NODE_KDTREE_H
+
+#include <v8.h>
+#include <nan.h>
+
+/**
+ * Free memory allocated to the 'data' portion of a node
+ */
+void freeNodeData(void *data);
+
+/**
+ * Convert a point to an array of its coordinates, followed by the
+ * point's data element if present.
+ */
+v8::Local<v8::Array> pointToArray(const double *pos, int dim, void *data);
+
+/**
+ * Register the DynamicKDTree class
+ */
+void InitDynamicKDTree(v8::Handle<v8::Object> exports);
+
+/**
+ * Register the ShardedKDTree class
+ */
+void InitShardedKDTree(v8::Handle<v8::Object> exports);
+
+#endif
@@ -0,0 +1,45 @@
+/**
+ * Test for batches of nearest point queries.
+ *
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+var assert = require('assert');
+var kd = require('../build/Release/kdtree');
+var tree = new kd.KDTree(2);
+var ids = [], i;
+
+for (i = 0; i < 1000; i++) {
+  ids.push(tree.insertWith({ tag: i % 2 ? 1 : 2 }, (i * 37) % 101, (i * 53) % 97, i));
+}
+
+var queries = new Float64Array(2 * 500);
+for (i = 0; i < queries.length; i++) {
+  queries[i] = ((i * 7919) % 1000) / 8 - 10;
+}
+
+// Each result is the same as that of a single query
+var out = new Float64Array(queries.length);
+var found = tree.nearestBatch(queries, out);
+assert.equal(found.length, 500);
+for (i = 0; i < 500; i++) {
+  var n = tree.nearest(queries[2 * i], queries[2 * i + 1]);
+  assert.equal(found[i], ids[n[2]]);
+  assert.deepEqual([out[2 * i], out[2 * i + 1]], [n[0], n[1]]);
+}
+
+// Query options apply to every query
+found = tree.nearestBatch(queries, { mask: 1, maxDistance: 2 });
+for (i = 0; i < 500; i++) {
+  var v = tree.nearestValue(queries[2 * i], queries[2 * i + 1], { mask: 1, maxDistance: 2 });
+  assert.equal(found[i], v === null ? -1 : ids[v]);
+}
+
+assert.equal(new kd.KDTree(2).nearestBatch(new Float64Array([1, 2]))[0], -1);
+assert.equal(tree.nearestBatch(new Float64Array(0)).length, 0);
+assert.throws(function() { tree.nearestBatch(new Float64Array(3)); });
+assert.throws(function() { tree.nearestBatch(queries, new Float64Array(2)); });
+assert.throws(function() { tree.nearestBatch(1, 2); });
@@ -0,0 +1,48 @@
+/**
+ * Test for the result cache of nearest and nearestN queries.
+ *
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+var assert = require('assert');
+var kd = require('../build/Release/kdtree');
+var tree = new kd.KDTree(2, { cacheSize: 4 });
+var plain = new kd.KDTree(2);
+var i;
+
+assert.equal(plain.cacheStats(), null);
+for (i = 0; i < 100; i++) {
+  tree.insert(i % 10, Math.floor(i / 10), i);
+}
+
+assert.deepEqual(tree.nearest(2.1, 3.2), [2, 3, 32]);
+assert.deepEqual(tree.nearest(2.1, 3.2), [2, 3, 32]);
+assert.deepEqual(tree.nearestN(2.1, 3.2, 2), [[2, 3, 32], [2, 4, 42]]);
+assert.deepEqual(tree.nearestN(2.1, 3.2, 2), [[2, 3, 32], [2, 4, 42]]);
+assert.deepEqual(tree.cacheStats(), { hits: 2, misses: 2, invalidated: 0, size: 2 });
+
+// A point far away keeps the results, a closer one drops them
+tree.insert(50, 50, "far");
+assert.equal(tree.cacheStats().invalidated, 0);
+tree.insert(2.1, 3.1, "near");
+assert.equal(tree.cacheStats().invalidated, 2);
+assert.deepEqual(tree.nearest(2.1, 3.2), [2.1, 3.1, "near"]);
+assert.deepEqual(tree.nearestN(2.1, 3.2, 2), [[2.1, 3.1, "near"], [2, 3, 32]]);
+
+// The least recently used results are dropped
+for (i = 0; i < 10; i++) {
+  tree.nearest(i, 0);
+}
+assert.equal(tree.cacheStats(true).size, 4);
+assert.deepEqual(tree.cacheStats(), { hits: 0, misses: 0, invalidated: 0, size: 4 });
+
+// Nearby queries share the result for their rounded point
+var rounded = new kd.KDTree(2, { cacheSize: 10, cacheQuantum: 1 });
+rounded.insert(0, 0, "a");
+rounded.insert(0.6, 0, "b");
+assert.equal(rounded.nearestValue(0.3, 0.2), "a");
+assert.equal(rounded.nearestValue(0.4, 0.1), "a");
+assert.equal(rounded.cacheStats().hits, 1);
@@ -0,0 +1,89 @@
+/**
+ * Test for range searches read a page at a time.
+ *
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+var assert = require('assert');
+var kd = require('../build/Release/kdtree');
+var tree = new kd.KDTree(2);
+var x, y;
+
+for (x = 0; x < 75; x++) {
+  for (y = 0; y < 75; y++) {
+    tree.insertWith({ tag: x % 2 ? 1 : 2 }, x, y, x * 100 + y);
+  }
+}
+
+function sorted(points) {
+  return points.slice().sort(function(a, b) { return a[2] - b[2]; });
+}
+
+// Pages hold the points of nearestRange, each once
+var cursor = tree.rangeCursor(30, 30, 10);
+var pages = [], page;
+while ((page = cursor.next(7)).length > 0) {
+  assert.ok(page.length <= 7);
+  pages = pages.concat(page);
+}
+assert.deepEqual(sorted(pages), sorted(tree.nearestRange(30, 30, 10)));
+assert.deepEqual(cursor.next(7), []);
+
+// The iterator protocol, with query options
+var found = [];
+for (var point of tree.rangeCursor(new Float64Array([30, 30]), 10, { mask: 1 })) {
+  found.push(point);
+}
+assert.deepEqual(sorted(found), sorted(tree.nearestRange(30, 30, 10, { mask: 1 })));
+
+// Pages and the iterator protocol share the same search
+cursor = tree.rangeCursor(0, 0, 3);
+var first = cursor.next();
+assert.equal(first.done, false);
+var rest = cursor.next(100);
+assert.equal(rest.length, 10);
+assert.deepEqual(cursor.next(), { done: true });
+assert.deepEqual(sorted([first.value].concat(rest)), sorted(tree.nearestRange(0, 0, 3)));
+
+// Leaving a loop early closes the cursor
+cursor = tree.rangeCursor(30, 30, 100);
+for (var point of cursor) {
+  break;
+}
+assert.deepEqual(cursor.next(10), []);
+
+// Inserts don't end a search, but moving points does
+cursor = tree.rangeCursor(30, 30, 100);
+assert.equal(cursor.next(10).length, 10);
+tree.insert(30, 30, 'new');
+assert.equal(cursor.next(10).length, 10);
+tree.update(0, 200, 200);
+assert.throws(function() { cursor.next(10); });
+
+assert.throws(function() { tree.rangeCursor(1, 2, 3, 4); });
+assert.throws(function() { tree.rangeCursor(1, 2, 3).next(0); });
+
+// Nearest points by increasing distance, as found by nearestN
+function distance(p) {
+  return Math.sqrt((p[0] - 20.3) * (p[0] - 20.3) + (p[1] - 40.6) * (p[1] - 40.6));
+}
+var nearest = tree.nearestN(20.3, 40.6, 60);
+cursor = tree.nearestCursor(20.3, 40.6);
+found = cursor.next(3).concat(cursor.next(7), cursor.next(50));
+assert.equal(found.length, 60);
+for (var i = 0; i < found.length; i++) {
+  assert.equal(distance(found[i]), distance(nearest[i]));
+}
+
+var last = 0, count = 0;
+for (var point of tree.nearestCursor(20.3, 40.6, { mask: 2, maxDistance: 5 })) {
+  assert.ok(distance(point) >= last);
+  assert.equal(point[0] % 2, 0);
+  last = distance(point);
+  count++;
+}
+assert.equal(count, tree.nearestRange(20.3, 40.6, 5, { mask: 2 }).length);
+assert.throws(function() { tree.nearestCursor(1, 2, 3); });
@@ -0,0 +1,82 @@
+/**
+ * Test for kernel density and weighted sums computed while walking the tree.
+ *
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+var assert = require('assert');
+var kd = require('../build/Release/kdtree');
+var tree = new kd.KDTree(2);
+var x, y;
+
+for (x = 0; x < 40; x++) {
+  for (y = 0; y < 40; y++) {
+    tree.insertWith({ tag: x % 2 ? 1 : 2 }, x / 2, y / 2, x - y);
+  }
+}
+
+var queries = new Float64Array([0, 0, 5.3, 7.1, 10, 10, 19.5, 2, -3, 25]);
+
+// Sums over the points found by nearestRange
+function expected(qx, qy, h, kernel, weighted, options) {
+  var total = 0;
+  tree.nearestRange(qx, qy, 1000, options || {}).forEach(function(p) {
+    var d2 = (p[0] - qx) * (p[0] - qx) + (p[1] - qy) * (p[1] - qy);
+    var k = kernel === 'uniform' ? (d2 <= h * h ? 1 : 0) :
+            kernel === 'epanechnikov' ? Math.max(0, 1 - d2 / (h * h)) :
+            Math.exp(-d2 / (2 * h * h));
+    total += k * (weighted ? (typeof p[2] === 'number' ? p[2] : 0) : 1);
+  });
+  return total;
+}
+
+function near(a, b, tolerance) {
+  assert.ok(Math.abs(a - b) <= tolerance, a + ' is not ' + b);
+}
+
+['gaussian', 'epanechnikov', 'uniform'].forEach(function(kernel) {
+  [false, true].forEach(function(weighted) {
+    var density = tree.densityBatch(queries, 1.5, { kernel: kernel, weighted: weighted });
+    assert.ok(density instanceof Float64Array);
+    assert.equal(density.length, 5);
+    for (var i = 0; i < 5; i++) {
+      near(density[i], expected(queries[2 * i], queries[2 * i + 1], 1.5, kernel, weighted), 1e-6);
+    }
+  });
+});
+
+// Far away subtrees are approximated within the tolerance per point
+var density = tree.densityBatch(queries, 3, { tolerance: 0.01 });
+for (var i = 0; i < 5; i++) {
+  near(density[i], expected(queries[2 * i], queries[2 * i + 1], 3), 0.01 * 1600);
+}
+
+// Query options, and an output array
+var out = new Float64Array(5);
+assert.strictEqual(tree.densityBatch(queries, 2, out, { mask: 1, kernel: 'uniform' }), out);
+for (var i = 0; i < 5; i++) {
+  assert.equal(out[i], expected(queries[2 * i], queries[2 * i + 1], 2, 'uniform', false, { mask: 1 }));
+}
+
+// Weighted sums follow the tree as points are added and moved
+assert.equal(tree.weightedSum(10, 10, 2), expected(10, 10, 2, 'uniform', true));
+assert.equal(tree.weightedSum(new Float64Array([10, 10]), 2, { mask: 2 }),
+             expected(10, 10, 2, 'uniform', true, { mask: 2 }));
+tree.insert(10, 10, 1000);
+tree.insert(10, 10, 'not a number');
+tree.update(0, 10.5, 10);
+assert.equal(tree.weightedSum(10, 10, 2), expected(10, 10, 2, 'uniform', true));
+
+// Optimizing moves the nodes, but not the points
+var before = tree.weightedSum(10, 10, 2);
+tree.optimize();
+assert.equal(tree.weightedSum(10, 10, 2), before);
+
+assert.throws(function() { tree.densityBatch(queries, 0); });
+assert.throws(function() { tree.densityBatch(queries, 1, { kernel: 'cosine' }); });
+assert.throws(function() { tree.densityBatch(new Float64Array(3), 1); });
+assert.throws(function() { tree.densityBatch(queries, 1, new Float64Array(2)); });
+assert.throws(function() { tree.weightedSum(1, 2, 3, 4); });
@@ -0,0 +1,48 @@
+/**
+ * Test for merging points at the same position into one node.
+ *
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+var assert = require('assert');
+var kd = require('../build/Release/kdtree');
+var tree = new kd.KDTree(2, { mergeDuplicates: true });
+var i;
+
+for (i = 0; i < 100; i++) {
+  tree.insert(1, 1, "event " + i);
+}
+tree.insert(5, 5, "other");
+
+// All points at one position share a node
+var stats = tree.stats();
+assert.equal(stats.size, 101);
+assert.equal(stats.maxDepth, 2);
+
+assert.deepEqual(tree.nearest(1.2, 1.2), [1, 1, "event 0"]);
+var values = tree.nearestValues(1.2, 1.2);
+assert.equal(values.length, 100);
+assert.equal(values[99], "event 99");
+assert.equal(tree.nearestRange(1, 1, 1).length, 100);
+assert.equal(tree.nearestRange(3, 3, 3).length, 101);
+
+var knn = tree.nearestN(4, 4, 3);
+assert.equal(knn.length, 3);
+assert.deepEqual(knn[0], [5, 5, "other"]);
+assert.deepEqual(knn[1], [1, 1, "event 0"]);
+
+// Snapshots don't see values added to a node later
+var snap = tree.snapshot();
+tree.insert(1, 1, "late");
+assert.equal(snap.nearestValues(1, 1).length, 100);
+assert.equal(tree.nearestValues(1, 1).length, 101);
+
+// Without the option, each point has its own node
+var plain = new kd.KDTree(2);
+plain.insert(1, 1, "a");
+plain.insert(1, 1, "b");
+assert.deepEqual(plain.nearestValues(1, 1), ["a"]);
+assert.equal(plain.nearestRange(1, 1, 0).length, 2);
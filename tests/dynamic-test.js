@@ -0,0 +1,43 @@
+/**
+ * Test for the dynamic index and nearestN.
+ *
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+var assert = require('assert');
+var kd = require('../build/Release/kdtree');
+
+// A small buffer so that several levels are merged
+var dyn = new kd.DynamicKDTree(2, 4);
+var tree = new kd.KDTree(2);
+assert.equal(dyn.dimensions(), 2);
+assert.deepEqual(dyn.nearest(0, 0), []);
+
+// Sorted inserts, which would make a single tree degenerate
+for (var x = 0; x < 30; x++) {
+  for (var y = 0; y < 30; y++) {
+    dyn.insert(x, y, x + "," + y);
+    tree.insert(x, y, x + "," + y);
+  }
+}
+assert.equal(dyn.size(), 900);
+
+for (var x = 0; x < 30; x += 3) {
+  for (var y = 0; y < 30; y += 3) {
+    assert.deepEqual(dyn.nearest(x + 0.1, y - 0.1), [x, y, x + "," + y]);
+  }
+}
+
+function byPoint(a, b) { return a[0] - b[0] || a[1] - b[1]; }
+assert.deepEqual(dyn.nearestRange(10, 10, 1.5).sort(byPoint),
+                 tree.nearestRange(10, 10, 1.5).sort(byPoint));
+assert.equal(dyn.nearestRange(10, 10, 1.5).length, 9);
+
+// nearestN returns points ordered by distance, on both kinds of tree
+assert.deepEqual(dyn.nearestN(5.2, 5.1, 3), [[5, 5, "5,5"], [6, 5, "6,5"], [5, 6, "5,6"]]);
+assert.deepEqual(tree.nearestN(5.2, 5.1, 3), [[5, 5, "5,5"], [6, 5, "6,5"], [5, 6, "5,6"]]);
+assert.equal(tree.nearestN(0, 0, 1000).length, 900);
+assert.deepEqual(tree.nearestN(0, 0, 0), []);
@@ -0,0 +1,56 @@
+/**
+ * Test for points which expire.
+ *
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+var assert = require('assert');
+var kd = require('../build/Release/kdtree');
+var tree = new kd.KDTree(2);
+var i;
+
+// Point i expires at time i % 10 + 1
+for (i = 0; i < 1000; i++) {
+  tree.insertWith({ expires: i % 10 + 1 }, i % 40, Math.floor(i / 40), i);
+}
+tree.insert(0.5, 0.5, "forever");
+
+// Queries may skip expired points before they are removed
+assert.deepEqual(tree.nearest(0.4, 0.4), [0.5, 0.5, "forever"]);
+assert.deepEqual(tree.nearest(0, 0, { now: 1 }), [0.5, 0.5, "forever"]);
+assert.deepEqual(tree.nearest(0, 0.1, { now: 1 }), [0.5, 0.5, "forever"]);
+assert.deepEqual(tree.nearest(1, 0, { now: 1 }), [1, 0, 1]);
+assert.equal(tree.nearestRange(20, 12, 2.5, { now: 5 }).length,
+             tree.nearestRange(20, 12, 2.5).filter(function(p) {
+               return typeof p[2] != "number" || p[2] % 10 + 1 > 5;
+             }).length);
+
+assert.equal(tree.expire(0), 0);
+assert.equal(tree.expire(1), 100);
+assert.equal(tree.stats().size, 901);
+assert.deepEqual(tree.nearest(0, 0), [0.5, 0.5, "forever"]);
+
+// Later expiries remove the rest, and the points keep their numbers
+assert.equal(tree.expire(9), 800);
+tree.nearestRange(20, 12, 50).forEach(function(p) {
+  assert.ok(p[2] == "forever" || p[2] % 10 == 9);
+});
+var other = new kd.KDTree(2);
+other.insert(9, 0);
+assert.deepEqual(Array.prototype.slice.call(kd.KDTree.radiusJoin(tree, other, 0.1).a), [9]);
+
+assert.equal(tree.expire(100), 100);
+assert.deepEqual(tree.nearest(9, 0), [0.5, 0.5, "forever"]);
+assert.equal(tree.stats().size, 1);
+
+// ttl counts from now
+tree.insertWith({ ttl: 60000 }, 3, 3, "soon");
+assert.equal(tree.expire(), 0);
+assert.equal(tree.expire(Date.now() + 60001), 1);
+
+var snap = tree.snapshot();
+assert.throws(function() { tree.expire(); });
+assert.throws(function() { snap.expire(); });
@@ -0,0 +1,98 @@
+/**
+ * Test for trees of latitude and longitude, with distances in metres.
+ *
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+var assert = require('assert');
+var kd = require('../build/Release/kdtree');
+var tree = new kd.KDTree(2, { geodesic: true });
+var points = [], i;
+
+// Great-circle distance by the haversine formula
+function distance(a, b) {
+  var rad = Math.PI / 180;
+  var h = Math.pow(Math.sin((b[0] - a[0]) * rad / 2), 2) +
+          Math.cos(a[0] * rad) * Math.cos(b[0] * rad) * Math.pow(Math.sin((b[1] - a[1]) * rad / 2), 2);
+  return 2 * Math.asin(Math.sqrt(Math.min(h, 1))) * 6371008.8;
+}
+
+function near(a, b, tolerance) {
+  assert.ok(Math.abs(a - b) <= tolerance, a + ' is not ' + b);
+}
+
+for (i = 0; i < 2000; i++) {
+  var lat = Math.asin(((i * 7919) % 2000) / 1000 - 1) * 180 / Math.PI;
+  var lon = ((i * 104729) % 3600) / 10 - 180;
+  points.push([lat, lon]);
+  tree.insert(lat, lon, i);
+}
+assert.equal(tree.dimensions(), 2);
+
+var queries = [[51.5074, -0.1278], [-33.87, 151.21], [89.9, 10], [0.5, 179.9], [-89.5, -45]];
+queries.forEach(function(q) {
+  var sorted = points.map(function(p, id) { return { id: id, d: distance(q, p) }; })
+                     .sort(function(a, b) { return a.d - b.d; });
+
+  // Nearest by great-circle distance, also across the antimeridian and poles
+  var n = tree.nearest(q[0], q[1]);
+  assert.equal(n[2], sorted[0].id);
+  near(distance(n, points[n[2]]), 0, 1e-6);
+  near(n.distance, sorted[0].d, 1e-3);
+
+  var nn = tree.nearestN(q[0], q[1], 10);
+  for (i = 0; i < 10; i++) {
+    near(nn[i].distance, sorted[i].d, 1e-3);
+  }
+
+  // Ranges in metres find exactly the points within them
+  var range = 800000;
+  var found = tree.nearestRange(q[0], q[1], range);
+  var expected = sorted.filter(function(p) { return p.d <= range; });
+  assert.equal(found.length, expected.length);
+  found.forEach(function(p) {
+    assert.ok(p.distance <= range);
+  });
+  assert.equal(tree.nearestN(new Float64Array(q), 100, { maxDistance: range }).length,
+               Math.min(100, expected.length));
+
+  var count = 0;
+  for (var p of tree.rangeCursor(q[0], q[1], range)) {
+    assert.ok(p.distance <= range);
+    count++;
+  }
+  assert.equal(count, expected.length);
+  assert.equal(tree.nearestCursor(q[0], q[1]).next(1)[0][2], sorted[0].id);
+
+  var sum = expected.reduce(function(total, p) { return total + p.id; }, 0);
+  assert.equal(tree.weightedSum(q[0], q[1], range), sum);
+});
+
+// Batches convert the points found back to latitude and longitude
+var out = new Float64Array(queries.length * 2);
+var ids = tree.nearestBatch(new Float64Array([].concat.apply([], queries)), out);
+for (i = 0; i < queries.length; i++) {
+  near(distance([out[2 * i], out[2 * i + 1]], points[ids[i]]), 0, 1e-6);
+}
+
+// Moved points, snapshots and joins measure in metres too
+tree.update(0, 10, 20);
+near(tree.nearest(10, 20.001).distance, distance([10, 20], [10, 20.001]), 1e-3);
+var snap = tree.snapshot();
+tree.insert(-10, -20, 'new');
+assert.equal(tree.nearestRange(-10, -20, 1).length, 1);
+assert.equal(snap.nearestRange(-10, -20, 1).length, 0);
+near(snap.nearest(10, 20.001).distance, distance([10, 20], [10, 20.001]), 1e-3);
+
+var other = new kd.KDTree(2, { geodesic: true });
+other.insert(10, 20.005);
+var join = kd.KDTree.radiusJoin(tree, other, 1000);
+assert.equal(join.a.length, 1);
+assert.equal(join.a[0], 0);
+assert.throws(function() { kd.KDTree.radiusJoin(tree, new kd.KDTree(2), 1000); });
+
+assert.throws(function() { new kd.KDTree(3, { geodesic: true }); });
+assert.throws(function() { new kd.KDTree(2, { geodesic: true, quantize: 16, min: [-90, -180], max: [90, 180] }); });
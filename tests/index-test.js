@@ -0,0 +1,54 @@
+/**
+ * Test for saving trees to index files and loading them.
+ *
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+var assert = require('assert');
+var fs = require('fs');
+var os = require('os');
+var path = require('path');
+var kd = require('../build/Release/kdtree');
+var file = path.join(os.tmpdir(), 'kdtree-index-test-' + process.pid + '.kd');
+var tree = new kd.KDTree(2);
+var i;
+
+for (i = 0; i < 2000; i++) {
+  tree.insertWith({ tag: i % 2 ? 1 : 2 }, (i * 37) % 101, (i * 53) % 97 + i / 1000, i);
+}
+tree.save(file);
+
+var copy = kd.KDTree.load(file);
+assert.equal(copy.dimensions(), 2);
+assert.equal(copy.stats().size, tree.stats().size);
+
+function coords(points) {
+  return points.map(function(p) { return [p[0], p[1]]; });
+}
+
+for (i = 0; i < 100; i++) {
+  var x = (i * 7919) % 120 - 10, y = (i * 104729) % 110 - 5;
+
+  // Loaded points have coordinates, but no values
+  var n = copy.nearest(x, y);
+  assert.equal(n.length, 2);
+  assert.deepEqual(n, coords([tree.nearest(x, y)])[0]);
+  assert.deepEqual(coords(copy.nearestN(x, y, 5)), coords(tree.nearestN(x, y, 5)));
+  assert.equal(copy.nearestRange(x, y, 6).length, tree.nearestRange(x, y, 6).length);
+
+  // Tags are kept
+  assert.deepEqual(copy.nearest(x, y, { mask: 1 }), coords([tree.nearest(x, y, { mask: 1 })])[0]);
+}
+
+// Points can be added to a loaded tree
+copy.insert(1000, 1000, 'far');
+assert.deepEqual(copy.nearest(999, 999), [1000, 1000, 'far']);
+
+// Files which are not index files are rejected
+fs.writeFileSync(file, 'not an index');
+assert.throws(function() { kd.KDTree.load(file); });
+fs.unlinkSync(file);
+assert.throws(function() { kd.KDTree.load(file); });
@@ -0,0 +1,50 @@
+/**
+ * Test for the dual-tree radius join.
+ *
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+var assert = require('assert');
+var kd = require('../build/Release/kdtree');
+
+var events = new kd.KDTree(2);
+var facilities = new kd.KDTree(2);
+var ev = [], fa = [];
+
+for (var i = 0; i < 400; i++) {
+  ev.push([(i * 7) % 37, (i * 13) % 41]);
+  events.insert(ev[i][0], ev[i][1], "event #" + i);
+}
+for (var i = 0; i < 300; i++) {
+  fa.push([(i * 11) % 43, (i * 5) % 31]);
+  facilities.insert(fa[i][0], fa[i][1]);
+}
+
+// Compare against a brute force join
+var range = 2.5, expected = {}, count = 0;
+for (var i = 0; i < ev.length; i++) {
+  for (var j = 0; j < fa.length; j++) {
+    var dx = ev[i][0] - fa[j][0], dy = ev[i][1] - fa[j][1];
+    if (dx * dx + dy * dy <= range * range) {
+      expected[i + "," + j] = true;
+      count++;
+    }
+  }
+}
+
+var pairs = kd.KDTree.radiusJoin(events, facilities, range);
+assert.ok(pairs.a instanceof Uint32Array);
+assert.equal(pairs.a.length, count);
+assert.equal(pairs.b.length, count);
+for (var i = 0; i < pairs.a.length; i++) {
+  assert.ok(expected[pairs.a[i] + "," + pairs.b[i]],
+            "Unexpected pair " + pairs.a[i] + "," + pairs.b[i]);
+}
+
+// Empty trees and mismatched dimensions
+assert.equal(kd.KDTree.radiusJoin(events, new kd.KDTree(2), range).a.length, 0);
+assert.throws(function() { kd.KDTree.radiusJoin(events, new kd.KDTree(3), range); });
+assert.throws(function() { kd.KDTree.radiusJoin(events, {}, range); });
@@ -0,0 +1,49 @@
+/**
+ * Test for queries limited to a maximum distance.
+ *
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+var assert = require('assert');
+var kd = require('../build/Release/kdtree');
+var i;
+
+function test(tree) {
+  for (i = 0; i < 100; i++) {
+    tree.insert(i % 10, Math.floor(i / 10), i);
+  }
+
+  // Points within range are found as usual
+  assert.deepEqual(tree.nearest(3.2, 4.1, { maxDistance: 1 }), [3, 4, 43]);
+  assert.equal(tree.nearestValue(3.2, 4.1, { maxDistance: 0.3 }), 43);
+  // A point exactly at the limit is found
+  assert.equal(tree.nearestValue(3, 3.5, { maxDistance: 0.5 }), 33);
+
+  // Misses, near the tree and far away from it
+  assert.equal(tree.nearestValue(3.5, 4.5, { maxDistance: 0.5 }), null);
+  assert.equal(tree.nearestValue(100, 100, { maxDistance: 5 }), null);
+  assert.equal(tree.nearestPoint(100, 100, new Float64Array(2), { maxDistance: 5 }), 0);
+  assert.deepEqual(tree.nearestValues(-10, 0, { maxDistance: 5 }), []);
+
+  // nearestN returns only the points within range
+  assert.deepEqual(tree.nearestN(0, 0, 5, { maxDistance: 1 }).map(function(p) { return p[2]; }).sort(),
+                   [0, 1, 10]);
+  assert.equal(tree.nearestN(0, 0, 5, { maxDistance: 3 }).length, 5);
+  assert.equal(tree.nearestN(-5, -5, 5, { maxDistance: 3 }).length, 0);
+
+  // nearestRange uses the smaller of both limits
+  assert.equal(tree.nearestRange(5, 5, 2, { maxDistance: 1 }).length, 5);
+  assert.equal(tree.nearestRange(5, 5, 1, { maxDistance: 2 }).length, 5);
+
+  // Inserting a point in range changes the result of a miss
+  assert.equal(tree.nearestValue(20, 20, { maxDistance: 2 }), null);
+  tree.insert(19, 19, "new");
+  assert.equal(tree.nearestValue(20, 20, { maxDistance: 2 }), "new");
+  assert.equal(tree.nearestValue(20, 20, { maxDistance: 1 }), null);
+}
+
+test(new kd.KDTree(2));
+test(new kd.KDTree(2, { cacheSize: 100 }));
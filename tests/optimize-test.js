@@ -0,0 +1,35 @@
+/**
+ * Test for the cache-friendly node layout of optimize().
+ *
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+var assert = require('assert');
+var kd = require('../build/Release/kdtree');
+var tree = new kd.KDTree(2);
+var i;
+
+for (i = 0; i < 1000; i++) {
+  tree.insert(i % 37, Math.floor(i / 37), i);
+}
+var before = tree.stats();
+var expected = [tree.nearest(10.2, 3.9), tree.nearestN(5, 5, 4), tree.nearestRange(20, 20, 2)];
+
+// The layout changes, but not the tree or the results of queries
+tree.optimize();
+assert.deepEqual(tree.stats(), before);
+assert.deepEqual([tree.nearest(10.2, 3.9), tree.nearestN(5, 5, 4), tree.nearestRange(20, 20, 2)], expected);
+
+// Inserts after optimizing, and optimizing again
+tree.insert(10.2, 3.9, "new");
+assert.deepEqual(tree.nearest(10.2, 3.9), [10.2, 3.9, "new"]);
+tree.optimize();
+assert.deepEqual(tree.nearest(10.2, 3.9), [10.2, 3.9, "new"]);
+
+// Snapshots would see nodes move
+var snap = tree.snapshot();
+assert.throws(function() { tree.optimize(); });
+assert.throws(function() { snap.optimize(); });
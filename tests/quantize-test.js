@@ -0,0 +1,42 @@
+/**
+ * Test for trees with quantized coordinates.
+ *
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+var assert = require('assert');
+var kd = require('../build/Release/kdtree');
+
+var plain = new kd.KDTree(2);
+var tree = new kd.KDTree(2, { quantize: 32, min: [-180, -90], max: [180, 90] });
+var small = new kd.KDTree(2, { quantize: 16, min: [0, 0], max: [100, 100] });
+var i;
+
+for (i = 0; i < 1000; i++) {
+  plain.insert(i % 360 - 180, i % 180 - 90, i);
+  tree.insert(i % 360 - 180, i % 180 - 90, i);
+}
+
+// Coordinates are rounded to the nearest step of the box
+tree.insert(12.3456789, 45.6789012, "rounded");
+var p = tree.nearest(12.3, 45.6);
+assert.equal(p[2], "rounded");
+assert.ok(Math.abs(p[0] - 12.3456789) < 1e-7 && Math.abs(p[1] - 45.6789012) < 1e-7);
+assert.deepEqual(tree.nearestN(0.3, 0.2, 3).map(function(r) { return r[2]; }),
+                 plain.nearestN(0.3, 0.2, 3).map(function(r) { return r[2]; }));
+assert.equal(tree.nearestRange(0.3, 0.2, 50).length, plain.nearestRange(0.3, 0.2, 50).length);
+assert.ok(tree.stats().nativeBytes < plain.stats().nativeBytes);
+
+// Points outside of the box are clamped to it
+small.insert(150, -5, "outside");
+p = small.nearest(100, 0);
+assert.ok(Math.abs(p[0] - 100) < 1e-9 && p[1] == 0 && p[2] == "outside");
+small.insert(33.33, 66.66, "inside");
+p = small.nearest(33, 67);
+assert.ok(Math.abs(p[0] - 33.33) < 1e-3 && Math.abs(p[1] - 66.66) < 1e-3);
+
+assert.throws(function() { new kd.KDTree(2, { quantize: 8, min: [0, 0], max: [1, 1] }); });
+assert.throws(function() { new kd.KDTree(2, { quantize: 16, min: [0], max: [1, 1] }); });
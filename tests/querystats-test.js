@@ -0,0 +1,79 @@
+/**
+ * Test for the statistics gathered over the queries of a tree.
+ *
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+var assert = require('assert');
+var kd = require('../build/Release/kdtree');
+var tree = new kd.KDTree(2);
+var x, y;
+
+for (x = 0; x < 32; x++) {
+  for (y = 0; y < 32; y++) {
+    tree.insert((x * 7) % 32, (y * 13) % 32, x * 32 + y);
+  }
+}
+
+var stats = tree.queryStats();
+
+// Without KD_STATS, see "make kdtree-stats", there is nothing to gather
+if (stats === null) {
+  assert.strictEqual(tree.queryStats(true), null);
+  assert.equal(tree.nearest(10.2, 20.7).length, 3);
+  return;
+}
+
+// Inserts are not queries
+assert.equal(stats.queries, 0);
+assert.equal(stats.nodesVisited, 0);
+assert.equal(stats.nodesHistogram.length, 32);
+assert.equal(stats.latencyHistogram.length, 32);
+
+function sum(histogram) {
+  return histogram.reduce(function(total, n) { return total + n; }, 0);
+}
+
+// A search visits a part of the tree, and skips the subtrees too far away
+tree.nearest(10.2, 20.7);
+stats = tree.queryStats();
+assert.equal(stats.queries, 1);
+assert.equal(stats.results, 1);
+assert.ok(stats.nodesVisited > 0 && stats.nodesVisited < tree.stats().size);
+assert.ok(stats.distanceEvaluations > 0);
+assert.ok(stats.pruned > 0);
+assert.ok(stats.timeUs >= 0);
+assert.equal(sum(stats.nodesHistogram), 1);
+assert.equal(sum(stats.latencyHistogram), 1);
+
+// Results add up over the queries
+var found = tree.nearestRange(10.2, 20.7, 2).length;
+assert.equal(tree.nearestN(10.2, 20.7, 5).length, 5);
+stats = tree.queryStats();
+assert.equal(stats.queries, 3);
+assert.equal(stats.results, 1 + found + 5);
+assert.equal(sum(stats.nodesHistogram), 3);
+assert.equal(sum(stats.latencyHistogram), 3);
+
+// A query which finds nothing still counts
+tree.nearestRange(100, 100, 1);
+assert.equal(tree.queryStats().queries, 4);
+assert.equal(tree.queryStats().results, 1 + found + 5);
+
+// Reading with true returns the statistics so far, then starts over
+assert.equal(tree.queryStats(true).queries, 4);
+stats = tree.queryStats();
+assert.equal(stats.queries, 0);
+assert.equal(stats.results, 0);
+assert.equal(stats.timeUs, 0);
+assert.equal(sum(stats.nodesHistogram), 0);
+
+// Each tree gathers its own
+var other = new kd.KDTree(2);
+other.insert(1, 1);
+other.nearest(0, 0);
+assert.equal(other.queryStats().queries, 1);
+assert.equal(tree.queryStats().queries, 0);
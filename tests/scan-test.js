@@ -0,0 +1,65 @@
+/**
+ * Test for searches by linear scan.
+ *
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+var assert = require('assert');
+var kd = require('../build/Release/kdtree');
+var DIM = 20;
+var points = [], i, j;
+
+for (i = 0; i < 500; i++) {
+  var p = [];
+  for (j = 0; j < DIM; j++) {
+    p.push(((i * 7919 + j * 104729) % 1009) / 1009 + i / 1e6);
+  }
+  points.push(p);
+}
+
+function dist(a, b) {
+  var d = 0;
+  for (var k = 0; k < DIM; k++) {
+    d += (a[k] - b[k]) * (a[k] - b[k]);
+  }
+  return Math.sqrt(d);
+}
+
+function ids(results) {
+  return results.map(function(r) { return r[DIM]; }).sort(function(a, b) { return a - b; });
+}
+
+['auto', 'always', 'never'].forEach(function(scan) {
+  var tree = new kd.KDTree(DIM, { scan: scan });
+  points.forEach(function(p, i) {
+    tree.insertWith.apply(tree, [{ tag: i % 2 ? 1 : 2 }].concat(p, [i]));
+  });
+
+  for (i = 0; i < 50; i++) {
+    var q = points[(i * 37) % points.length].map(function(x, k) { return x + ((i + k) % 5) / 50; });
+    var best = -1, range = [], oddRange = [];
+
+    points.forEach(function(p, k) {
+      var d = dist(p, q);
+      if (best == -1 || d < dist(points[best], q)) best = k;
+      if (d <= 0.8) {
+        range.push(k);
+        if (k % 2) oddRange.push(k);
+      }
+    });
+
+    assert.equal(tree.nearest.apply(tree, q)[DIM], best);
+    assert.deepEqual(ids(tree.nearestRange.apply(tree, q.concat([0.8]))), range);
+    assert.deepEqual(ids(tree.nearestRange.apply(tree, q.concat([0.8, { mask: 1 }]))), oddRange);
+  }
+
+  // Moved points are found at their new place
+  var moved = points[0].map(function(x) { return x + 5; });
+  tree.update.apply(tree, [3].concat(moved));
+  assert.equal(tree.nearest.apply(tree, moved)[DIM], 3);
+});
+
+assert.throws(function() { new kd.KDTree(2, { scan: 'sometimes' }); });
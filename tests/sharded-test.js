@@ -0,0 +1,57 @@
+/**
+ * Test for the sharded index.
+ *
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+var assert = require('assert');
+var kd = require('../build/Release/kdtree');
+var n = 5000, i;
+
+var points = new Float64Array(2 * n), values = [];
+for (i = 0; i < n; i++) {
+  points[2 * i] = (i * 37) % 101;
+  points[2 * i + 1] = (i * 53) % 97 + Math.sqrt(i) / 100;
+  values.push(i);
+}
+
+function test(index) {
+  var tree = new kd.KDTree(2);
+  for (i = 0; i < n; i++) {
+    tree.insert(points[2 * i], points[2 * i + 1], i);
+  }
+
+  assert.equal(index.insertBatch(points.subarray(0, 2 * (n - 10)), values.slice(0, n - 10)), n - 10);
+  for (i = n - 10; i < n; i++) {
+    assert.equal(index.insert(points[2 * i], points[2 * i + 1], i), true);
+  }
+  assert.equal(index.size(), n);
+  assert.equal(index.shardSizes().reduce(function(a, b) { return a + b; }), n);
+
+  // The same results as a single tree
+  for (i = 0; i < 200; i++) {
+    var x = (i * 7) % 120 - 10, y = (i * 11) % 110 - 5;
+    assert.deepEqual(index.nearest(x, y), tree.nearest(x, y));
+    assert.deepEqual(index.nearestN(x, y, 5), tree.nearestN(x, y, 5));
+    var sorted = function(a, b) { return a[2] - b[2]; };
+    assert.deepEqual(index.nearestRange(x, y, 4).sort(sorted), tree.nearestRange(x, y, 4).sort(sorted));
+  }
+}
+
+test(new kd.ShardedKDTree(2, { shards: 8, sample: points.subarray(0, 2000) }));
+test(new kd.ShardedKDTree(2, { shards: 3, min: [0, 0], max: [50, 50] }));
+
+var empty = new kd.ShardedKDTree(2, { min: [0, 0], max: [1, 1] });
+assert.equal(empty.nearest(1, 1).length, 3);
+assert.equal(empty.nearest(1, 1)[0], undefined);
+assert.equal(empty.shardSizes().length, 4);
+
+assert.throws(function() { new kd.ShardedKDTree(2); });
+assert.throws(function() { new kd.ShardedKDTree(2, { shards: 4, sample: [1, 2] }); });
+assert.throws(function() { new kd.ShardedKDTree(2, { min: [0], max: [1, 1] }); });
+var index = new kd.ShardedKDTree(2, { sample: points });
+assert.throws(function() { index.insertBatch(new Float64Array(3)); });
+assert.throws(function() { index.insertBatch(new Float64Array(4), [1]); });
@@ -0,0 +1,52 @@
+/**
+ * Test for sharing a tree across worker threads.
+ *
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+var assert = require('assert');
+var threads = require('worker_threads');
+var kd = require('../build/Release/kdtree');
+
+if (!threads.isMainThread) {
+  // Query and insert into the tree shared by the main thread
+  var shared = kd.KDTree.attach(threads.workerData);
+  assert.deepEqual(shared.nearest(1, 1), [0, 0]);
+  assert.throws(function() { shared.insert(3, 3, "value"); });
+  for (var i = 0; i < 1000; i++) {
+    shared.insert(100 + i, 100 + i);
+    shared.nearest(i, i);
+  }
+  threads.parentPort.postMessage(shared.nearestN(0, 0, 2));
+  return;
+}
+
+var tree = new kd.KDTree(2);
+tree.insert(0, 0, "origin");
+tree.insert(10, 10, "far");
+
+// Trees with snapshots can not be shared, nor can shared trees take snapshots
+var other = new kd.KDTree(2);
+var snap = other.snapshot();
+assert.throws(function() { other.share(); });
+assert.throws(function() { snap.share(); });
+
+var id = tree.share();
+assert.equal(tree.share(), id);
+assert.throws(function() { tree.snapshot(); });
+assert.throws(function() { kd.KDTree.attach(id + 1000); });
+
+var pending = 4;
+for (var w = 0; w < 4; w++) {
+  new threads.Worker(__filename, { workerData: id }).on('message', function(msg) {
+    assert.deepEqual(msg, [[0, 0], [10, 10]]);
+    if (--pending == 0) {
+      // The owner still sees its values and every point the workers inserted
+      assert.deepEqual(tree.nearest(1, 1), [0, 0, "origin"]);
+      assert.equal(tree.stats().size, 4002);
+    }
+  });
+}
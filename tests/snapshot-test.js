@@ -0,0 +1,37 @@
+/**
+ * Test for read-only tree snapshots.
+ *
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+var assert = require('assert');
+var kd = require('../build/Release/kdtree');
+var tree = new kd.KDTree(2);
+
+tree.insert(0, 0, "origin");
+tree.insert(10, 10, "far");
+var snap = tree.snapshot();
+
+// Points inserted after the snapshot are only seen by the tree
+tree.insert(1, 1, "near");
+assert.deepEqual(tree.nearest(2, 2), [1, 1, "near"]);
+assert.deepEqual(snap.nearest(2, 2), [0, 0, "origin"]);
+assert.deepEqual(snap.nearestN(2, 2, 5), [[0, 0, "origin"], [10, 10, "far"]]);
+assert.equal(snap.nearestRange(0, 0, 2).length, 1);
+assert.equal(snap.stats().size, 2);
+assert.equal(snap.dimensions(), 2);
+
+// Snapshots are read-only
+assert.throws(function() { snap.insert(5, 5); });
+
+// Snapshots of snapshots see the same points
+var snap2 = snap.snapshot();
+assert.deepEqual(snap2.nearest(2, 2), [0, 0, "origin"]);
+
+// A snapshot keeps its points after the tree is dropped
+tree = null;
+if (global.gc) global.gc();
+assert.deepEqual(snap.nearest(9, 9), [10, 10, "far"]);
@@ -0,0 +1,65 @@
+/**
+ * Test for the split policies of rebuild().
+ *
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+var assert = require('assert');
+var kd = require('../build/Release/kdtree');
+var points = [], i;
+
+// Wide in the first coordinate and narrow in the second
+for (i = 0; i < 2000; i++) {
+  points.push([(i * 7919) % 3600 / 10 - 180 + Math.sqrt(i) / 1000, ((i * 104729) % 997) / 997]);
+}
+
+function nearest(x, y) {
+  var best = null, bestDist = Infinity;
+  points.forEach(function(p) {
+    var d = (p[0] - x) * (p[0] - x) + (p[1] - y) * (p[1] - y);
+    if (d < bestDist) {
+      best = p;
+      bestDist = d;
+    }
+  });
+  return best;
+}
+
+function sorted(results) {
+  return results.map(function(p) { return p[2]; }).sort(function(a, b) { return a - b; });
+}
+
+['cycle', 'spread', 'variance', 'midpoint'].forEach(function(split) {
+  var tree = new kd.KDTree(2, { split: split });
+  points.forEach(function(p, i) { tree.insert(p[0], p[1], i); });
+  var range = sorted(tree.nearestRange(10, 0.5, 3));
+
+  tree.rebuild();
+  assert.equal(tree.stats().size, points.length);
+  assert.deepEqual(sorted(tree.nearestRange(10, 0.5, 3)), range);
+  for (i = 0; i < 200; i++) {
+    var x = (i * 31) % 360 - 180.5, y = (i % 10) / 9;
+    var n = tree.nearest(x, y);
+    assert.deepEqual(n.slice(0, 2), nearest(x, y));
+  }
+
+  // Inserts into a rebuilt tree
+  tree.insert(0.123, 0.456, 'new');
+  assert.deepEqual(tree.nearest(0.123, 0.456), [0.123, 0.456, 'new']);
+});
+
+// The policy can be changed by rebuild()
+var tree = new kd.KDTree(2);
+points.forEach(function(p, i) { tree.insert(p[0], p[1], i); });
+tree.rebuild({ split: 'midpoint' });
+assert.deepEqual(tree.nearest(100, 0.5).slice(0, 2), nearest(100, 0.5));
+
+// Unknown policies and snapshots are rejected
+assert.throws(function() { new kd.KDTree(2, { split: 'median' }); });
+assert.throws(function() { tree.rebuild({ split: 1 }); });
+var snap = tree.snapshot();
+assert.throws(function() { snap.rebuild(); });
+assert.throws(function() { tree.rebuild(); });
@@ -0,0 +1,34 @@
+/**
+ * Test for tree shape and memory statistics.
+ *
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+var assert = require('assert');
+var kd = require('../build/Release/kdtree');
+var tree = new kd.KDTree(2);
+
+var empty = tree.stats();
+assert.equal(empty.size, 0);
+assert.equal(empty.maxDepth, 0);
+assert.ok(empty.nativeBytes > 0);
+
+// Sorted inserts along one axis make a degenerate tree
+for (var i = 0; i < 8; i++) {
+  tree.insert(i, 0, "value " + i);
+}
+var stats = tree.stats();
+assert.equal(stats.size, 8);
+assert.equal(stats.maxDepth, 8);
+assert.equal(stats.avgDepth, 4.5);
+assert.equal(stats.balance, 4 / 8);
+assert.ok(stats.nativeBytes > empty.nativeBytes);
+
+// A balanced insertion order
+var balanced = new kd.KDTree(1);
+[4, 2, 6, 1, 3, 5, 7].forEach(function(x) { balanced.insert(x); });
+assert.equal(balanced.stats().maxDepth, 3);
+assert.equal(balanced.stats().balance, 1);
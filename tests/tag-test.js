@@ -0,0 +1,45 @@
+/**
+ * Test for queries filtered by the tags of points.
+ *
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+var assert = require('assert');
+var kd = require('../build/Release/kdtree');
+var tree = new kd.KDTree(2);
+var RESTAURANT = 1, SHOP = 2, MUSEUM = 4;
+var i;
+
+for (i = 0; i < 1000; i++) {
+  tree.insertWith({ tag: i % 2 ? RESTAURANT : SHOP }, i % 40, Math.floor(i / 40), i);
+}
+tree.insertWith({ tag: MUSEUM }, 30, 20, "museum");
+tree.insert(0.5, 0.5, "untagged");
+
+// Without a mask every point is found
+assert.deepEqual(tree.nearest(0.4, 0.4), [0.5, 0.5, "untagged"]);
+assert.deepEqual(tree.nearest(0.4, 0.4, {}), [0.5, 0.5, "untagged"]);
+
+assert.deepEqual(tree.nearest(0, 0, { mask: RESTAURANT }), [1, 0, 1]);
+assert.deepEqual(tree.nearest(0, 0, { mask: SHOP }), [0, 0, 0]);
+assert.deepEqual(tree.nearest(0, 0, { mask: MUSEUM }), [30, 20, "museum"]);
+assert.equal(tree.nearestValue(30, 20.1, { mask: MUSEUM | RESTAURANT }), "museum");
+assert.deepEqual(tree.nearestValues(0, 0, { mask: MUSEUM }), ["museum"]);
+
+var shops = tree.nearestRange(10, 10, 3, { mask: SHOP });
+assert.ok(shops.length > 0);
+shops.forEach(function(p) { assert.equal(p[2] % 2, 0); });
+assert.equal(shops.length + tree.nearestRange(10, 10, 3, { mask: RESTAURANT }).length,
+             tree.nearestRange(10, 10, 3).length);
+
+var knn = tree.nearestN(20, 20, 5, { mask: RESTAURANT });
+assert.equal(knn.length, 5);
+knn.forEach(function(p) { assert.equal(p[2] % 2, 1); });
+
+// No point matches
+assert.deepEqual(tree.nearestN(0, 0, 5, { mask: 8 }), []);
+assert.deepEqual(tree.nearestValues(0, 0, { mask: 8 }), []);
+assert.equal(tree.nearestValue(0, 0, { mask: 8 }), null);
@@ -0,0 +1,57 @@
+/**
+ * Test for queries taking their point from, and writing their results to,
+ * Float64Arrays.
+ *
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+var assert = require('assert');
+var kd = require('../build/Release/kdtree');
+var tree = new kd.KDTree(3);
+var q = new Float64Array(3);
+var out = new Float64Array(3 * 4);
+var i;
+
+for (i = 0; i < 10; i++) {
+  tree.insert(new Float64Array([i, 0, 0]), "v" + i);
+}
+tree.insert(new Float64Array([0, 5, 0]));
+assert.throws(function() { tree.insert(new Float64Array([1, 2])); });
+assert.throws(function() { tree.insert(new Float64Array([1, 2]), "short"); });
+
+q[0] = 3.2;
+assert.deepEqual(tree.nearest(q), [3, 0, 0, "v3"]);
+assert.deepEqual(tree.nearestPoint(q), [3, 0, 0]);
+assert.equal(tree.nearestPoint(q).length, 3);
+assert.equal(tree.nearestValue(q), "v3");
+assert.deepEqual(tree.nearestValues(q), ["v3"]);
+assert.deepEqual(tree.nearestN(q, 1), [[3, 0, 0, "v3"]]);
+assert.equal(tree.nearestRange(q, 1.5).length, 3);
+
+// Results written to an output array
+assert.equal(tree.nearestPoint(q, out), 1);
+assert.deepEqual(Array.prototype.slice.call(out, 0, 3), [3, 0, 0]);
+assert.equal(tree.nearestPoint(0.2, 4.9, 0, out), 1);
+assert.deepEqual(Array.prototype.slice.call(out, 0, 3), [0, 5, 0]);
+
+assert.equal(tree.nearestN(q, 2, out), 2);
+assert.deepEqual(Array.prototype.slice.call(out, 0, 6), [3, 0, 0, 4, 0, 0]);
+
+// Only as many points as fit are written, all of them are counted
+out.fill(-1);
+assert.equal(tree.nearestRange(q, 10, out), 11);
+for (i = 0; i < 4; i++) {
+  assert.equal(out[i * 3 + 1] + out[i * 3 + 2] >= 0, true);
+}
+
+// Options still come last
+tree.insertWith({ tag: 2 }, new Float64Array([3, 0, 1]), "tagged");
+assert.deepEqual(tree.nearest(q, { mask: 2 }), [3, 0, 1, "tagged"]);
+assert.equal(tree.nearestPoint(q, out, { mask: 2 }), 1);
+assert.equal(out[2], 1);
+assert.equal(tree.nearestPoint(q, out, { mask: 8 }), 0);
+
+assert.throws(function() { tree.nearestPoint(q, new Float64Array(2)); });
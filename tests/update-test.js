@@ -0,0 +1,50 @@
+/**
+ * Test for moving points.
+ *
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+var assert = require('assert');
+var kd = require('../build/Release/kdtree');
+var tree = new kd.KDTree(2);
+var pos = [];
+var i, j;
+
+for (i = 0; i < 500; i++) {
+  pos.push([i % 25, Math.floor(i / 25)]);
+  assert.strictEqual(tree.insert(pos[i][0], pos[i][1], "car " + i), i);
+}
+
+// Small moves, and moves across the tree
+for (i = 0; i < 2000; i++) {
+  var id = (i * 7919) % 500;
+  if (i % 5 == 0) {
+    pos[id] = [(i * 13) % 25 + 0.5, (i * 17) % 20 + 0.5];
+  } else {
+    pos[id] = [pos[id][0] + 0.01 * (i % 3 - 1), pos[id][1] + 0.01 * (i % 2)];
+  }
+  assert.equal(tree.update(id, pos[id][0], pos[id][1]), true);
+}
+
+for (i = 0; i < 500; i += 7) {
+  assert.deepEqual(tree.nearest(pos[i][0], pos[i][1]), [pos[i][0], pos[i][1], "car " + i]);
+}
+var found = tree.nearestRange(12, 10, 3).map(function(p) { return p[2]; }).sort();
+var expected = [];
+for (i = 0; i < 500; i++) {
+  var dx = pos[i][0] - 12, dy = pos[i][1] - 10;
+  if (dx * dx + dy * dy <= 9) expected.push("car " + i);
+}
+assert.deepEqual(found, expected.sort());
+
+assert.equal(tree.update(0, new Float64Array([100, 100])), true);
+assert.deepEqual(tree.nearest(99, 99), [100, 100, "car 0"]);
+assert.equal(tree.update(500, 1, 1), false);
+assert.throws(function() { tree.update(1, 1); });
+
+var snap = tree.snapshot();
+assert.throws(function() { tree.update(1, 1, 1); });
+assert.throws(function() { snap.update(1, 1, 1); });
@@ -0,0 +1,244 @@
+/**
+ * Offline index builder for the kdtree library.
+ *
+ * Reads points from a CSV file or a file of raw doubles, builds a balanced
+ * tree from them and writes it to an index file, which KDTree.load() reads
+ * without building the tree again. Prints the build time and shape of the
+ * tree as one line of JSON. The points are not streamed: kd_build needs all
+ * of them at once, so the input has to fit in memory.
+ *
+ * This file is part of node-kdtree, a node.js Addon for working with kd-trees.
+ * Copyright (C) 2011 Justin Ethier <justinethier@github>
+ *
+ * Please use github to submit patches and bug reports:
+ * https://github.com/justinethier/node-kdtree
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "kdtree.h"
+
+#define MAX_LINE		4096	/* longest CSV line */
+#define READ_CHUNK		4096	/* points read at once from binary files */
+
+/* the coordinates read so far, "n" points of "dim" doubles each */
+struct points {
+	double *pos;
+	int dim, n, cap;
+};
+
+/* processor time, which is portable, and close to wall time for a single
+ * threaded tool */
+static double now_us(void)
+{
+	return clock() * (1e6 / CLOCKS_PER_SEC);
+}
+
+/* makes room for "more" points */
+static int points_grow(struct points *pts, int more)
+{
+	double *pos;
+	int cap = pts->cap ? pts->cap : 1024;
+
+	while(cap - pts->n < more) {
+		cap *= 2;
+	}
+	if(cap == pts->cap) {
+		return 0;
+	}
+	if(!(pos = realloc(pts->pos, (size_t)cap * pts->dim * sizeof *pos))) {
+		return -1;
+	}
+	pts->pos = pos;
+	pts->cap = cap;
+	return 0;
+}
+
+/* reads the numbers of a CSV line, returns their number or -1 if a field
+ * is not a number */
+static int parse_line(char *line, double *vals, int max)
+{
+	char *s = line, *end;
+	int n = 0;
+
+	while(*s && *s != '\n' && *s != '\r') {
+		if(n == max) {
+			return n;
+		}
+		vals[n] = strtod(s, &end);
+		if(end == s) {
+			return -1;
+		}
+		n++;
+		for(s = end; *s == ' ' || *s == '\t'; s++);
+		if(*s == ',' || *s == ';') {
+			s++;
+		} else if(*s && *s != '\n' && *s != '\r') {
+			return -1;
+		}
+	}
+	return n;
+}
+
+/* reads points from a CSV file, one per line, skipping empty lines and a
+ * header. Without "dim", each line holds as many coordinates as the first
+ * one; otherwise the first "dim" fields of each line are read. */
+static int read_csv(FILE *fp, struct points *pts, const char *name)
+{
+	char line[MAX_LINE];
+	double vals[256];
+	int n, lineno = 0;
+
+	while(fgets(line, sizeof line, fp)) {
+		lineno++;
+		if(!strchr(line, '\n') && !feof(fp)) {
+			fprintf(stderr, "%s:%d: line too long\n", name, lineno);
+			return -1;
+		}
+		if(line[strspn(line, " \t\r\n")] == 0) {
+			continue;
+		}
+		n = parse_line(line, vals, pts->dim ? pts->dim : 256);
+		if(n == -1 && lineno == 1) {
+			continue;
+		}
+		if(n == -1 || (pts->dim && n < pts->dim)) {
+			fprintf(stderr, "%s:%d: expected %d numbers\n", name, lineno, pts->dim);
+			return -1;
+		}
+		if(!pts->dim) {
+			pts->dim = n;
+		}
+		if(points_grow(pts, 1) == -1) {
+			fprintf(stderr, "out of memory\n");
+			return -1;
+		}
+		memcpy(pts->pos + (size_t)pts->n * pts->dim, vals, pts->dim * sizeof *vals);
+		pts->n++;
+	}
+	if(ferror(fp)) {
+		perror(name);
+		return -1;
+	}
+	return 0;
+}
+
+/* reads points from a file of raw doubles in the byte order of the machine */
+static int read_binary(FILE *fp, struct points *pts, const char *name)
+{
+	size_t got;
+
+	for(;;) {
+		if(points_grow(pts, READ_CHUNK) == -1) {
+			fprintf(stderr, "out of memory\n");
+			return -1;
+		}
+		got = fread(pts->pos + (size_t)pts->n * pts->dim, sizeof(double) * pts->dim, READ_CHUNK, fp);
+		pts->n += (int)got;
+		if(got < READ_CHUNK) {
+			break;
+		}
+	}
+	if(ferror(fp)) {
+		perror(name);
+		return -1;
+	}
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-d dim] [-f csv|bin] [-s split] -o index [input]\n", prog);
+	fprintf(stderr, "  -d  dimensions of the points; required for binary input, otherwise\n");
+	fprintf(stderr, "      taken from the first line of the CSV file\n");
+	fprintf(stderr, "  -f  input format: csv (default), or bin for raw doubles\n");
+	fprintf(stderr, "  -s  split policy: cycle (default), spread, variance or midpoint\n");
+	fprintf(stderr, "  -o  index file to write\n");
+	fprintf(stderr, "  input  file to read, or standard input if missing or -\n");
+	fprintf(stderr, "All points are held in memory while the tree is built, which takes\n");
+	fprintf(stderr, "about twice the size of the points as raw doubles, plus the nodes.\n");
+}
+
+int main(int argc, char **argv)
+{
+	static const char *splits[] = {"cycle", "spread", "variance", "midpoint"};
+	const char *in_name = "-", *out_name = 0, *format = "csv";
+	struct points pts;
+	struct kdtree *kd;
+	struct kdinfo info;
+	FILE *in = stdin, *out;
+	double t0, t_read, t_build;
+	int i, ret, split = KD_SPLIT_CYCLE;
+
+	memset(&pts, 0, sizeof pts);
+	for(i=1; i<argc; i++) {
+		if(i + 1 < argc && strcmp(argv[i], "-d") == 0) {
+			pts.dim = atoi(argv[++i]);
+		} else if(i + 1 < argc && strcmp(argv[i], "-f") == 0) {
+			format = argv[++i];
+		} else if(i + 1 < argc && strcmp(argv[i], "-s") == 0) {
+			for(split=KD_SPLIT_MIDPOINT; split>=0 && strcmp(argv[i + 1], splits[split]) != 0; split--);
+			if(split < 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			i++;
+		} else if(i + 1 < argc && strcmp(argv[i], "-o") == 0) {
+			out_name = argv[++i];
+		} else if(argv[i][0] != '-' || strcmp(argv[i], "-") == 0) {
+			in_name = argv[i];
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if(!out_name || pts.dim < 0 || pts.dim > 256 ||
+			(strcmp(format, "csv") != 0 && (strcmp(format, "bin") != 0 || pts.dim == 0))) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if(strcmp(in_name, "-") != 0 && !(in = fopen(in_name, strcmp(format, "bin") == 0 ? "rb" : "r"))) {
+		perror(in_name);
+		return 1;
+	}
+	t0 = now_us();
+	ret = strcmp(format, "bin") == 0 ? read_binary(in, &pts, in_name) : read_csv(in, &pts, in_name);
+	if(in != stdin) {
+		fclose(in);
+	}
+	if(ret == -1) {
+		return 1;
+	}
+	if(pts.n == 0) {
+		fprintf(stderr, "%s: no points\n", in_name);
+		return 1;
+	}
+	t_read = now_us();
+
+	if(!(kd = kd_create(pts.dim)) || kd_split(kd, split) == -1 || kd_build(kd, pts.pos, 0, pts.n) == -1) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	free(pts.pos);
+	t_build = now_us();
+
+	if(!(out = fopen(out_name, "wb"))) {
+		perror(out_name);
+		return 1;
+	}
+	if(kd_save(kd, out) == -1 || fclose(out) != 0) {
+		fprintf(stderr, "%s: write error\n", out_name);
+		remove(out_name);
+		return 1;
+	}
+
+	kd_info(kd, &info);
+	printf("{\"points\":%d,\"dim\":%d,\"read_ms\":%.3f,\"build_ms\":%.3f,\"write_ms\":%.3f", pts.n, pts.dim,
+			(t_read - t0) / 1e3, (t_build - t_read) / 1e3, (now_us() - t_build) / 1e3);
+	printf(",\"max_depth\":%d,\"avg_depth\":%.2f,\"balance\":%.3f,\"mem_bytes\":%lu}\n",
+			info.max_depth, info.avg_depth, info.balance, (unsigned long)info.mem);
+	kd_free(kd);
+	return 0;
+}